@@ -156,10 +156,16 @@ function main_dll(t)
         local dir = "samples/" .. sn
         folder {dir}
         removefiles {dir .. "/host.c"}
-        links {"Foundation.framework", "QuartzCore.framework", "Metal.framework"}
         cppdialect "C++17"
-        removeplatforms { "x64", "Linux" }
-        includedirs { "", lib_path("metal-cpp-2020-11-macosx/include") }
+        removeplatforms { "x64" }
+        filter { "platforms:MacOSX-x64 or MacOSX-ARM" }
+            links {"Foundation.framework", "QuartzCore.framework", "Metal.framework"}
+            includedirs { lib_path("metal-cpp-2020-11-macosx/include") }
+        -- No Metal on Linux, the CPU backend in `cpu_adder.cpp` is used instead.
+        filter { "platforms:Linux" }
+            removefiles {dir .. "/metal_adder.cpp"}
+            linkoptions {"-pthread"}
+        filter {}
         copy_shaders_to_data_dir()
 end
 
@@ -186,10 +192,14 @@ function main_exe(t, copy_data)
                 '{MKDIR} ../../bin/%{cfg.buildcfg}/plugins', 
                 '{MKDIR} ../../bin/%{cfg.buildcfg}/data/shaders', 
             }
-            filter { "platforms:Linux or MacOSX-x64 or MacOSX-ARM" }
+            filter { "platforms:MacOSX-x64 or MacOSX-ARM" }
                 postbuildcommands {
                     '{COPY} "${TM_SDK_DIR}/bin/Debug/plugins/libtm_os_window.dylib" ../../bin/%{cfg.buildcfg}/plugins',
                 }
+            filter { "platforms:Linux" }
+                postbuildcommands {
+                    '{COPY} "${TM_SDK_DIR}/bin/Debug/plugins/libtm_os_window.so" ../../bin/%{cfg.buildcfg}/plugins',
+                }
             filter {}
         end
 end
@@ -210,20 +220,29 @@ workspace "metal-samples"
 filter { "system:macosx" }
     platforms { "MacOSX-x64", "MacOSX-ARM" }
 
+filter { "system:linux" }
+    platforms { "Linux" }
+
+-- x64 builds only assume SSE2. The CPU kernels compile their AVX2 and AVX-512 variants with target
+-- attributes and pick one at runtime, so one binary runs on any x64 CPU.
 filter {"platforms:MacOSX-x64"}
     architecture "x64"
-    defines {"TM_CPU_X64", "TM_CPU_AVX", "TM_CPU_SSE"}
-    buildoptions {
-        "-mavx",                            -- AVX.
-        "-mfma"                             -- FMA.
-    }
+    defines {"TM_CPU_X64", "TM_CPU_SSE"}
 
 filter {"platforms:MacOSX-ARM"}
     architecture "ARM"
     defines {"TM_CPU_ARM", "TM_CPU_NEON"}
 
+filter {"platforms:Linux"}
+    system "linux"
+    architecture "x64"
+    toolset "clang"
+    defines {"TM_OS_LINUX", "TM_OS_POSIX", "TM_CPU_X64", "TM_CPU_SSE"}
+
 filter { "platforms:MacOSX-x64 or MacOSX-ARM" }
     defines { "TM_OS_MACOSX", "TM_OS_POSIX", "TM_NO_MAIN_FIBER" }
+
+filter { "platforms:Linux or MacOSX-x64 or MacOSX-ARM" }
     includedirs { "$(TM_SDK_DIR)" }
     libdirs { "$(TM_SDK_DIR)/bin/Debug" }
     buildoptions {
@@ -261,3 +280,12 @@ filter "configurations:Release"
 main_dll {name = "performing-calculations-on-gpu"}
 main_exe({name = "performing-calculations-on-gpu"}, true)
 
+-- Microbenchmark of the sample's CPU kernels. It compiles them in directly instead of loading the
+-- sample's DLL, see `utils/adder_bench/adder_bench.c`.
+util "adder-bench"
+    cppdialect "C++17"
+    includedirs { "samples/performing_calculations_on_gpu" }
+    files {
+        "samples/performing_calculations_on_gpu/cpu_kernels.h",
+        "samples/performing_calculations_on_gpu/cpu_kernels.cpp",
+    }
@@ -0,0 +1,191 @@
+extern "C" {
+#include "adder_graph.h"
+#include "loader.h"
+
+#include <foundation/log.h>
+#include <foundation/os.h>
+#include <foundation/task_system.h>
+}
+
+uint32_t adder_graph__num_args(const metal_adder_graph_op_t *op, adder_graph_expr_inputs_f *expr_inputs)
+{
+    return op->type == METAL_ADDER_GRAPH_OP_ADD ? 3 : expr_inputs(op->expr) + 1;
+}
+
+// Checks operation `i` of a graph or task list on `num_arrays` arrays, and sets `reads` and `writes`
+// to the arrays it accesses, one bit per array.
+static bool private__op_access(const metal_adder_graph_op_t *op, uint32_t i, uint32_t num_arrays,
+    adder_graph_expr_inputs_f *expr_inputs, uint32_t *reads, uint32_t *writes)
+{
+    if (op->type != METAL_ADDER_GRAPH_OP_ADD && op->type != METAL_ADDER_GRAPH_OP_EXPR) {
+        TM_LOG("Graph operation %u has unknown type %u\n", i, (uint32_t)op->type);
+        return false;
+    }
+    if (op->type == METAL_ADDER_GRAPH_OP_EXPR && !op->expr) {
+        TM_LOG("Graph operation %u has no expression\n", i);
+        return false;
+    }
+
+    const uint32_t num_args = adder_graph__num_args(op, expr_inputs);
+    *reads = 0;
+    for (uint32_t a = 0; a < num_args; ++a) {
+        if (op->args[a] >= num_arrays) {
+            TM_LOG("Graph operation %u uses array %u of %u\n", i, op->args[a], num_arrays);
+            return false;
+        }
+        if (a + 1 < num_args)
+            *reads |= 1u << op->args[a];
+    }
+    *writes = 1u << op->args[num_args - 1];
+    return true;
+}
+
+bool adder_graph__plan(const metal_adder_graph_t *graph, adder_graph_expr_inputs_f *expr_inputs, bool *barriers)
+{
+    if (graph->num_ops > METAL_ADDER_MAX_GRAPH_OPS) {
+        TM_LOG("Graph has %u operations, at most %u are supported\n", graph->num_ops, METAL_ADDER_MAX_GRAPH_OPS);
+        return false;
+    }
+    if (graph->num_arrays > METAL_ADDER_MAX_GRAPH_ARRAYS) {
+        TM_LOG("Graph has %u arrays, at most %u are supported\n", graph->num_arrays, METAL_ADDER_MAX_GRAPH_ARRAYS);
+        return false;
+    }
+    if (!graph->array_length) {
+        TM_LOG("Graph has empty arrays\n");
+        return false;
+    }
+
+    // Arrays read and written by the operations since the last barrier, one bit per array.
+    uint32_t reads = 0, writes = 0;
+    for (uint32_t i = 0; i < graph->num_ops; ++i) {
+        uint32_t op_reads, op_writes;
+        if (!private__op_access(graph->ops + i, i, graph->num_arrays, expr_inputs, &op_reads, &op_writes))
+            return false;
+
+        barriers[i] = ((op_reads | op_writes) & writes) || (op_writes & reads);
+        if (barriers[i])
+            reads = writes = 0;
+        reads |= op_reads;
+        writes |= op_writes;
+    }
+    return true;
+}
+
+// Data of the task system task that runs a CPU task.
+typedef struct cpu_task_t
+{
+    const metal_adder_task_t *task;
+    float *const *arrays;
+    uint64_t count;
+} cpu_task_t;
+
+static void private__cpu_task(void *data, uint64_t task_id)
+{
+    const cpu_task_t *t = (const cpu_task_t *)data;
+    t->task->f(t->task->ud, t->arrays, t->count);
+}
+
+bool adder_graph__run_tasks(const metal_adder_task_t *tasks, uint32_t num_tasks, float *const *arrays, uint32_t num_arrays,
+    uint64_t count, adder_graph_expr_inputs_f *expr_inputs, const adder_graph_device_i *device)
+{
+    if (num_tasks > METAL_ADDER_MAX_TASKS) {
+        TM_LOG("%u tasks, at most %u are supported\n", num_tasks, METAL_ADDER_MAX_TASKS);
+        return false;
+    }
+
+    // Task `i` waits for the tasks in `deps[i]`, one bit per task.
+    uint32_t reads[METAL_ADDER_MAX_TASKS], writes[METAL_ADDER_MAX_TASKS];
+    uint64_t deps[METAL_ADDER_MAX_TASKS];
+    const uint32_t valid_arrays = num_arrays < 32 ? (1u << num_arrays) - 1 : ~0u;
+    for (uint32_t i = 0; i < num_tasks; ++i) {
+        const metal_adder_task_t *task = tasks + i;
+        if (task->type == METAL_ADDER_TASK_DEVICE) {
+            if (!private__op_access(&task->op, i, num_arrays, expr_inputs, reads + i, writes + i))
+                return false;
+        } else if (task->type == METAL_ADDER_TASK_CPU) {
+            if (!task->f) {
+                TM_LOG("Task %u has no function\n", i);
+                return false;
+            }
+            if ((task->reads | task->writes) & ~valid_arrays) {
+                TM_LOG("Task %u uses arrays outside the %u of the graph\n", i, num_arrays);
+                return false;
+            }
+            reads[i] = task->reads;
+            writes[i] = task->writes;
+        } else {
+            TM_LOG("Task %u has unknown type %u\n", i, (uint32_t)task->type);
+            return false;
+        }
+
+        deps[i] = 0;
+        for (uint32_t j = 0; j < i; ++j) {
+            if ((writes[j] & (reads[i] | writes[i])) || (reads[j] & writes[i]))
+                deps[i] |= 1ull << j;
+        }
+    }
+
+    cpu_task_t cpu_tasks[METAL_ADDER_MAX_TASKS];
+    uint64_t task_ids[METAL_ADDER_MAX_TASKS];
+
+    // Device tasks that are running, one handle and one bit mask of tasks per `device->start()`.
+    void *batches[METAL_ADDER_MAX_TASKS];
+    uint64_t batch_tasks[METAL_ADDER_MAX_TASKS];
+    uint32_t num_batches = 0;
+
+    const uint64_t all = num_tasks == 64 ? ~0ull : (1ull << num_tasks) - 1;
+    uint64_t started = 0, done = 0;
+    while (done != all) {
+        uint32_t ready[METAL_ADDER_MAX_TASKS];
+        uint32_t num_ready = 0;
+        uint64_t ready_mask = 0;
+        for (uint32_t i = 0; i < num_tasks; ++i) {
+            const uint64_t bit = 1ull << i;
+            if ((started & bit) || (deps[i] & ~done))
+                continue;
+            started |= bit;
+            if (tasks[i].type == METAL_ADDER_TASK_CPU) {
+                cpu_tasks[i] = (cpu_task_t){ .task = tasks + i, .arrays = arrays, .count = count };
+                task_ids[i] = tm_task_system_api->run_task(private__cpu_task, cpu_tasks + i, tasks[i].name ? tasks[i].name : "adder_task");
+            } else {
+                ready[num_ready++] = i;
+                ready_mask |= bit;
+            }
+        }
+        if (num_ready) {
+            batches[num_batches] = device->start(device->inst, tasks, ready, num_ready, count);
+            batch_tasks[num_batches++] = ready_mask;
+        }
+
+        const uint64_t done_before = done;
+        uint32_t assist = num_tasks;
+        for (uint32_t i = 0; i < num_tasks; ++i) {
+            const uint64_t bit = 1ull << i;
+            if (tasks[i].type != METAL_ADDER_TASK_CPU || !(started & bit) || (done & bit))
+                continue;
+            if (tm_task_system_api->is_task_done(task_ids[i]))
+                done |= bit;
+            else if (assist == num_tasks)
+                assist = i;
+        }
+        for (uint32_t b = 0; b < num_batches;) {
+            if (device->poll(device->inst, batches[b])) {
+                done |= batch_tasks[b];
+                --num_batches;
+                batches[b] = batches[num_batches];
+                batch_tasks[b] = batch_tasks[num_batches];
+            } else
+                ++b;
+        }
+
+        // Nothing new can start until something finishes. Run other task system work meanwhile, or
+        // just wait for the device.
+        if (done == done_before) {
+            if (assist < num_tasks)
+                tm_task_system_api->is_task_done_else_assist(task_ids[assist]);
+            else
+                tm_os_api->thread->yield_processor();
+        }
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "metal_adder.h"
+
+#include <foundation/api_types.h>
+
+// Validation and scheduling of `metal_adder_graph_t` and `metal_adder_task_t`, shared by the adder
+// backends.
+
+// Returns the number of inputs of an expression compiled by a backend.
+typedef uint32_t adder_graph_expr_inputs_f(const struct metal_adder_expr_o *expr);
+
+// Returns the number of arrays `op` uses, its inputs followed by its result.
+uint32_t adder_graph__num_args(const metal_adder_graph_op_t *op, adder_graph_expr_inputs_f *expr_inputs);
+
+// Checks that `graph` is well formed and sets `barriers[i]` for each operation `i` that has to wait
+// for all the operations before it, because it depends on one of the operations since the previous
+// barrier. The operations between two barriers are independent and can run concurrently. Returns
+// `false` and logs the problem if the graph is invalid.
+bool adder_graph__plan(const metal_adder_graph_t *graph, adder_graph_expr_inputs_f *expr_inputs, bool *barriers);
+
+// Device side of `adder_graph__run_tasks()`, implemented by each backend.
+typedef struct adder_graph_device_i
+{
+    void *inst;
+
+    // Starts the device tasks `tasks[ids[0]]`, ..., `tasks[ids[n - 1]]`, which don't depend on each
+    // other, on `count` elements. Returns a handle for `poll()`.
+    void *(*start)(void *inst, const metal_adder_task_t *tasks, const uint32_t *ids, uint32_t n, uint64_t count);
+
+    // Returns `true` and frees `handle` if the tasks it was returned for have finished.
+    bool (*poll)(void *inst, void *handle);
+} adder_graph_device_i;
+
+// Implements `metal_adder_api->run_tasks()` on `num_arrays` arrays. The calling thread starts each
+// task when its dependencies have finished: CPU tasks on `tm_task_system_api`, device tasks through
+// `device`, all the ready ones at once. While nothing finishes it helps the task system. Returns
+// `false` and logs the problem if the tasks are invalid, without running any of them.
+bool adder_graph__run_tasks(const metal_adder_task_t *tasks, uint32_t num_tasks, float *const *arrays, uint32_t num_arrays,
+    uint64_t count, adder_graph_expr_inputs_f *expr_inputs, const adder_graph_device_i *device);
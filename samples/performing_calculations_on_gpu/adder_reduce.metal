@@ -0,0 +1,111 @@
+/*
+Reductions over the adder's buffers.
+
+Each threadgroup reduces a grid-strided slice of the input to a single partial result, which the host
+combines in threadgroup order. The grid size only depends on the array length, so the result is
+the same on every run. This file is compiled without fast math, which would let the compiler
+reassociate away the Kahan compensation.
+*/
+
+#include <metal_stdlib>
+using namespace metal;
+
+// Threads per threadgroup. Must match `METAL_ADDER_REDUCE_GROUP_SIZE` in metal_adder.cpp.
+#define REDUCE_GROUP_SIZE 256
+
+struct reduce_add {
+    float operator()(float x, float y) const { return x + y; }
+};
+
+// `fmin` and `fmax` return the other operand when one is NaN, so NaNs are ignored.
+struct reduce_min {
+    float operator()(float x, float y) const { return fmin(x, y); }
+};
+
+struct reduce_max {
+    float operator()(float x, float y) const { return fmax(x, y); }
+};
+
+// Tree reduction of one value per thread in threadgroup memory, returns the result in all threads.
+template <typename Op>
+static float reduce_threadgroup(threadgroup float *scratch, uint lid, float value, Op op)
+{
+    scratch[lid] = value;
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    for (uint stride = REDUCE_GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride)
+            scratch[lid] = op(scratch[lid], scratch[lid + stride]);
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+    return scratch[0];
+}
+
+// Kahan-compensated sum of `x[i]`, or of `x[i] * y[i]` with `DOT`, over the elements of this thread.
+template <bool DOT>
+static float reduce_thread_sum(device const float *x, device const float *y, uint n, uint tid, uint grid)
+{
+    float s = 0, c = 0;
+    for (uint i = tid; i < n; i += grid) {
+        const float v = (DOT ? x[i] * y[i] : x[i]) - c;
+        const float t = s + v;
+        c = (t - s) - v;
+        s = t;
+    }
+    return s - c;
+}
+
+kernel void reduce_sum(device const float *x [[buffer(0)]],
+                       device float *partials [[buffer(2)]],
+                       constant uint &n [[buffer(3)]],
+                       uint tid [[thread_position_in_grid]],
+                       uint lid [[thread_position_in_threadgroup]],
+                       uint group [[threadgroup_position_in_grid]],
+                       uint grid [[threads_per_grid]])
+{
+    threadgroup float scratch[REDUCE_GROUP_SIZE];
+    const float sum = reduce_threadgroup(scratch, lid, reduce_thread_sum<false>(x, x, n, tid, grid), reduce_add());
+    if (lid == 0)
+        partials[group] = sum;
+}
+
+kernel void reduce_dot(device const float *x [[buffer(0)]],
+                       device const float *y [[buffer(1)]],
+                       device float *partials [[buffer(2)]],
+                       constant uint &n [[buffer(3)]],
+                       uint tid [[thread_position_in_grid]],
+                       uint lid [[thread_position_in_threadgroup]],
+                       uint group [[threadgroup_position_in_grid]],
+                       uint grid [[threads_per_grid]])
+{
+    threadgroup float scratch[REDUCE_GROUP_SIZE];
+    const float sum = reduce_threadgroup(scratch, lid, reduce_thread_sum<true>(x, y, n, tid, grid), reduce_add());
+    if (lid == 0)
+        partials[group] = sum;
+}
+
+// Writes the minimum and maximum of each threadgroup to `partials[2 * group]` and
+// `partials[2 * group + 1]`.
+kernel void reduce_min_max(device const float *x [[buffer(0)]],
+                           device float *partials [[buffer(2)]],
+                           constant uint &n [[buffer(3)]],
+                           uint tid [[thread_position_in_grid]],
+                           uint lid [[thread_position_in_threadgroup]],
+                           uint group [[threadgroup_position_in_grid]],
+                           uint grid [[threads_per_grid]])
+{
+    threadgroup float scratch[REDUCE_GROUP_SIZE];
+    float lo = INFINITY, hi = -INFINITY;
+    for (uint i = tid; i < n; i += grid) {
+        lo = fmin(lo, x[i]);
+        hi = fmax(hi, x[i]);
+    }
+    lo = reduce_threadgroup(scratch, lid, lo, reduce_min());
+
+    // All threads must have read the minimum before `scratch` is reused.
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    hi = reduce_threadgroup(scratch, lid, hi, reduce_max());
+    if (lid == 0) {
+        partials[2 * group] = lo;
+        partials[2 * group + 1] = hi;
+    }
+}
@@ -0,0 +1,194 @@
+extern "C" {
+#include "adder_stream.h"
+#include "adder_trace.h"
+#include "cpu_kernels.h"
+#include "loader.h"
+
+#include <foundation/allocator.h>
+#include <foundation/log.h>
+#include <foundation/math.inl>
+#include <foundation/os.h>
+#include <foundation/profiler.h>
+}
+
+#include <atomic>
+#include <string.h>
+
+// A read of both inputs into a slot, or a write of a slot's result.
+typedef struct io_job_t
+{
+    adder_stream_o *s;
+    const adder_stream_slot_t *slot;
+
+    // Index of the first element of the chunk in the files.
+    uint64_t first;
+    bool write;
+    TM_PAD(7);
+} io_job_t;
+
+struct adder_stream_o
+{
+    tm_allocator_i *allocator;
+
+    tm_file_o a;
+    tm_file_o b;
+    tm_file_o result;
+
+    uint64_t length;
+    uint64_t chunk_length;
+
+    // The read or write in flight on each slot of the ring. A slot goes read, add, write and then
+    // read again, so it never has more than one.
+    io_job_t jobs[METAL_ADDER_STREAM_RING_SIZE];
+    cpu_kernels_async_o *pending[METAL_ADDER_STREAM_RING_SIZE];
+
+    // Set by any job whose read or write fails.
+    std::atomic<bool> failed;
+    TM_PAD(7);
+};
+
+static void private__close_files(adder_stream_o *s)
+{
+    if (s->a.valid)
+        tm_os_api->file_io->close(s->a);
+    if (s->b.valid)
+        tm_os_api->file_io->close(s->b);
+    if (s->result.valid)
+        tm_os_api->file_io->close(s->result);
+}
+
+adder_stream_o *adder_stream__open(tm_allocator_i *allocator, const metal_adder_stream_t *stream)
+{
+    adder_stream_o *s = (adder_stream_o *)tm_alloc(allocator, sizeof(adder_stream_o));
+    memset((void *)s, 0, sizeof(adder_stream_o));
+    s->allocator = allocator;
+
+    s->a = tm_os_api->file_io->open_input(stream->input_a_path);
+    s->b = tm_os_api->file_io->open_input(stream->input_b_path);
+    s->result = tm_os_api->file_io->open_output(stream->result_path);
+    if (!s->a.valid || !s->b.valid || !s->result.valid) {
+        TM_LOG("Failed to open `%s`\n", !s->a.valid ? stream->input_a_path : !s->b.valid ? stream->input_b_path : stream->result_path);
+        private__close_files(s);
+        tm_free(allocator, s, sizeof(adder_stream_o));
+        return NULL;
+    }
+
+    s->length = tm_min(tm_os_api->file_io->size(s->a), tm_os_api->file_io->size(s->b)) / sizeof(float);
+    if (!s->length) {
+        TM_LOG("Input files hold less than one float\n");
+        private__close_files(s);
+        tm_free(allocator, s, sizeof(adder_stream_o));
+        return NULL;
+    }
+
+    const uint64_t chunk_length = stream->chunk_length ? stream->chunk_length : METAL_ADDER_DEFAULT_STREAM_CHUNK_LENGTH;
+    s->chunk_length = tm_min(chunk_length, s->length);
+    return s;
+}
+
+void adder_stream__close(adder_stream_o *s)
+{
+    private__close_files(s);
+    tm_free(s->allocator, s, sizeof(adder_stream_o));
+}
+
+uint64_t adder_stream__chunk_length(const adder_stream_o *s)
+{
+    return s->chunk_length;
+}
+
+// Reads exactly `size` bytes at `offset`, a single read can return less than asked for.
+static bool private__read_at(tm_file_o f, uint64_t offset, void *data, uint64_t size)
+{
+    while (size) {
+        const int64_t read = tm_os_api->file_io->read_at(f, offset, data, size);
+        if (read <= 0)
+            return false;
+        offset += (uint64_t)read;
+        data = (char *)data + read;
+        size -= (uint64_t)read;
+    }
+    return true;
+}
+
+static void private__io_job(void *data, uint64_t begin, uint64_t end)
+{
+    const io_job_t *job = (const io_job_t *)data;
+    adder_stream_o *s = job->s;
+    const uint64_t offset = (job->first + begin) * sizeof(float);
+    const uint64_t size = (end - begin) * sizeof(float);
+
+    bool ok;
+    if (job->write) {
+        ok = tm_os_api->file_io->write_at(s->result, offset, job->slot->result + begin, size);
+    } else {
+        ok = private__read_at(s->a, offset, job->slot->a + begin, size)
+            && private__read_at(s->b, offset, job->slot->b + begin, size);
+    }
+    if (!ok)
+        s->failed.store(true, std::memory_order_relaxed);
+}
+
+// Starts reading or writing back chunk `chunk` of the files in slot `slot`.
+static void private__begin_io(adder_stream_o *s, const adder_stream_slot_t *slots, uint64_t chunk, bool write)
+{
+    const uint32_t slot = (uint32_t)(chunk % METAL_ADDER_STREAM_RING_SIZE);
+    const uint64_t first = chunk * s->chunk_length;
+    const uint64_t count = tm_min(s->chunk_length, s->length - first);
+    s->jobs[slot] = (io_job_t){ .s = s, .slot = slots + slot, .first = first, .write = write };
+    s->pending[slot] = cpu_kernels__parallel_for_async(s->allocator, count, ADDER_STREAM_IO_GRAIN, private__io_job, s->jobs + slot);
+}
+
+static void private__wait_io(adder_stream_o *s, uint32_t slot)
+{
+    if (!s->pending[slot])
+        return;
+    cpu_kernels__wait(s->pending[slot]);
+    s->pending[slot] = NULL;
+}
+
+uint64_t adder_stream__run(adder_stream_o *s, const adder_stream_slot_t slots[METAL_ADDER_STREAM_RING_SIZE],
+    void (*add)(void *inst, uint32_t slot, const adder_stream_slot_t *buffers, uint64_t count), void *inst, adder_trace_o *trace)
+{
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    const uint64_t num_chunks = (s->length + s->chunk_length - 1) / s->chunk_length;
+    s->failed.store(false, std::memory_order_relaxed);
+
+    private__begin_io(s, slots, 0, false);
+    uint64_t chunk = 0;
+    for (; chunk < num_chunks && !s->failed.load(std::memory_order_relaxed); ++chunk) {
+        const uint32_t slot = (uint32_t)(chunk % METAL_ADDER_STREAM_RING_SIZE);
+
+        // The next chunk's slot was last used by chunk N-2, its write-back must finish before the
+        // slot can be refilled.
+        if (chunk + 1 < num_chunks) {
+            const uint32_t next = (uint32_t)((chunk + 1) % METAL_ADDER_STREAM_RING_SIZE);
+            ADDER_TRACE_BEGIN_SCOPE(trace, stream_wait_write);
+            private__wait_io(s, next);
+            ADDER_TRACE_END_SCOPE(trace, stream_wait_write);
+            private__begin_io(s, slots, chunk + 1, false);
+        }
+
+        ADDER_TRACE_BEGIN_SCOPE(trace, stream_wait_read);
+        private__wait_io(s, slot);
+        ADDER_TRACE_END_SCOPE(trace, stream_wait_read);
+
+        const uint64_t count = tm_min(s->chunk_length, s->length - chunk * s->chunk_length);
+        ADDER_TRACE_BEGIN_SCOPE(trace, stream_add);
+        add(inst, slot, slots + slot, count);
+        ADDER_TRACE_END_SCOPE_WITH_BYTES(trace, stream_add, 3 * count * sizeof(float));
+
+        private__begin_io(s, slots, chunk, true);
+    }
+
+    for (uint32_t slot = 0; slot < METAL_ADDER_STREAM_RING_SIZE; ++slot)
+        private__wait_io(s, slot);
+
+    const bool failed = s->failed.load(std::memory_order_relaxed);
+    if (failed)
+        TM_LOG("Streaming failed in chunk %llu of %llu\n", (unsigned long long)chunk, (unsigned long long)num_chunks);
+
+    TM_PROFILER_END_FUNC_SCOPE();
+    return failed ? 0 : s->length;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "metal_adder.h"
+
+#include <foundation/api_types.h>
+
+// Chunked file streaming behind `metal_adder_api->stream_files()`, shared by the adder backends. The
+// backends own the staging buffers and the add itself, this drives the file I/O around them.
+
+struct tm_allocator_i;
+struct adder_trace_o;
+
+// Elements per read or write job. Several jobs per chunk keep more requests in flight than a single
+// sequential read, which fast SSDs need to reach their bandwidth.
+#define ADDER_STREAM_IO_GRAIN (1024 * 1024)
+
+typedef struct adder_stream_o adder_stream_o;
+
+// Staging buffers for one chunk of the ring, each with room for the stream's chunk length.
+typedef struct adder_stream_slot_t
+{
+    float *a;
+    float *b;
+    float *result;
+} adder_stream_slot_t;
+
+// Opens the files of `stream`. Returns NULL and logs the problem if any of them can't be opened or
+// the inputs are empty.
+adder_stream_o *adder_stream__open(struct tm_allocator_i *allocator, const metal_adder_stream_t *stream);
+
+// Closes the files and frees the stream.
+void adder_stream__close(adder_stream_o *s);
+
+// Returns the number of elements per chunk, which is never more than the length of the inputs.
+uint64_t adder_stream__chunk_length(const adder_stream_o *s);
+
+// Streams all chunks through `slots`, calling `add(inst, slot, &slots[slot], count)` for each chunk
+// once it has been read into `slots[slot]`. `add` must have written the result to the slot when it
+// returns.
+// Returns the number of elements written, or 0 if any read or write failed.
+uint64_t adder_stream__run(adder_stream_o *s, const adder_stream_slot_t slots[METAL_ADDER_STREAM_RING_SIZE],
+    void (*add)(void *inst, uint32_t slot, const adder_stream_slot_t *buffers, uint64_t count), void *inst, struct adder_trace_o *trace);
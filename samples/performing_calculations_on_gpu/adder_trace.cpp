@@ -0,0 +1,133 @@
+extern "C" {
+#include "adder_trace.h"
+#include "loader.h"
+
+#include <foundation/allocator.h>
+#include <foundation/carray_print.inl>
+#include <foundation/log.h>
+#include <foundation/os.h>
+}
+
+#include <string.h>
+
+enum adder_trace_event_type {
+    ADDER_TRACE_EVENT_TYPE_COMPLETE,
+    ADDER_TRACE_EVENT_TYPE_COUNTER,
+};
+
+typedef struct adder_trace_event_t
+{
+    const char *name;
+    enum adder_trace_event_type type;
+    enum adder_trace_track track;
+
+    // Start of the event, in microseconds since the trace was created.
+    double ts;
+
+    // Duration of a complete event in microseconds, or the value of a counter sample.
+    double value;
+} adder_trace_event_t;
+
+struct adder_trace_o
+{
+    tm_allocator_i *allocator;
+    char *path;
+    tm_clock_o start;
+
+    // carray
+    adder_trace_event_t *events;
+};
+
+adder_trace_o *adder_trace__create(tm_allocator_i *allocator, const char *path)
+{
+    if (!path || !*path)
+        return NULL;
+
+    adder_trace_o *trace = (adder_trace_o *)tm_alloc(allocator, sizeof(adder_trace_o));
+    const uint64_t path_size = strlen(path) + 1;
+    *trace = (adder_trace_o){
+        .allocator = allocator,
+        .path = (char *)tm_alloc(allocator, path_size),
+        .start = tm_os_api->time->now(),
+    };
+    memcpy(trace->path, path, path_size);
+    return trace;
+}
+
+static double private__microseconds(const adder_trace_o *trace, tm_clock_o t)
+{
+    return tm_os_api->time->delta(t, trace->start) * 1e6;
+}
+
+void adder_trace__event(adder_trace_o *trace, const char *name, enum adder_trace_track track, tm_clock_o start,
+    double duration)
+{
+    if (!trace)
+        return;
+    const adder_trace_event_t e = {
+        .name = name,
+        .type = ADDER_TRACE_EVENT_TYPE_COMPLETE,
+        .track = track,
+        .ts = private__microseconds(trace, start),
+        .value = duration * 1e6,
+    };
+    tm_carray_push(trace->events, e, trace->allocator);
+}
+
+void adder_trace__throughput(adder_trace_o *trace, const char *name, tm_clock_o end, uint64_t bytes, double duration)
+{
+    if (!trace || duration <= 0)
+        return;
+    const adder_trace_event_t e = {
+        .name = name,
+        .type = ADDER_TRACE_EVENT_TYPE_COUNTER,
+        .track = ADDER_TRACE_TRACK_HOST,
+        .ts = private__microseconds(trace, end),
+        .value = (double)bytes / duration * 1e-9,
+    };
+    tm_carray_push(trace->events, e, trace->allocator);
+}
+
+void adder_trace__end_scope(adder_trace_o *trace, const char *name, tm_clock_o start, uint64_t bytes)
+{
+    if (!trace)
+        return;
+    const tm_clock_o end = tm_os_api->time->now();
+    const double duration = tm_os_api->time->delta(end, start);
+    adder_trace__event(trace, name, ADDER_TRACE_TRACK_HOST, start, duration);
+    if (bytes)
+        adder_trace__throughput(trace, name, end, bytes, duration);
+}
+
+void adder_trace__destroy(adder_trace_o *trace)
+{
+    if (!trace)
+        return;
+
+    // Chrome's trace event format, with one process and a thread per track.
+    char *json = NULL;
+    tm_carray_printf(&json, trace->allocator, "{\"traceEvents\":[\n");
+    tm_carray_printf(&json, trace->allocator, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"host\"}},\n", ADDER_TRACE_TRACK_HOST);
+    tm_carray_printf(&json, trace->allocator, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"device\"}}", ADDER_TRACE_TRACK_DEVICE);
+    for (const adder_trace_event_t *e = trace->events; e != tm_carray_end(trace->events); ++e) {
+        if (e->type == ADDER_TRACE_EVENT_TYPE_COMPLETE)
+            tm_carray_printf(&json, trace->allocator, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", e->name, e->track, e->ts, e->value);
+        else
+            tm_carray_printf(&json, trace->allocator, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"GB/s\":%.3f}}", e->name, e->ts, e->value);
+    }
+    tm_carray_printf(&json, trace->allocator, "\n]}\n");
+
+    const tm_file_o f = tm_os_api->file_io->open_output(trace->path);
+    if (f.valid && tm_os_api->file_io->write(f, json, tm_carray_size(json)))
+        TM_LOG("Wrote %llu trace events to %s\n", (unsigned long long)tm_carray_size(trace->events), trace->path);
+    else
+        TM_LOG("Failed to write trace to %s\n", trace->path);
+    if (f.valid)
+        tm_os_api->file_io->close(f);
+
+    tm_allocator_i *a = trace->allocator;
+    tm_carray_free(json, a);
+    tm_carray_free(trace->events, a);
+    tm_free(a, trace->path, strlen(trace->path) + 1);
+    tm_free(a, trace, sizeof(adder_trace_o));
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <foundation/api_types.h>
+
+// Records the phases of the adder for offline inspection. Every scope opened with
+// `ADDER_TRACE_BEGIN_SCOPE()` is both a regular `tm_profiler_api` scope and an event in the trace,
+// which is written as a Chrome trace JSON file (`chrome://tracing`, Perfetto) when the trace is
+// destroyed. This makes it possible to look at stalls on machines that don't run the editor's
+// profiler view.
+//
+// All functions accept a NULL trace and do nothing, so tracing costs nothing when it's disabled.
+
+struct tm_allocator_i;
+
+typedef struct adder_trace_o adder_trace_o;
+
+// Rows of the trace view.
+enum adder_trace_track {
+    // Work done by the thread calling into the adder.
+    ADDER_TRACE_TRACK_HOST,
+
+    // Kernels executing on the device, either the GPU or the job system workers.
+    ADDER_TRACE_TRACK_DEVICE,
+};
+
+// Creates a trace that will be written to `path` by `adder_trace__destroy()`. Returns NULL if `path`
+// is NULL or empty.
+adder_trace_o *adder_trace__create(struct tm_allocator_i *allocator, const char *path);
+
+// Writes the trace to the path it was created with and frees it.
+void adder_trace__destroy(adder_trace_o *trace);
+
+// Records an event called `name` on `track`, that started at `start` and lasted `duration`
+// seconds. `name` must be a static string.
+void adder_trace__event(adder_trace_o *trace, const char *name, enum adder_trace_track track, tm_clock_o start,
+    double duration);
+
+// Records a throughput sample for the counter `name`: `bytes` were processed in `duration` seconds
+// ending at `end`. The trace shows the counter in GB/s. `name` must be a static string.
+void adder_trace__throughput(adder_trace_o *trace, const char *name, tm_clock_o end, uint64_t bytes, double duration);
+
+// Opens a profiler scope that is also recorded as an event on the host track of `trace`.
+#define ADDER_TRACE_BEGIN_SCOPE(trace, tag) \
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(tag);     \
+    const tm_clock_o adder_trace__##tag##_start = tm_os_api->time->now()
+
+// Closes a scope opened with `ADDER_TRACE_BEGIN_SCOPE()`.
+#define ADDER_TRACE_END_SCOPE(trace, tag) ADDER_TRACE_END_SCOPE_WITH_BYTES(trace, tag, 0)
+
+// As `ADDER_TRACE_END_SCOPE()`, and also records the scope's throughput for processing `bytes` as a
+// counter with the same name.
+#define ADDER_TRACE_END_SCOPE_WITH_BYTES(trace, tag, bytes) \
+    TM_PROFILER_END_LOCAL_SCOPE(tag);                       \
+    adder_trace__end_scope(trace, #tag, adder_trace__##tag##_start, bytes)
+
+// Implementation of `ADDER_TRACE_END_SCOPE_WITH_BYTES()`.
+void adder_trace__end_scope(adder_trace_o *trace, const char *name, tm_clock_o start, uint64_t bytes);
@@ -0,0 +1,143 @@
+extern "C" {
+#include "buffer_allocator.h"
+#include "compute_device.h"
+#include "cpu_kernels.h"
+#include "loader.h"
+
+#include <foundation/allocator.h>
+#include <foundation/log.h>
+#include <foundation/memory_tracker.h>
+#include <foundation/os.h>
+}
+
+#include <string.h>
+
+#if defined(TM_OS_POSIX)
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2ULL * 1024 * 1024)
+#define PAGE_SIZE_4K (4ULL * 1024)
+
+// Mappings are rounded up to whole huge pages, smaller allocations to regular pages.
+static uint64_t private__mapping_size(uint64_t size)
+{
+    const uint64_t page = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : PAGE_SIZE_4K;
+    return (size + page - 1) / page * page;
+}
+
+static void *private__map(uint64_t size)
+{
+#if defined(TM_OS_LINUX)
+    if (size >= HUGE_PAGE_SIZE) {
+        // Explicit huge pages only succeed if the system has reserved enough of them
+        // (`vm.nr_hugepages`).
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return p;
+
+        // Otherwise map an extra huge page, so the range can be trimmed to huge page alignment
+        // before asking for transparent huge pages.
+        char *raw = (char *)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned > raw)
+            munmap(raw, (uint64_t)(aligned - raw));
+        const uint64_t tail = (uint64_t)(raw + size + HUGE_PAGE_SIZE - (aligned + size));
+        if (tail)
+            munmap(aligned + size, tail);
+        madvise(aligned, size, MADV_HUGEPAGE);
+        return aligned;
+    }
+#endif
+#if defined(TM_OS_POSIX)
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    return tm_os_api->virtual_memory->map(size);
+#endif
+}
+
+static void private__unmap(void *p, uint64_t size)
+{
+#if defined(TM_OS_POSIX)
+    munmap(p, size);
+#else
+    tm_os_api->virtual_memory->unmap(p, size);
+#endif
+}
+
+static void *private__realloc(tm_allocator_i *a, void *ptr, uint64_t old_size, uint64_t new_size, const char *file, uint32_t line)
+{
+    void *new_ptr = NULL;
+    if (new_size) {
+        new_ptr = private__map(private__mapping_size(new_size));
+        if (!new_ptr) {
+            TM_LOG("Failed to map %llu bytes for compute buffer\n", (unsigned long long)new_size);
+            return NULL;
+        }
+        if (ptr)
+            memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    if (ptr)
+        private__unmap(ptr, private__mapping_size(old_size));
+
+    tm_memory_tracker_api->record_realloc(ptr, old_size, new_ptr, new_size, file, line, a->mem_scope);
+    return new_ptr;
+}
+
+tm_allocator_i buffer_allocator__create(const tm_allocator_i *parent, const char *desc)
+{
+    tm_allocator_i a = { 0 };
+    a.mem_scope = tm_memory_tracker_api->create_scope(desc, parent->mem_scope);
+    a.realloc = private__realloc;
+    return a;
+}
+
+void buffer_allocator__rebind(tm_allocator_i *allocator)
+{
+    allocator->realloc = private__realloc;
+}
+
+void buffer_allocator__destroy(tm_allocator_i *allocator)
+{
+    tm_memory_tracker_api->destroy_scope(allocator->mem_scope);
+}
+
+typedef struct first_touch_job_t
+{
+    char *p;
+    uint64_t size;
+    uint64_t element_size;
+} first_touch_job_t;
+
+static void private__first_touch_job(void *data, uint64_t begin, uint64_t end)
+{
+    const first_touch_job_t *job = (const first_touch_job_t *)data;
+    const uint64_t first = begin * job->element_size;
+    const uint64_t last = end * job->element_size < job->size ? end * job->element_size : job->size;
+    memset(job->p + first, 0, last - first);
+}
+
+void buffer_allocator__first_touch(void *p, uint64_t size, uint64_t grain_size, uint64_t element_size)
+{
+    first_touch_job_t job = { .p = (char *)p, .size = size, .element_size = element_size };
+    cpu_kernels__parallel_for((size + element_size - 1) / element_size, grain_size, private__first_touch_job, &job);
+}
+
+void buffer_allocator__first_touch_shards(void *p, uint64_t size, uint64_t grain_size, uint64_t element_size,
+    const compute_device_t *devices, uint32_t num_devices, const uint64_t *offsets)
+{
+    first_touch_job_t job = { .p = (char *)p, .size = size, .element_size = element_size };
+
+    // The devices touch their shards concurrently.
+    compute_device_shard_t shards[METAL_ADDER_MAX_DEVICES];
+    cpu_kernels_async_o *pending[METAL_ADDER_MAX_DEVICES];
+    for (uint32_t d = 0; d < num_devices; ++d) {
+        shards[d] = (compute_device_shard_t){ .device = devices + d, .f = private__first_touch_job, .data = &job, .first = offsets[d] };
+        pending[d] = cpu_kernels__parallel_for_async(tm_allocator_api->system, offsets[d + 1] - offsets[d], grain_size, compute_device__shard_job, shards + d);
+    }
+    for (uint32_t d = 0; d < num_devices; ++d)
+        cpu_kernels__wait(pending[d]);
+}
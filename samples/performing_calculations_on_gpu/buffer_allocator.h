@@ -0,0 +1,40 @@
+#pragma once
+
+#include <foundation/api_types.h>
+
+// Allocator for the large compute buffers of the CPU backend. Allocations are mapped directly from
+// the OS instead of going through the heap, so that:
+//
+// * On Linux, they are backed by huge pages: explicit huge pages if the system has reserved any,
+//   otherwise transparent huge pages. A 64 MB buffer then needs 32 TLB entries instead of 16384.
+// * Pages are not committed until they are first written, so `buffer_allocator__first_touch()` can
+//   decide which NUMA node they end up on.
+//
+// The allocations are reported to `tm_memory_tracker_api` in a child scope of the parent allocator.
+
+struct tm_allocator_i;
+struct compute_device_t;
+
+// Creates a buffer allocator whose memory is tracked under `parent`, with the scope name `desc`.
+struct tm_allocator_i buffer_allocator__create(const struct tm_allocator_i *parent, const char *desc);
+
+// Points `allocator`, created by `buffer_allocator__create()`, at the code of the currently loaded
+// DLL. Its `realloc` is a function in this DLL, so call this after a hot reload, before allocating or
+// freeing through it again.
+void buffer_allocator__rebind(struct tm_allocator_i *allocator);
+
+// Destroys an allocator created by `buffer_allocator__create()`. All its allocations must have been
+// freed.
+void buffer_allocator__destroy(struct tm_allocator_i *allocator);
+
+// Writes zeros to `size` bytes at `p` using the same job split as a dispatch with `grain_size`
+// elements of `element_size` bytes per job. Linux places a page on the NUMA node of the thread that
+// first writes it, so touching fresh memory this way spreads it over the nodes in the same pattern
+// as the workers that will process it, instead of placing all of it on the allocating thread's node.
+void buffer_allocator__first_touch(void *p, uint64_t size, uint64_t grain_size, uint64_t element_size);
+
+// As `buffer_allocator__first_touch()`, but touches the elements `[offsets[i], offsets[i + 1])`
+// from jobs pinned to `devices[i]`, so each shard of a dispatch has its pages on its device's node.
+// `num_devices` is at most `METAL_ADDER_MAX_DEVICES`, see `compute_device__split()` for the offsets.
+void buffer_allocator__first_touch_shards(void *p, uint64_t size, uint64_t grain_size, uint64_t element_size,
+    const struct compute_device_t *devices, uint32_t num_devices, const uint64_t *offsets);
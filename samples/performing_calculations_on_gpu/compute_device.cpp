@@ -0,0 +1,245 @@
+extern "C" {
+#include "compute_device.h"
+
+#include <foundation/math.inl>
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(TM_OS_LINUX)
+#include <sched.h>
+#endif
+
+// Upper bound on the NUMA nodes that are looked at.
+#define MAX_NODES 64
+
+#define CPU_MASK_WORDS (COMPUTE_DEVICE_MAX_CPUS / 64)
+
+// The CPUs of one NUMA node that this process may run on.
+typedef struct node_t
+{
+    uint32_t node;
+    uint32_t num_cpus;
+    uint64_t cpus[CPU_MASK_WORDS];
+} node_t;
+
+static uint32_t private__count_cpus(const uint64_t *cpus)
+{
+    uint32_t n = 0;
+    for (uint32_t w = 0; w < CPU_MASK_WORDS; ++w)
+        n += (uint32_t)__builtin_popcountll(cpus[w]);
+    return n;
+}
+
+#if defined(TM_OS_LINUX)
+
+// Parses a sysfs CPU or node list such as "0-3,8-11" into a bit mask.
+static void private__parse_list(const char *s, uint64_t *mask)
+{
+    memset(mask, 0, CPU_MASK_WORDS * sizeof(uint64_t));
+    while (*s >= '0' && *s <= '9') {
+        char *end;
+        const uint64_t first = strtoull(s, &end, 10);
+        uint64_t last = first;
+        if (*end == '-')
+            last = strtoull(end + 1, &end, 10);
+        for (uint64_t i = first; i <= last && i < COMPUTE_DEVICE_MAX_CPUS; ++i)
+            mask[i / 64] |= 1ULL << (i % 64);
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+static bool private__read_list(const char *path, uint64_t *mask)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    char line[4096];
+    const bool ok = fgets(line, sizeof(line), f) != NULL;
+    fclose(f);
+    if (ok)
+        private__parse_list(line, mask);
+    return ok;
+}
+
+// Returns the online NUMA nodes, restricted to the CPUs this process is allowed to run on.
+static uint32_t private__nodes(node_t *nodes)
+{
+    uint64_t allowed[CPU_MASK_WORDS] = { 0 };
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set))
+        return 0;
+    for (uint32_t i = 0; i < COMPUTE_DEVICE_MAX_CPUS && i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &set))
+            allowed[i / 64] |= 1ULL << (i % 64);
+    }
+
+    uint64_t online[CPU_MASK_WORDS];
+    if (!private__read_list("/sys/devices/system/node/online", online)) {
+        // No NUMA information, all CPUs are on node 0.
+        nodes[0] = (node_t){ .node = 0 };
+        memcpy(nodes[0].cpus, allowed, sizeof(allowed));
+        nodes[0].num_cpus = private__count_cpus(allowed);
+        return nodes[0].num_cpus ? 1 : 0;
+    }
+
+    uint32_t num_nodes = 0;
+    for (uint32_t node = 0; node < MAX_NODES; ++node) {
+        if (!(online[node / 64] >> (node % 64) & 1))
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        node_t *n = nodes + num_nodes;
+        if (!private__read_list(path, n->cpus))
+            continue;
+        for (uint32_t w = 0; w < CPU_MASK_WORDS; ++w)
+            n->cpus[w] &= allowed[w];
+        n->node = node;
+        n->num_cpus = private__count_cpus(n->cpus);
+
+        // Memory-only nodes and nodes outside the process's CPU set get no device.
+        if (n->num_cpus)
+            ++num_nodes;
+    }
+    return num_nodes;
+}
+
+#else
+
+static uint32_t private__nodes(node_t *nodes)
+{
+    return 0;
+}
+
+#endif
+
+// Sets `cpus` to the CPUs of group `group` of `num_groups` equally sized groups of `node`'s CPUs,
+// in CPU index order, and returns their number.
+static uint32_t private__core_group(const node_t *node, uint32_t group, uint32_t num_groups, uint64_t *cpus)
+{
+    const uint32_t first = (uint32_t)((uint64_t)node->num_cpus * group / num_groups);
+    const uint32_t last = (uint32_t)((uint64_t)node->num_cpus * (group + 1) / num_groups);
+    memset(cpus, 0, CPU_MASK_WORDS * sizeof(uint64_t));
+    uint32_t rank = 0;
+    for (uint32_t i = 0; i < COMPUTE_DEVICE_MAX_CPUS && rank < last; ++i) {
+        if (!(node->cpus[i / 64] >> (i % 64) & 1))
+            continue;
+        if (rank >= first)
+            cpus[i / 64] |= 1ULL << (i % 64);
+        ++rank;
+    }
+    return last - first;
+}
+
+uint32_t compute_device__enumerate(compute_device_t *devices, uint32_t max_devices, uint32_t num_devices)
+{
+    node_t nodes[MAX_NODES];
+    const uint32_t num_nodes = private__nodes(nodes);
+
+    // A single device is left unpinned, pinning it to all CPUs would only cost system calls.
+    const uint32_t wanted = tm_min(num_devices ? num_devices : tm_max(num_nodes, 1), max_devices);
+    if (num_nodes == 0 || wanted <= 1) {
+        devices[0] = (compute_device_t){ .name = "cpu" };
+        return 1;
+    }
+
+    uint32_t n = 0;
+    if (wanted <= num_nodes) {
+        // Fewer devices than nodes: each device gets a run of consecutive nodes.
+        for (uint32_t d = 0; d < wanted; ++d) {
+            compute_device_t *device = devices + n++;
+            *device = (compute_device_t){ 0 };
+            const uint32_t first = num_nodes * d / wanted, last = num_nodes * (d + 1) / wanted;
+            for (uint32_t i = first; i < last; ++i) {
+                for (uint32_t w = 0; w < CPU_MASK_WORDS; ++w)
+                    device->cpus[w] |= nodes[i].cpus[w];
+            }
+            device->node = nodes[first].node;
+            device->num_cpus = private__count_cpus(device->cpus);
+            if (last - first == 1)
+                snprintf(device->name, sizeof(device->name), "node%u", device->node);
+            else
+                snprintf(device->name, sizeof(device->name), "node%u-%u", device->node, nodes[last - 1].node);
+        }
+        return n;
+    }
+
+    // More devices than nodes: split each node into groups of cores, the first nodes get the extra
+    // groups when they don't divide evenly.
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+        const uint32_t num_groups = tm_min(wanted / num_nodes + (i < wanted % num_nodes ? 1 : 0), nodes[i].num_cpus);
+        for (uint32_t g = 0; g < num_groups; ++g) {
+            compute_device_t *device = devices + n++;
+            *device = (compute_device_t){ .node = nodes[i].node };
+            device->num_cpus = private__core_group(nodes + i, g, num_groups, device->cpus);
+            snprintf(device->name, sizeof(device->name), "node%u.%u", nodes[i].node, g);
+        }
+    }
+    return n;
+}
+
+void compute_device__split(const compute_device_t *devices, uint32_t num_devices, uint64_t n, uint64_t align, uint64_t *offsets)
+{
+    // Until every device has been measured, the shards are weighted by CPU count.
+    bool measured = true;
+    for (uint32_t d = 0; d < num_devices; ++d)
+        measured = measured && devices[d].throughput > 0;
+
+    double total = 0;
+    for (uint32_t d = 0; d < num_devices; ++d)
+        total += measured ? devices[d].throughput : tm_max(devices[d].num_cpus, 1);
+
+    double sum = 0;
+    offsets[0] = 0;
+    for (uint32_t d = 0; d + 1 < num_devices; ++d) {
+        sum += measured ? devices[d].throughput : tm_max(devices[d].num_cpus, 1);
+        const uint64_t end = (uint64_t)((double)n * (sum / total)) / align * align;
+        offsets[d + 1] = tm_clamp(end, offsets[d], n);
+    }
+    offsets[num_devices] = n;
+}
+
+void compute_device__record(compute_device_t *device, uint64_t n, double seconds)
+{
+    if (!n || seconds <= 0)
+        return;
+
+    // An exponential moving average, so the split adapts to load on the device without following
+    // the noise of single dispatches.
+    const double rate = (double)n / seconds;
+    device->throughput = device->throughput > 0 ? 0.75 * device->throughput + 0.25 * rate : rate;
+}
+
+void compute_device__shard_job(void *data, uint64_t begin, uint64_t end)
+{
+    const compute_device_shard_t *shard = (const compute_device_shard_t *)data;
+
+#if defined(TM_OS_LINUX)
+    // Re-pinning takes three syscalls, which is a noticeable part of a job. A worker that already
+    // runs on one of the device's CPUs, as most do once the pool has settled, runs the job where it
+    // is. `sched_getcpu()` is answered without entering the kernel.
+    const compute_device_t *device = shard->device;
+    const int cpu = device->num_cpus ? sched_getcpu() : -1;
+    const bool on_device = cpu >= 0 && cpu < COMPUTE_DEVICE_MAX_CPUS && (device->cpus[cpu / 64] >> (cpu % 64) & 1);
+    cpu_set_t previous;
+    const bool pin = device->num_cpus && !on_device && !sched_getaffinity(0, sizeof(previous), &previous);
+    if (pin) {
+        cpu_set_t pinned;
+        CPU_ZERO(&pinned);
+        for (uint32_t w = 0; w < CPU_MASK_WORDS; ++w) {
+            for (uint64_t bits = device->cpus[w]; bits; bits &= bits - 1)
+                CPU_SET(w * 64 + (uint32_t)__builtin_ctzll(bits), &pinned);
+        }
+        sched_setaffinity(0, sizeof(pinned), &pinned);
+    }
+#endif
+
+    shard->f(shard->data, shard->first + begin, shard->first + end);
+
+#if defined(TM_OS_LINUX)
+    if (pin)
+        sched_setaffinity(0, sizeof(previous), &previous);
+#endif
+}
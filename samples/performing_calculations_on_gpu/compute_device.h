@@ -0,0 +1,62 @@
+#pragma once
+
+#include <foundation/api_types.h>
+
+// CPU compute devices that a dispatch can be sharded across. On Linux a device is the set of CPUs of
+// a NUMA node, or a group of cores of a node when more devices are asked for than there are nodes.
+// Jobs run on a device by pinning the job system worker that picks them up to the device's CPUs for
+// the duration of the job, so the memory they first touch lands on the device's node.
+//
+// Elsewhere there is a single device that leaves the workers where they are.
+
+// Largest CPU index a device can hold.
+#define COMPUTE_DEVICE_MAX_CPUS 1024
+
+typedef struct compute_device_t
+{
+    char name[32];
+
+    // NUMA node the device's CPUs belong to.
+    uint32_t node;
+
+    // Number of CPUs in `cpus`. Zero for a device that doesn't pin its jobs.
+    uint32_t num_cpus;
+
+    // Bit `i` is set if CPU `i` belongs to the device.
+    uint64_t cpus[COMPUTE_DEVICE_MAX_CPUS / 64];
+
+    // Measured throughput in elements per second, used to weight the device's shard of a dispatch.
+    // Starts out proportional to `num_cpus` and is updated by `compute_device__record()`.
+    double throughput;
+} compute_device_t;
+
+// Fills `devices` with up to `max_devices` devices and returns their number, which is at least one.
+// `num_devices` is the number of devices to create: zero gives one per NUMA node, more than the
+// number of nodes splits each node into groups of cores.
+uint32_t compute_device__enumerate(compute_device_t *devices, uint32_t max_devices, uint32_t num_devices);
+
+// Splits `[0, n)` into one shard per device, with sizes proportional to the devices' throughput
+// and rounded to multiples of `align`. Shard `i` is `[offsets[i], offsets[i + 1])`, so `offsets`
+// must have room for `num_devices + 1` entries.
+void compute_device__split(const compute_device_t *devices, uint32_t num_devices, uint64_t n, uint64_t align, uint64_t *offsets);
+
+// Records that `device` processed `n` elements in `seconds`, and moves its throughput towards that
+// rate.
+void compute_device__record(compute_device_t *device, uint64_t n, double seconds);
+
+// A range of a parallel-for that runs on one device, see `compute_device__shard_job()`.
+typedef struct compute_device_shard_t
+{
+    const compute_device_t *device;
+    void (*f)(void *data, uint64_t begin, uint64_t end);
+    void *data;
+
+    // First element of the shard. Job ranges are relative to it.
+    uint64_t first;
+} compute_device_shard_t;
+
+// Job function for `cpu_kernels__parallel_for()` and `cpu_kernels__parallel_for_async()` with a
+// `compute_device_shard_t` as the data. Runs `shard->f` on `[shard->first + begin, shard->first +
+// end)` pinned to `shard->device`, then restores the worker's previous affinity. A worker that is
+// already on one of the device's CPUs runs the job without being pinned.
+void compute_device__shard_job(void *shard, uint64_t begin, uint64_t end);
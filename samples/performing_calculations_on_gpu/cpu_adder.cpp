@@ -0,0 +1,985 @@
+extern "C" {
+#include "adder_graph.h"
+#include "adder_stream.h"
+#include "adder_trace.h"
+#include "buffer_allocator.h"
+#include "compute_device.h"
+#include "cpu_kernels.h"
+#include "dirty_chunks.h"
+#include "fused_expr.h"
+#include "kernel_cache.h"
+#include "loader.h"
+#include "mapped_file.h"
+#include "metal_adder.h"
+
+#include <foundation/allocator.h>
+#include <foundation/api_registry.h>
+#include <foundation/carray.inl>
+#include <foundation/log.h>
+#include <foundation/math.inl>
+#include <foundation/os.h>
+#include <foundation/profiler.h>
+#include <foundation/temp_allocator.h>
+}
+
+#include <math.h>
+
+// CPU implementation of `metal_adder_api`. It runs the same computation as the `add_arrays` Metal
+// kernel, using the widest SIMD kernel set available, so the sample can run on platforms without
+// Metal.
+
+// Inputs and result of one dispatch in the ring.
+typedef struct buffer_set_t
+{
+    // Arrays of `metal_adder_settings_t::dtype` elements.
+    void *buffer_a;
+    void *buffer_b;
+    void *result;
+
+    const cpu_kernels_dtype_t *kernels;
+
+    // Prefetch distance for `kernels->add_arrays_streaming()`, or zero if the dispatches use
+    // `kernels->add_arrays()`. See `metal_adder_settings_t::stores`.
+    uint64_t prefetch_distance;
+
+    // Ticket of the last dispatch submitted on this set. While `num_shards` is non-zero, it's still
+    // in flight and hasn't been retired.
+    metal_adder_ticket_t ticket;
+    uint32_t num_shards;
+    TM_PAD(4);
+
+    // The dispatch runs as one parallel-for per compute device, over the elements
+    // `[offsets[i], offsets[i + 1])`. They're started as one group, so `max_workers` limits the
+    // jobs of all of them together.
+    uint64_t offsets[METAL_ADDER_MAX_DEVICES + 1];
+    compute_device_shard_t shards[METAL_ADDER_MAX_DEVICES];
+    cpu_kernels_async_o *dispatch;
+    metal_adder_completion_t completion;
+
+    // With `metal_adder_settings_t::fused_verify`, the dispatch writes the checksum of each block of
+    // `block_size` results to `checksums`, to be compared with the `expected` checksums of the
+    // inputs' sums. Both are NULL otherwise.
+    uint64_t block_size;
+    uint32_t *checksums;
+    uint32_t *expected;
+    tm_clock_o submit_time;
+    double encode_time;
+
+    // Chunks of `grain_size` elements whose inputs have changed since they were last dispatched (or
+    // since `expected` was computed). With `metal_adder_settings_t::incremental`, the dispatch runs
+    // one job per chunk in `dirty.stale`.
+    dirty_chunks_t dirty;
+} buffer_set_t;
+
+struct metal_adder_o {
+    tm_allocator_i allocator;
+
+    // Allocator for the input and result buffers, see `buffer_allocator.h`.
+    tm_allocator_i buffer_allocator;
+
+    // `kernels` is used by the float-only operations, `dtype_kernels` by the dispatches.
+    const cpu_kernels_t *kernels;
+    const cpu_kernels_dtype_t *dtype_kernels;
+    uint64_t grain_size;
+    uint32_t ulp_tolerance;
+    uint32_t frames_in_flight;
+    enum metal_adder_dtype dtype;
+    enum cpu_kernels_isa isa;
+
+    // The number of elements in each array, and the size of the arrays in bytes.
+    uint64_t array_length;
+    uint64_t buffer_size;
+
+    // Devices that dispatches are sharded across, and the most jobs a dispatch runs at once across
+    // all of them, or zero for no limit.
+    compute_device_t devices[METAL_ADDER_MAX_DEVICES];
+    uint32_t num_devices;
+    uint32_t max_workers;
+
+    enum metal_adder_incremental incremental;
+    TM_PAD(4);
+
+    // Files mapped as the inputs and the result, if they were given in the settings. Buffers that
+    // come from files are shared by all buffer sets.
+    mapped_adder_files_t files;
+
+    uint64_t next_ticket;
+    buffer_set_t buffer_sets[METAL_ADDER_MAX_FRAMES_IN_FLIGHT];
+
+    // NULL unless `metal_adder_settings_t::trace_path` was set.
+    adder_trace_o *trace;
+
+    // carray of the compiled expressions that haven't been released.
+    struct metal_adder_expr_o **exprs;
+
+    // carray of the recorded graphs that haven't been released.
+    struct metal_adder_graph_o **graphs;
+};
+
+static struct metal_adder_o *init(struct tm_allocator_i *allocator, const char *data_dir, const metal_adder_settings_t *settings)
+{
+    mapped_adder_files_t files;
+    uint64_t array_length;
+    if (!mapped_file__open_adder_files(&files, settings, &array_length))
+        return NULL;
+
+    tm_allocator_i a = tm_allocator_api->create_child(allocator, "cpu_adder");
+    metal_adder_o *m = (metal_adder_o *)tm_alloc(&a, sizeof(metal_adder_o));
+    memset(m, 0, sizeof(metal_adder_o));
+    m->allocator = a;
+    m->buffer_allocator = buffer_allocator__create(&m->allocator, "cpu_adder buffers");
+    m->trace = adder_trace__create(&m->allocator, settings->trace_path);
+
+    ADDER_TRACE_BEGIN_SCOPE(m->trace, init);
+
+    m->kernels = cpu_kernels__select(settings->cpu_kernels);
+    m->isa = m->kernels->isa;
+    m->dtype = settings->dtype;
+    m->dtype_kernels = cpu_kernels__select_dtype(m->kernels, m->dtype);
+    m->grain_size = settings->grain_size ? settings->grain_size : METAL_ADDER_DEFAULT_GRAIN_SIZE;
+    m->ulp_tolerance = settings->ulp_tolerance;
+    m->frames_in_flight = files.result.data ? 1 : tm_clamp(settings->frames_in_flight, 1, METAL_ADDER_MAX_FRAMES_IN_FLIGHT);
+    m->array_length = array_length;
+    m->buffer_size = m->array_length * m->dtype_kernels->element_size;
+    m->next_ticket = 1;
+    m->files = files;
+    m->num_devices = compute_device__enumerate(m->devices, METAL_ADDER_MAX_DEVICES, settings->num_devices);
+    m->max_workers = settings->max_workers;
+    m->incremental = settings->incremental;
+    const bool fused_verify = settings->fused_verify && !m->incremental;
+
+    // Once a dispatch doesn't fit in the cache, the results are evicted before anything reads them
+    // again and caching them only costs the reads of the lines they overwrite. The fused checksums
+    // read the results right after writing them, so they want them in the cache, as do the few chunks
+    // of an incremental dispatch.
+    const uint64_t llc_size = cpu_kernels__llc_size();
+    const bool streaming = settings->stores == METAL_ADDER_STORES_STREAMING
+        || (settings->stores == METAL_ADDER_STORES_AUTO && !fused_verify && !m->incremental && 3 * m->buffer_size > llc_size);
+    const uint64_t prefetch_distance = settings->prefetch_distance ? settings->prefetch_distance : METAL_ADDER_DEFAULT_PREFETCH_DISTANCE;
+
+    TM_LOG("CPU adder using %s kernels, %llu %s elements per array, %llu elements per job, %u frames in flight, %u devices\n",
+        m->kernels->name, (unsigned long long)m->array_length, m->dtype_kernels->name, (unsigned long long)m->grain_size, m->frames_in_flight,
+        m->num_devices);
+    TM_LOG("  %s stores, %llu KB last-level cache\n", streaming ? "streaming" : "cached", (unsigned long long)(llc_size >> 10));
+    for (uint32_t d = 0; d < m->num_devices && m->num_devices > 1; ++d)
+        TM_LOG("  %s: %u CPUs\n", m->devices[d].name, m->devices[d].num_cpus);
+
+    // Buffers are placed for the initial split, which weights the devices by CPU count.
+    uint64_t offsets[METAL_ADDER_MAX_DEVICES + 1];
+    compute_device__split(m->devices, m->num_devices, m->array_length, m->grain_size, offsets);
+    const uint32_t element_size = m->dtype_kernels->element_size;
+
+    // Create and prepare data
+    const uint64_t num_blocks = (m->array_length + m->grain_size - 1) / m->grain_size;
+    for (uint32_t i = 0; i < m->frames_in_flight; ++i) {
+        buffer_set_t *set = m->buffer_sets + i;
+
+        set->kernels = m->dtype_kernels;
+        set->prefetch_distance = streaming ? prefetch_distance : 0;
+        dirty_chunks__init(&set->dirty, &m->allocator, m->array_length, m->grain_size, m->incremental == METAL_ADDER_INCREMENTAL_HASHED);
+        if (fused_verify) {
+            set->block_size = m->grain_size;
+            set->checksums = (uint32_t *)tm_alloc(&m->allocator, num_blocks * sizeof(uint32_t));
+            set->expected = (uint32_t *)tm_alloc(&m->allocator, num_blocks * sizeof(uint32_t));
+        }
+
+        // The kernels read and write file mappings directly, the page cache is the only copy.
+        if (m->files.result.data) {
+            set->result = m->files.result.data;
+        } else {
+            ADDER_TRACE_BEGIN_SCOPE(m->trace, allocate_buffers);
+            set->result = tm_alloc(&m->buffer_allocator, m->buffer_size);
+            ADDER_TRACE_END_SCOPE(m->trace, allocate_buffers);
+
+            // The result is first written by the dispatch itself, touch it with the same job split
+            // up front so its pages don't all land on whichever node runs the first job.
+            ADDER_TRACE_BEGIN_SCOPE(m->trace, first_touch);
+            buffer_allocator__first_touch_shards(set->result, m->buffer_size, m->grain_size, element_size, m->devices, m->num_devices, offsets);
+            ADDER_TRACE_END_SCOPE_WITH_BYTES(m->trace, first_touch, m->buffer_size);
+        }
+
+        if (m->files.a.data) {
+            set->buffer_a = m->files.a.data;
+            set->buffer_b = m->files.b.data;
+            continue;
+        }
+
+        ADDER_TRACE_BEGIN_SCOPE(m->trace, allocate_buffers);
+        set->buffer_a = tm_alloc(&m->buffer_allocator, m->buffer_size);
+        set->buffer_b = tm_alloc(&m->buffer_allocator, m->buffer_size);
+        ADDER_TRACE_END_SCOPE(m->trace, allocate_buffers);
+
+        // The random fill uses the same job split as the dispatches, so it also first-touches the
+        // inputs. With several devices the jobs also need to run on the right device, which the
+        // fill doesn't do, so they are touched by device first.
+        if (m->num_devices > 1) {
+            ADDER_TRACE_BEGIN_SCOPE(m->trace, first_touch);
+            buffer_allocator__first_touch_shards(set->buffer_a, m->buffer_size, m->grain_size, element_size, m->devices, m->num_devices, offsets);
+            buffer_allocator__first_touch_shards(set->buffer_b, m->buffer_size, m->grain_size, element_size, m->devices, m->num_devices, offsets);
+            ADDER_TRACE_END_SCOPE_WITH_BYTES(m->trace, first_touch, 2 * m->buffer_size);
+        }
+
+        ADDER_TRACE_BEGIN_SCOPE(m->trace, random_fill);
+        cpu_kernels__generate_random(m->dtype_kernels, set->buffer_a, m->array_length, settings->seed, 2 * i, m->grain_size);
+        cpu_kernels__generate_random(m->dtype_kernels, set->buffer_b, m->array_length, settings->seed, 2 * i + 1, m->grain_size);
+        ADDER_TRACE_END_SCOPE_WITH_BYTES(m->trace, random_fill, 2 * m->buffer_size);
+    }
+
+    // The checksums every dispatch should produce are known up front, and only change with the
+    // inputs that are written by `write_input()`.
+    if (fused_verify) {
+        ADDER_TRACE_BEGIN_SCOPE(m->trace, expected_checksums);
+        for (uint32_t i = 0; i < m->frames_in_flight; ++i) {
+            buffer_set_t *set = m->buffer_sets + i;
+            cpu_kernels__add_checksums(m->dtype_kernels, set->buffer_a, set->buffer_b, 0, m->array_length, set->block_size, set->expected);
+            dirty_chunks__collect(&set->dirty, set->buffer_a, set->buffer_b, element_size);
+        }
+        ADDER_TRACE_END_SCOPE_WITH_BYTES(m->trace, expected_checksums, 2 * m->buffer_size * m->frames_in_flight);
+    }
+
+    ADDER_TRACE_END_SCOPE(m->trace, init);
+
+    return m;
+}
+
+static void private__add_arrays_job(void *data, uint64_t begin, uint64_t end)
+{
+    const buffer_set_t *set = (const buffer_set_t *)data;
+    const uint64_t offset = begin * set->kernels->element_size;
+    const void *a = (const char *)set->buffer_a + offset, *b = (const char *)set->buffer_b + offset;
+    void *result = (char *)set->result + offset;
+    if (set->prefetch_distance)
+        set->kernels->add_arrays_streaming(a, b, result, end - begin, set->prefetch_distance);
+    else
+        set->kernels->add_arrays(a, b, result, end - begin);
+
+    // A job is at most one block, and its results are still in cache. An empty range would clobber
+    // the checksum of the block that the next shard starts with.
+    if (set->checksums && end > begin)
+        set->checksums[begin / set->block_size] = set->kernels->checksum(result, begin, end - begin);
+}
+
+// Runs `private__add_arrays_job()` on the stale chunks `[begin, end)` of `set->dirty.stale`.
+static void private__add_chunks_job(void *data, uint64_t begin, uint64_t end)
+{
+    const buffer_set_t *set = (const buffer_set_t *)data;
+    const dirty_chunks_t *dirty = &set->dirty;
+    for (uint64_t j = begin; j < end; ++j) {
+        const uint64_t first = dirty->stale[j] * dirty->chunk_length;
+        private__add_arrays_job(data, first, tm_min(first + dirty->chunk_length, dirty->n));
+    }
+}
+
+// Returns the index of the first chunk in `dirty->stale` that is at or after `chunk`.
+static uint64_t private__first_stale(const dirty_chunks_t *dirty, uint64_t chunk)
+{
+    uint64_t lo = 0, hi = dirty->num_stale;
+    while (lo < hi) {
+        const uint64_t mid = (lo + hi) / 2;
+        if (dirty->stale[mid] < chunk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static buffer_set_t *private__buffer_set(metal_adder_o *cpu_adder, metal_adder_ticket_t ticket)
+{
+    return cpu_adder->buffer_sets + (ticket.id - 1) % cpu_adder->frames_in_flight;
+}
+
+// Waits for the dispatch on `set` (if any), then verifies it and reports the completion.
+static void private__retire(metal_adder_o *cpu_adder, buffer_set_t *set)
+{
+    if (!set->num_shards)
+        return;
+
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    const uint64_t count = cpu_adder->incremental ? set->dirty.num_stale_elements : cpu_adder->array_length;
+    metal_adder_result_t res = { .ticket = set->ticket, .count = count, .timings = { .encode = set->encode_time } };
+
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(wait);
+    const tm_clock_o wait_start = tm_os_api->time->now();
+
+    // The shards run concurrently, the dispatch takes as long as the slowest one. Incremental
+    // dispatches only run a few chunks, so their timings would mostly measure the job overhead.
+    double seconds[METAL_ADDER_MAX_DEVICES];
+    res.timings.execute = cpu_kernels__wait_group(set->dispatch, seconds);
+    for (uint32_t d = 0; !cpu_adder->incremental && d < set->num_shards; ++d)
+        compute_device__record(cpu_adder->devices + d, set->offsets[d + 1] - set->offsets[d], seconds[d]);
+    set->num_shards = 0;
+    TM_PROFILER_END_LOCAL_SCOPE(wait);
+
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(verify);
+    const tm_clock_o verify_start = tm_os_api->time->now();
+    cpu_kernels_verify_report_t report;
+    if (cpu_adder->incremental) {
+        res.ok = cpu_kernels__verify_add_blocks(cpu_adder->dtype_kernels, set->buffer_a, set->buffer_b, set->result, cpu_adder->array_length,
+            cpu_adder->grain_size, set->dirty.stale, set->dirty.num_stale, cpu_adder->ulp_tolerance, &report);
+
+        // Failed chunks are recomputed by the next dispatch, instead of being taken as up to date.
+        if (!res.ok)
+            dirty_chunks__mark_collected(&set->dirty);
+    } else if (set->checksums) {
+        res.ok = cpu_kernels__verify_add_checksums(cpu_adder->dtype_kernels, set->buffer_a, set->buffer_b, set->result, cpu_adder->array_length,
+            set->block_size, set->expected, set->checksums, cpu_adder->ulp_tolerance, &report);
+    } else {
+        res.ok = cpu_kernels__verify_add(cpu_adder->dtype_kernels, set->buffer_a, set->buffer_b, set->result, cpu_adder->array_length,
+            cpu_adder->grain_size, cpu_adder->ulp_tolerance, &report);
+    }
+    const tm_clock_o verify_end = tm_os_api->time->now();
+    TM_PROFILER_END_LOCAL_SCOPE(verify);
+
+    res.timings.wait = tm_os_api->time->delta(verify_start, wait_start);
+    res.timings.verify = tm_os_api->time->delta(verify_end, verify_start);
+
+    // The jobs start running as soon as they're submitted, so the dispatch executes from the submit
+    // time.
+    const uint64_t dispatch_bytes = 3 * count * cpu_adder->dtype_kernels->element_size;
+    const uint64_t verify_bytes = 3 * report.num_diffed * cpu_adder->dtype_kernels->element_size;
+    adder_trace__event(cpu_adder->trace, "execute", ADDER_TRACE_TRACK_DEVICE, set->submit_time, res.timings.execute);
+    adder_trace__event(cpu_adder->trace, "wait", ADDER_TRACE_TRACK_HOST, wait_start, res.timings.wait);
+    adder_trace__event(cpu_adder->trace, "verify", ADDER_TRACE_TRACK_HOST, verify_start, res.timings.verify);
+    adder_trace__throughput(cpu_adder->trace, "execute", verify_start, dispatch_bytes, res.timings.execute);
+    adder_trace__throughput(cpu_adder->trace, "verify", verify_end, verify_bytes, res.timings.verify);
+
+    TM_PROFILER_END_FUNC_SCOPE();
+
+    if (set->completion.f)
+        set->completion.f(set->completion.ud, &res);
+}
+
+static metal_adder_ticket_t submit(struct metal_adder_o *cpu_adder, const metal_adder_completion_t *completion)
+{
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    const metal_adder_ticket_t ticket = { cpu_adder->next_ticket++ };
+    buffer_set_t *set = private__buffer_set(cpu_adder, ticket);
+    private__retire(cpu_adder, set);
+
+    set->ticket = ticket;
+    set->completion = completion ? *completion : (metal_adder_completion_t){ 0 };
+
+    // Each job handles a cache-sized slice of the grid, the same way the Metal backend hands
+    // threadgroups to the GPU.
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(encode);
+    set->submit_time = tm_os_api->time->now();
+    const bool incremental = cpu_adder->incremental;
+    if (incremental || set->expected) {
+        const uint64_t element_size = cpu_adder->dtype_kernels->element_size;
+        dirty_chunks__collect(&set->dirty, set->buffer_a, set->buffer_b, (uint32_t)element_size);
+
+        // Without incremental dispatches everything is recomputed, but the expected checksums of
+        // the changed blocks are out of date.
+        for (uint64_t j = 0; !incremental && j < set->dirty.num_stale;) {
+            uint64_t first, n;
+            const uint64_t next = dirty_chunks__run(&set->dirty, j, &first, &n);
+            cpu_kernels__add_checksums(cpu_adder->dtype_kernels, (const char *)set->buffer_a + first * element_size,
+                (const char *)set->buffer_b + first * element_size, first, n, set->block_size, set->expected + first / set->block_size);
+            j = next;
+        }
+    }
+    compute_device__split(cpu_adder->devices, cpu_adder->num_devices, cpu_adder->array_length, cpu_adder->grain_size, set->offsets);
+    cpu_kernels_parallel_for_t shards[METAL_ADDER_MAX_DEVICES];
+    for (uint32_t d = 0; d < cpu_adder->num_devices; ++d) {
+        // Incremental dispatches run one job per stale chunk in the device's shard, the shards are
+        // whole chunks.
+        uint64_t first = set->offsets[d], n = set->offsets[d + 1] - set->offsets[d], grain_size = cpu_adder->grain_size;
+        void (*f)(void *, uint64_t, uint64_t) = private__add_arrays_job;
+        if (incremental) {
+            first = private__first_stale(&set->dirty, set->offsets[d] / cpu_adder->grain_size);
+            n = private__first_stale(&set->dirty, (set->offsets[d + 1] + cpu_adder->grain_size - 1) / cpu_adder->grain_size) - first;
+            grain_size = 1;
+            f = private__add_chunks_job;
+        }
+        set->shards[d] = (compute_device_shard_t){ .device = cpu_adder->devices + d, .f = f, .data = set, .first = first };
+        shards[d] = (cpu_kernels_parallel_for_t){ .n = n, .grain_size = grain_size, .f = compute_device__shard_job, .data = set->shards + d };
+    }
+    set->dispatch = cpu_kernels__parallel_for_group_async(&cpu_adder->allocator, shards, cpu_adder->num_devices, cpu_adder->max_workers);
+    set->num_shards = cpu_adder->num_devices;
+    set->encode_time = tm_os_api->time->delta(tm_os_api->time->now(), set->submit_time);
+    TM_PROFILER_END_LOCAL_SCOPE(encode);
+    adder_trace__event(cpu_adder->trace, "encode", ADDER_TRACE_TRACK_HOST, set->submit_time, set->encode_time);
+
+    TM_PROFILER_END_FUNC_SCOPE();
+    return ticket;
+}
+
+static bool is_complete(struct metal_adder_o *cpu_adder, metal_adder_ticket_t ticket)
+{
+    buffer_set_t *set = private__buffer_set(cpu_adder, ticket);
+    if (set->ticket.id != ticket.id || !set->num_shards)
+        return true;
+    if (!cpu_kernels__is_done(set->dispatch))
+        return false;
+    private__retire(cpu_adder, set);
+    return true;
+}
+
+static void wait_for_completion(struct metal_adder_o *cpu_adder, metal_adder_ticket_t ticket)
+{
+    buffer_set_t *set = private__buffer_set(cpu_adder, ticket);
+    if (set->ticket.id == ticket.id)
+        private__retire(cpu_adder, set);
+}
+
+static void send_compute_command(struct metal_adder_o *cpu_adder)
+{
+    wait_for_completion(cpu_adder, submit(cpu_adder, NULL));
+}
+
+typedef struct add_batch_job_t
+{
+    const cpu_kernels_t *kernels;
+    const metal_adder_segment_t *segments;
+
+    // `offsets[i]` is the index of the first element of segment `i` when all the segments are laid
+    // out after each other, `offsets[num_segments]` is the total number of elements.
+    const uint64_t *offsets;
+    uint32_t num_segments;
+    TM_PAD(4);
+} add_batch_job_t;
+
+static void private__add_batch_job(void *data, uint64_t begin, uint64_t end)
+{
+    const add_batch_job_t *job = (const add_batch_job_t *)data;
+
+    // Find the last segment that starts at or before `begin`.
+    uint32_t lo = 0, hi = job->num_segments;
+    while (lo + 1 < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+        if (job->offsets[mid] <= begin)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // A job's range can span several small segments.
+    for (uint32_t s = lo; begin < end; ++s) {
+        const metal_adder_segment_t *seg = job->segments + s;
+        const uint64_t first = begin - job->offsets[s];
+        const uint64_t n = tm_min(end, job->offsets[s + 1]) - begin;
+        job->kernels->add_arrays(seg->a + first, seg->b + first, seg->result + first, n);
+        begin += n;
+    }
+}
+
+static void add_batch(struct metal_adder_o *cpu_adder, const metal_adder_segment_t *segments, uint32_t num_segments)
+{
+    if (!num_segments)
+        return;
+
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, add_batch);
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    uint64_t *offsets = (uint64_t *)tm_temp_alloc(ta, (num_segments + 1) * sizeof(uint64_t));
+    offsets[0] = 0;
+    for (uint32_t i = 0; i < num_segments; ++i)
+        offsets[i + 1] = offsets[i] + segments[i].count;
+
+    add_batch_job_t job = {
+        .kernels = cpu_adder->kernels,
+        .segments = segments,
+        .offsets = offsets,
+        .num_segments = num_segments,
+    };
+    cpu_kernels__parallel_for(offsets[num_segments], cpu_adder->grain_size, private__add_batch_job, &job);
+
+    const uint64_t bytes = 3 * sizeof(float) * offsets[num_segments];
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(cpu_adder->trace, add_batch, bytes);
+}
+
+struct metal_adder_expr_o
+{
+    fused_expr_program_t *program;
+
+    // Kernel cache key of the expression, see `compile_expr()`.
+    uint64_t key;
+
+    uint32_t num_inputs;
+
+    // Number of `compile_expr()` calls that returned this expression and haven't released it.
+    uint32_t ref_count;
+};
+
+// The CPU programs are cheap to build compared to a GPU pipeline, so instead of storing them on disk
+// the adder shares the compiled program between all `compile_expr()` calls with the same expression
+// and kernel set, using the same kind of key as the Metal backend's kernel cache.
+static struct metal_adder_expr_o *compile_expr(struct metal_adder_o *cpu_adder, const metal_adder_expr_t *expr)
+{
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, compile_expr);
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    const char *options = tm_temp_allocator_api->printf(ta, "cpu;%s;inputs=%u", cpu_adder->kernels->name, expr->num_inputs);
+    const uint64_t key = kernel_cache__key(expr->nodes, expr->num_nodes * sizeof(metal_adder_expr_node_t), options);
+
+    metal_adder_expr_o *e = NULL;
+    for (metal_adder_expr_o **it = cpu_adder->exprs; it != tm_carray_end(cpu_adder->exprs); ++it) {
+        if ((*it)->key == key) {
+            e = *it;
+            ++e->ref_count;
+            break;
+        }
+    }
+
+    if (!e) {
+        fused_expr_program_t *program = fused_expr__compile_cpu(expr, &cpu_adder->allocator);
+        if (program) {
+            e = (metal_adder_expr_o *)tm_alloc(&cpu_adder->allocator, sizeof(metal_adder_expr_o));
+            *e = (metal_adder_expr_o){ .program = program, .key = key, .num_inputs = expr->num_inputs, .ref_count = 1 };
+            tm_carray_push(cpu_adder->exprs, e, &cpu_adder->allocator);
+        }
+    }
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    ADDER_TRACE_END_SCOPE(cpu_adder->trace, compile_expr);
+    return e;
+}
+
+static void run_expr(struct metal_adder_o *cpu_adder, const struct metal_adder_expr_o *expr, const float *const *inputs,
+    float *result, uint64_t count)
+{
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, run_expr);
+    fused_expr__run_cpu(expr->program, inputs, result, count, cpu_adder->grain_size);
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(cpu_adder->trace, run_expr, (expr->num_inputs + 1) * count * sizeof(float));
+}
+
+static void private__free_expr(metal_adder_o *cpu_adder, metal_adder_expr_o *expr)
+{
+    fused_expr__free_cpu(expr->program);
+    tm_free(&cpu_adder->allocator, expr, sizeof(metal_adder_expr_o));
+}
+
+static void release_expr(struct metal_adder_o *cpu_adder, struct metal_adder_expr_o *expr)
+{
+    if (!expr || --expr->ref_count)
+        return;
+    for (metal_adder_expr_o **it = cpu_adder->exprs; it != tm_carray_end(cpu_adder->exprs); ++it) {
+        if (*it == expr) {
+            *it = tm_carray_pop(cpu_adder->exprs);
+            break;
+        }
+    }
+    private__free_expr(cpu_adder, expr);
+}
+
+// Data of the jobs of one operation of a recorded graph.
+typedef struct graph_op_job_t
+{
+    const struct metal_adder_graph_o *graph;
+    const metal_adder_graph_op_t *op;
+    const float *inputs[METAL_ADDER_MAX_EXPR_INPUTS];
+    float *result;
+} graph_op_job_t;
+
+struct metal_adder_graph_o
+{
+    metal_adder_graph_op_t ops[METAL_ADDER_MAX_GRAPH_OPS];
+    uint32_t num_ops;
+    uint32_t num_arrays;
+    uint64_t array_length;
+
+    // Elements processed by the current run. The jobs are built for `array_length` and clamp their
+    // ranges to this.
+    uint64_t count;
+
+    // Float kernels the jobs add with.
+    const cpu_kernels_t *kernels;
+
+    float *arrays[METAL_ADDER_MAX_GRAPH_ARRAYS];
+    graph_op_job_t jobs[METAL_ADDER_MAX_GRAPH_OPS];
+    bool barriers[METAL_ADDER_MAX_GRAPH_OPS];
+
+    // One job list for each run of operations between barriers, with the jobs of all of them. The
+    // lists run one after the other.
+    cpu_kernels_job_list_o *waves[METAL_ADDER_MAX_GRAPH_OPS];
+    uint32_t num_waves;
+
+    // Number of arrays read or written by all the operations, for the trace.
+    uint32_t num_accesses;
+};
+
+static uint32_t private__expr_inputs(const struct metal_adder_expr_o *expr)
+{
+    return expr->num_inputs;
+}
+
+static void private__graph_op_job(void *data, uint64_t begin, uint64_t end)
+{
+    const graph_op_job_t *job = (const graph_op_job_t *)data;
+    end = tm_min(end, job->graph->count);
+    if (begin >= end)
+        return;
+    if (job->op->type == METAL_ADDER_GRAPH_OP_ADD)
+        job->graph->kernels->add_arrays(job->inputs[0] + begin, job->inputs[1] + begin, job->result + begin, end - begin);
+    else
+        fused_expr__run_cpu_range(job->op->expr->program, job->inputs, job->result, begin, end);
+}
+
+// Sets up `job` to run `op` on the arrays of `graph` and returns the number of arrays it uses.
+static uint32_t private__init_graph_op_job(const metal_adder_graph_o *graph, const metal_adder_graph_op_t *op, graph_op_job_t *job)
+{
+    const uint32_t num_args = adder_graph__num_args(op, private__expr_inputs);
+    *job = (graph_op_job_t){ .graph = graph, .op = op, .result = graph->arrays[op->args[num_args - 1]] };
+    for (uint32_t a = 0; a + 1 < num_args; ++a)
+        job->inputs[a] = graph->arrays[op->args[a]];
+    return num_args;
+}
+
+// Tile aligned, as in `fused_expr__run_cpu()`.
+static uint64_t private__graph_grain_size(const metal_adder_o *cpu_adder)
+{
+    return tm_max(cpu_adder->grain_size / FUSED_EXPR_TILE_SIZE, 1) * FUSED_EXPR_TILE_SIZE;
+}
+
+// (Re)builds the job lists of `graph`. The job lists point to code, so this has to be done again
+// after a hot reload.
+static void private__build_graph_jobs(metal_adder_o *cpu_adder, metal_adder_graph_o *graph)
+{
+    for (uint32_t w = 0; w < graph->num_waves; ++w)
+        cpu_kernels__job_list_free(graph->waves[w]);
+    graph->num_waves = 0;
+    graph->kernels = cpu_adder->kernels;
+
+    const uint64_t grain_size = private__graph_grain_size(cpu_adder);
+    for (uint32_t i = 0; i < graph->num_ops; ++i) {
+        if (!graph->num_waves || graph->barriers[i])
+            graph->waves[graph->num_waves++] = cpu_kernels__job_list_create(&cpu_adder->allocator);
+        cpu_kernels__job_list_add(graph->waves[graph->num_waves - 1], graph->array_length, grain_size, private__graph_op_job, graph->jobs + i);
+    }
+}
+
+static struct metal_adder_graph_o *record_graph(struct metal_adder_o *cpu_adder, const metal_adder_graph_t *graph)
+{
+    bool barriers[METAL_ADDER_MAX_GRAPH_OPS];
+    if (!adder_graph__plan(graph, private__expr_inputs, barriers))
+        return NULL;
+
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, record_graph);
+
+    metal_adder_graph_o *g = (metal_adder_graph_o *)tm_alloc(&cpu_adder->allocator, sizeof(metal_adder_graph_o));
+    memset(g, 0, sizeof(metal_adder_graph_o));
+    memcpy(g->ops, graph->ops, graph->num_ops * sizeof(metal_adder_graph_op_t));
+    memcpy(g->barriers, barriers, graph->num_ops * sizeof(bool));
+    g->num_ops = graph->num_ops;
+    g->num_arrays = graph->num_arrays;
+    g->array_length = graph->array_length;
+    g->count = graph->array_length;
+    for (uint32_t i = 0; i < g->num_arrays; ++i)
+        g->arrays[i] = (float *)tm_alloc(&cpu_adder->buffer_allocator, g->array_length * sizeof(float));
+
+    for (uint32_t i = 0; i < g->num_ops; ++i)
+        g->num_accesses += private__init_graph_op_job(g, g->ops + i, g->jobs + i);
+    private__build_graph_jobs(cpu_adder, g);
+    tm_carray_push(cpu_adder->graphs, g, &cpu_adder->allocator);
+
+    ADDER_TRACE_END_SCOPE(cpu_adder->trace, record_graph);
+    return g;
+}
+
+static float *graph_array(struct metal_adder_o *cpu_adder, struct metal_adder_graph_o *graph, uint32_t array)
+{
+    return array < graph->num_arrays ? graph->arrays[array] : NULL;
+}
+
+static void run_graph(struct metal_adder_o *cpu_adder, struct metal_adder_graph_o *graph, uint64_t count)
+{
+    graph->count = tm_min(count, graph->array_length);
+    if (!graph->count)
+        return;
+
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, run_graph);
+    for (uint32_t w = 0; w < graph->num_waves; ++w)
+        cpu_kernels__job_list_run(graph->waves[w]);
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(cpu_adder->trace, run_graph, graph->num_accesses * graph->count * sizeof(float));
+}
+
+// Device tasks of one `adder_graph_device_i::start()`, each running as a parallel-for.
+typedef struct task_batch_t
+{
+    uint32_t num_tasks;
+    TM_PAD(4);
+    graph_op_job_t jobs[METAL_ADDER_MAX_TASKS];
+    cpu_kernels_async_o *dispatches[METAL_ADDER_MAX_TASKS];
+} task_batch_t;
+
+// Instance of the `adder_graph_device_i` of `run_tasks()`.
+typedef struct device_tasks_t
+{
+    metal_adder_o *cpu_adder;
+    metal_adder_graph_o *graph;
+} device_tasks_t;
+
+static void *private__start_device_tasks(void *inst, const metal_adder_task_t *tasks, const uint32_t *ids, uint32_t n, uint64_t count)
+{
+    const device_tasks_t *d = (const device_tasks_t *)inst;
+    task_batch_t *batch = (task_batch_t *)tm_alloc(&d->cpu_adder->allocator, sizeof(task_batch_t));
+    batch->num_tasks = n;
+    const uint64_t grain_size = private__graph_grain_size(d->cpu_adder);
+    for (uint32_t i = 0; i < n; ++i) {
+        private__init_graph_op_job(d->graph, &tasks[ids[i]].op, batch->jobs + i);
+        batch->dispatches[i] = cpu_kernels__parallel_for_async(&d->cpu_adder->allocator, count, grain_size, private__graph_op_job, batch->jobs + i);
+    }
+    return batch;
+}
+
+static bool private__poll_device_tasks(void *inst, void *handle)
+{
+    const device_tasks_t *d = (const device_tasks_t *)inst;
+    task_batch_t *batch = (task_batch_t *)handle;
+    for (uint32_t i = 0; i < batch->num_tasks; ++i) {
+        if (!cpu_kernels__is_done(batch->dispatches[i]))
+            return false;
+    }
+    for (uint32_t i = 0; i < batch->num_tasks; ++i)
+        cpu_kernels__wait(batch->dispatches[i]);
+    tm_free(&d->cpu_adder->allocator, batch, sizeof(task_batch_t));
+    return true;
+}
+
+static bool run_tasks(struct metal_adder_o *cpu_adder, struct metal_adder_graph_o *graph, const metal_adder_task_t *tasks,
+    uint32_t num_tasks, uint64_t count)
+{
+    graph->count = tm_min(count, graph->array_length);
+    if (!graph->count)
+        return true;
+
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, run_tasks);
+    device_tasks_t d = { .cpu_adder = cpu_adder, .graph = graph };
+    const adder_graph_device_i device = { .inst = &d, .start = private__start_device_tasks, .poll = private__poll_device_tasks };
+    const bool ok = adder_graph__run_tasks(tasks, num_tasks, graph->arrays, graph->num_arrays, graph->count, private__expr_inputs, &device);
+    ADDER_TRACE_END_SCOPE(cpu_adder->trace, run_tasks);
+    return ok;
+}
+
+static void private__free_graph(metal_adder_o *cpu_adder, metal_adder_graph_o *graph)
+{
+    for (uint32_t w = 0; w < graph->num_waves; ++w)
+        cpu_kernels__job_list_free(graph->waves[w]);
+    for (uint32_t i = 0; i < graph->num_arrays; ++i)
+        tm_free(&cpu_adder->buffer_allocator, graph->arrays[i], graph->array_length * sizeof(float));
+    tm_free(&cpu_adder->allocator, graph, sizeof(metal_adder_graph_o));
+}
+
+static void release_graph(struct metal_adder_o *cpu_adder, struct metal_adder_graph_o *graph)
+{
+    if (!graph)
+        return;
+    for (metal_adder_graph_o **it = cpu_adder->graphs; it != tm_carray_end(cpu_adder->graphs); ++it) {
+        if (*it == graph) {
+            *it = tm_carray_pop(cpu_adder->graphs);
+            break;
+        }
+    }
+    private__free_graph(cpu_adder, graph);
+}
+
+static const float *private__array(const buffer_set_t *set, enum metal_adder_array array)
+{
+    return (const float *)(array == METAL_ADDER_ARRAY_A ? set->buffer_a : array == METAL_ADDER_ARRAY_B ? set->buffer_b : set->result);
+}
+
+static double reduce(struct metal_adder_o *cpu_adder, metal_adder_ticket_t ticket, enum metal_adder_reduce_op op,
+    enum metal_adder_array x, enum metal_adder_array y)
+{
+    buffer_set_t *set = private__buffer_set(cpu_adder, ticket);
+    if (set->ticket.id != ticket.id) {
+        TM_LOG("Can't reduce dispatch %llu, its buffers have been reused\n", (unsigned long long)ticket.id);
+        return NAN;
+    }
+    if (cpu_adder->dtype != METAL_ADDER_DTYPE_FLOAT) {
+        TM_LOG("Can't reduce %s arrays, only floats are supported\n", cpu_adder->dtype_kernels->name);
+        return NAN;
+    }
+    private__retire(cpu_adder, set);
+
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, reduce);
+    const float *a = private__array(set, x);
+    double res;
+    if (op == METAL_ADDER_REDUCE_OP_SUM || op == METAL_ADDER_REDUCE_OP_DOT) {
+        const float *b = op == METAL_ADDER_REDUCE_OP_DOT ? private__array(set, y) : NULL;
+        res = cpu_kernels__sum(cpu_adder->kernels, a, b, cpu_adder->array_length, cpu_adder->grain_size);
+    } else {
+        float min, max;
+        cpu_kernels__min_max(cpu_adder->kernels, a, cpu_adder->array_length, cpu_adder->grain_size, &min, &max);
+        res = op == METAL_ADDER_REDUCE_OP_MIN ? min : max;
+    }
+    const uint64_t num_arrays = op == METAL_ADDER_REDUCE_OP_DOT ? 2 : 1;
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(cpu_adder->trace, reduce, num_arrays * cpu_adder->buffer_size);
+    return res;
+}
+
+typedef struct stream_add_t
+{
+    const cpu_kernels_t *kernels;
+    const adder_stream_slot_t *buffers;
+} stream_add_t;
+
+static void private__stream_add_job(void *data, uint64_t begin, uint64_t end)
+{
+    const stream_add_t *add = (const stream_add_t *)data;
+    add->kernels->add_arrays(add->buffers->a + begin, add->buffers->b + begin, add->buffers->result + begin, end - begin);
+}
+
+static void private__stream_add(void *inst, uint32_t slot, const adder_stream_slot_t *buffers, uint64_t count)
+{
+    const metal_adder_o *cpu_adder = (const metal_adder_o *)inst;
+    stream_add_t add = { .kernels = cpu_adder->kernels, .buffers = buffers };
+    cpu_kernels__parallel_for(count, cpu_adder->grain_size, private__stream_add_job, &add);
+}
+
+static uint64_t stream_files(struct metal_adder_o *cpu_adder, const metal_adder_stream_t *stream)
+{
+    adder_stream_o *s = adder_stream__open(&cpu_adder->allocator, stream);
+    if (!s)
+        return 0;
+
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, stream_files);
+
+    const uint64_t chunk_size = adder_stream__chunk_length(s) * sizeof(float);
+    adder_stream_slot_t slots[METAL_ADDER_STREAM_RING_SIZE];
+    for (uint32_t i = 0; i < METAL_ADDER_STREAM_RING_SIZE; ++i) {
+        slots[i].a = (float *)tm_alloc(&cpu_adder->buffer_allocator, chunk_size);
+        slots[i].b = (float *)tm_alloc(&cpu_adder->buffer_allocator, chunk_size);
+        slots[i].result = (float *)tm_alloc(&cpu_adder->buffer_allocator, chunk_size);
+    }
+
+    const uint64_t n = adder_stream__run(s, slots, private__stream_add, cpu_adder, cpu_adder->trace);
+
+    for (uint32_t i = 0; i < METAL_ADDER_STREAM_RING_SIZE; ++i) {
+        tm_free(&cpu_adder->buffer_allocator, slots[i].a, chunk_size);
+        tm_free(&cpu_adder->buffer_allocator, slots[i].b, chunk_size);
+        tm_free(&cpu_adder->buffer_allocator, slots[i].result, chunk_size);
+    }
+    adder_stream__close(s);
+
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(cpu_adder->trace, stream_files, 3 * n * sizeof(float));
+    return n;
+}
+
+// Retires all dispatches in flight, in submission order, so completions are reported in the order
+// they were submitted.
+static void private__retire_all(metal_adder_o *cpu_adder)
+{
+    const uint64_t num_sets = tm_min(cpu_adder->next_ticket - 1, cpu_adder->frames_in_flight);
+    for (uint64_t id = cpu_adder->next_ticket - num_sets; id < cpu_adder->next_ticket; ++id)
+        wait_for_completion(cpu_adder, (metal_adder_ticket_t){ id });
+}
+
+static void *write_input(struct metal_adder_o *cpu_adder, enum metal_adder_array array, uint64_t first, uint64_t count)
+{
+    if (array == METAL_ADDER_ARRAY_RESULT || first > cpu_adder->array_length || count > cpu_adder->array_length - first)
+        return NULL;
+
+    // Input files are read by the dispatches of every buffer set. The buffers live as long as the
+    // adder and only `submit()` dispatches on `set`, so the pointer stays valid until then.
+    buffer_set_t *set = private__buffer_set(cpu_adder, (metal_adder_ticket_t){ cpu_adder->next_ticket });
+    if (cpu_adder->files.a.data) {
+        private__retire_all(cpu_adder);
+        for (uint32_t i = 0; i < cpu_adder->frames_in_flight; ++i)
+            dirty_chunks__mark(&cpu_adder->buffer_sets[i].dirty, first, count);
+    } else {
+        private__retire(cpu_adder, set);
+        dirty_chunks__mark(&set->dirty, first, count);
+    }
+
+    char *buffer = (char *)(array == METAL_ADDER_ARRAY_A ? set->buffer_a : set->buffer_b);
+    return buffer + first * cpu_adder->dtype_kernels->element_size;
+}
+
+// The kernel sets are static data of the DLL, so after a hot reload `kernels` still points into the
+// code that was loaded when the adder was created, as do the buffer allocator's `realloc` and the
+// jobs of the recorded graphs. The rest of the adder is plain data that stays valid.
+static void reload(struct metal_adder_o *cpu_adder, const metal_adder_completion_t *completion)
+{
+    ADDER_TRACE_BEGIN_SCOPE(cpu_adder->trace, reload);
+
+    for (uint32_t i = 0; i < cpu_adder->frames_in_flight; ++i)
+        cpu_adder->buffer_sets[i].completion = completion ? *completion : (metal_adder_completion_t){ 0 };
+    private__retire_all(cpu_adder);
+
+    buffer_allocator__rebind(&cpu_adder->buffer_allocator);
+    cpu_adder->kernels = cpu_kernels__select_isa(cpu_adder->isa);
+    cpu_adder->dtype_kernels = cpu_kernels__select_dtype(cpu_adder->kernels, cpu_adder->dtype);
+    for (uint32_t i = 0; i < cpu_adder->frames_in_flight; ++i)
+        cpu_adder->buffer_sets[i].kernels = cpu_adder->dtype_kernels;
+    for (metal_adder_graph_o **it = cpu_adder->graphs; it != tm_carray_end(cpu_adder->graphs); ++it)
+        private__build_graph_jobs(cpu_adder, *it);
+
+    ADDER_TRACE_END_SCOPE(cpu_adder->trace, reload);
+    TM_LOG("CPU adder reloaded, using %s kernels\n", cpu_adder->kernels->name);
+}
+
+static void shutdown(struct metal_adder_o *cpu_adder)
+{
+    private__retire_all(cpu_adder);
+
+    for (uint32_t d = 0; d < cpu_adder->num_devices && cpu_adder->num_devices > 1; ++d)
+        TM_LOG("  %s: %.2f GB/s\n", cpu_adder->devices[d].name, cpu_adder->devices[d].throughput * 3 * cpu_adder->dtype_kernels->element_size * 1e-9);
+
+    for (uint32_t i = 0; i < cpu_adder->frames_in_flight; ++i) {
+        buffer_set_t *set = cpu_adder->buffer_sets + i;
+        if (!cpu_adder->files.a.data) {
+            tm_free(&cpu_adder->buffer_allocator, set->buffer_a, cpu_adder->buffer_size);
+            tm_free(&cpu_adder->buffer_allocator, set->buffer_b, cpu_adder->buffer_size);
+        }
+        if (!cpu_adder->files.result.data)
+            tm_free(&cpu_adder->buffer_allocator, set->result, cpu_adder->buffer_size);
+        if (set->checksums) {
+            const uint64_t num_blocks = (cpu_adder->array_length + set->block_size - 1) / set->block_size;
+            tm_free(&cpu_adder->allocator, set->checksums, num_blocks * sizeof(uint32_t));
+            tm_free(&cpu_adder->allocator, set->expected, num_blocks * sizeof(uint32_t));
+        }
+        dirty_chunks__free(&set->dirty, &cpu_adder->allocator);
+    }
+    for (metal_adder_graph_o **it = cpu_adder->graphs; it != tm_carray_end(cpu_adder->graphs); ++it)
+        private__free_graph(cpu_adder, *it);
+    tm_carray_free(cpu_adder->graphs, &cpu_adder->allocator);
+    buffer_allocator__destroy(&cpu_adder->buffer_allocator);
+    mapped_file__close_adder_files(&cpu_adder->files);
+
+    for (metal_adder_expr_o **it = cpu_adder->exprs; it != tm_carray_end(cpu_adder->exprs); ++it)
+        private__free_expr(cpu_adder, *it);
+    tm_carray_free(cpu_adder->exprs, &cpu_adder->allocator);
+
+    adder_trace__destroy(cpu_adder->trace);
+
+    tm_allocator_i a = cpu_adder->allocator;
+    tm_free(&a, cpu_adder, sizeof(metal_adder_o));
+    tm_allocator_api->destroy_child(&a);
+}
+
+static struct metal_adder_api adder_api = {
+    .init = init,
+    .send_compute_command = send_compute_command,
+    .submit = submit,
+    .is_complete = is_complete,
+    .wait_for_completion = wait_for_completion,
+    .add_batch = add_batch,
+    .shutdown = shutdown,
+    .compile_expr = compile_expr,
+    .run_expr = run_expr,
+    .release_expr = release_expr,
+    .reload = reload,
+    .stream_files = stream_files,
+    .reduce = reduce,
+    .write_input = write_input,
+    .record_graph = record_graph,
+    .graph_array = graph_array,
+    .run_graph = run_graph,
+    .release_graph = release_graph,
+    .run_tasks = run_tasks,
+};
+
+extern "C" {
+void load_cpu_adder(struct tm_api_registry_api *reg, bool load);
+}
+
+void load_cpu_adder(struct tm_api_registry_api *reg, bool load)
+{
+    tm_set_or_remove_api(reg, load, metal_adder_api, &adder_api);
+}
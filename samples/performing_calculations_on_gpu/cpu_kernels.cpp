@@ -0,0 +1,1886 @@
+extern "C" {
+#include "cpu_kernels.h"
+#include "loader.h"
+
+#include <foundation/allocator.h>
+#include <foundation/carray.inl>
+#include <foundation/job_system.h>
+#include <foundation/log.h>
+#include <foundation/math.inl>
+#include <foundation/os.h>
+#include <foundation/temp_allocator.h>
+}
+
+#include <atomic>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(TM_OS_MACOSX)
+#include <sys/sysctl.h>
+#endif
+
+#if defined(TM_CPU_SSE)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(TM_CPU_NEON)
+#include <arm_neon.h>
+#endif
+
+static void private__add_arrays_scalar(const float *a, const float *b, float *result, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; ++i)
+        result[i] = a[i] + b[i];
+}
+
+// Compares bits rather than values, as `!=` would flag every NaN and let `-0` pass for `+0`. The
+// vector kernels do the same.
+static uint64_t private__find_add_mismatch_scalar(const float *a, const float *b, const float *result, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; ++i) {
+        const float expected = a[i] + b[i];
+        if (memcmp(result + i, &expected, sizeof(float)))
+            return i;
+    }
+    return n;
+}
+
+// The sums use Kahan summation: `c` holds the low-order bits lost when adding to `s`, and is
+// subtracted from the next term. The vector kernels do the same per lane.
+
+static double private__sum_scalar(const float *a, uint64_t n)
+{
+    float s = 0, c = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        const float y = a[i] - c;
+        const float t = s + y;
+        c = (t - s) - y;
+        s = t;
+    }
+    return (double)s - (double)c;
+}
+
+static double private__dot_scalar(const float *a, const float *b, uint64_t n)
+{
+    float s = 0, c = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        const float y = a[i] * b[i] - c;
+        const float t = s + y;
+        c = (t - s) - y;
+        s = t;
+    }
+    return (double)s - (double)c;
+}
+
+// Comparisons with NaN are false, so NaNs never replace the current extremes.
+static void private__min_max_scalar(const float *a, uint64_t n, float *min, float *max)
+{
+    float lo = *min, hi = *max;
+    for (uint64_t i = 0; i < n; ++i) {
+        lo = a[i] < lo ? a[i] : lo;
+        hi = a[i] > hi ? a[i] : hi;
+    }
+    *min = lo;
+    *max = hi;
+}
+
+// Merges the per-lane (or per-job) minimums `lo` and maximums `hi` into `*min` and `*max`.
+static void private__merge_min_max(const float *lo, const float *hi, uint64_t n, float *min, float *max)
+{
+    for (uint64_t i = 0; i < n; ++i) {
+        *min = lo[i] < *min ? lo[i] : *min;
+        *max = hi[i] > *max ? hi[i] : *max;
+    }
+}
+
+// Adds up the lane sums `s` and compensations `c` of a vector kernel in lane order.
+static double private__sum_lanes(const float *s, const float *c, uint32_t num_lanes)
+{
+    double sum = 0;
+    for (uint32_t i = 0; i < num_lanes; ++i)
+        sum += (double)s[i] - (double)c[i];
+    return sum;
+}
+
+// Random floats are a two-round keyed hash of the element index, using the `lowbias32` integer hash
+// by Chris Wellons. The top 24 bits of the hash are scaled to [0, 1), which is exact in a float. The
+// first round hashes the low 32 bits of the index, the key of the second round is derived from the
+// high 32 bits, so arrays of more than 2^32 elements don't repeat. The vector loops run on 32-bit
+// lanes, within ranges where the high bits don't change, see `private__random_runs()`.
+
+static inline uint32_t private__hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// Key of the second round for the elements whose index has the high 32 bits of `i`.
+static inline uint32_t private__random_key1(uint64_t i, const uint32_t key[2])
+{
+    return private__hash32((uint32_t)(i >> 32) ^ key[1]);
+}
+
+static inline float private__random_float_keyed(uint32_t i, uint32_t k0, uint32_t k1)
+{
+    const uint32_t h = private__hash32(private__hash32(i ^ k0) + k1);
+    return (float)(h >> 8) * (1.0f / 16777216.0f);
+}
+
+static inline float private__random_float(uint64_t i, const uint32_t key[2])
+{
+    return private__random_float_keyed((uint32_t)i, key[0], private__random_key1(i, key));
+}
+
+// Runs `f` on the parts of `[first, first + n)` that don't cross a multiple of 2^32, with the low 32
+// bits of the first index of the part and its keys.
+static inline void private__random_runs(float *data, uint64_t first, uint64_t n, const uint32_t key[2],
+    void (*f)(float *data, uint32_t first, uint64_t n, uint32_t k0, uint32_t k1))
+{
+    while (n) {
+        const uint64_t run = tm_min(n, (1ULL << 32) - (uint32_t)first);
+        f(data, (uint32_t)first, run, key[0], private__random_key1(first, key));
+        data += run;
+        first += run;
+        n -= run;
+    }
+}
+
+static void private__random_run_scalar(float *data, uint32_t first, uint64_t n, uint32_t k0, uint32_t k1)
+{
+    for (uint64_t i = 0; i < n; ++i)
+        data[i] = private__random_float_keyed(first + (uint32_t)i, k0, k1);
+}
+
+static void private__random_floats_scalar(float *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    private__random_runs(data, first, n, key, private__random_run_scalar);
+}
+
+// Without vector instructions there are no non-temporal stores either, the streaming kernels only
+// prefetch.
+static void private__add_arrays_streaming_scalar(const float *a, const float *b, float *result, uint64_t n, uint64_t prefetch_distance)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __builtin_prefetch((const char *)(a + i) + prefetch_distance);
+        __builtin_prefetch((const char *)(b + i) + prefetch_distance);
+        private__add_arrays_scalar(a + i, b + i, result + i, 16);
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+}
+
+// Number of elements before the first element of `result` that is aligned to `align` bytes, at
+// most `n`.
+static inline uint64_t private__unaligned_head(const void *result, uint64_t align, uint32_t element_size, uint64_t n)
+{
+    const uint64_t head = (uint64_t)(-(uintptr_t)result & (align - 1)) / element_size;
+    return head < n ? head : n;
+}
+
+// The vector kernels process four registers per iteration to keep enough loads in flight to saturate
+// memory bandwidth, then fall back to the scalar loop for the tail.
+
+#if defined(TM_CPU_SSE)
+static void private__add_arrays_sse2(const float *a, const float *b, float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128 a0 = _mm_loadu_ps(a + i + 0), b0 = _mm_loadu_ps(b + i + 0);
+        const __m128 a1 = _mm_loadu_ps(a + i + 4), b1 = _mm_loadu_ps(b + i + 4);
+        const __m128 a2 = _mm_loadu_ps(a + i + 8), b2 = _mm_loadu_ps(b + i + 8);
+        const __m128 a3 = _mm_loadu_ps(a + i + 12), b3 = _mm_loadu_ps(b + i + 12);
+        _mm_storeu_ps(result + i + 0, _mm_add_ps(a0, b0));
+        _mm_storeu_ps(result + i + 4, _mm_add_ps(a1, b1));
+        _mm_storeu_ps(result + i + 8, _mm_add_ps(a2, b2));
+        _mm_storeu_ps(result + i + 12, _mm_add_ps(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+}
+
+// The streaming kernels write the results with non-temporal stores, which go straight to memory
+// instead of first reading each cache line of `result` they overwrite, and prefetch the inputs
+// `prefetch_distance` bytes ahead. Each iteration covers one cache line of each array. The stores
+// need aligned addresses, so the elements before the first aligned one use regular stores.
+static void private__add_arrays_streaming_sse2(const float *a, const float *b, float *result, uint64_t n, uint64_t prefetch_distance)
+{
+    uint64_t i = private__unaligned_head(result, 16, sizeof(float), n);
+    private__add_arrays_scalar(a, b, result, i);
+    for (; i + 16 <= n; i += 16) {
+        _mm_prefetch((const char *)(a + i) + prefetch_distance, _MM_HINT_T0);
+        _mm_prefetch((const char *)(b + i) + prefetch_distance, _MM_HINT_T0);
+        const __m128 a0 = _mm_loadu_ps(a + i + 0), b0 = _mm_loadu_ps(b + i + 0);
+        const __m128 a1 = _mm_loadu_ps(a + i + 4), b1 = _mm_loadu_ps(b + i + 4);
+        const __m128 a2 = _mm_loadu_ps(a + i + 8), b2 = _mm_loadu_ps(b + i + 8);
+        const __m128 a3 = _mm_loadu_ps(a + i + 12), b3 = _mm_loadu_ps(b + i + 12);
+        _mm_stream_ps(result + i + 0, _mm_add_ps(a0, b0));
+        _mm_stream_ps(result + i + 4, _mm_add_ps(a1, b1));
+        _mm_stream_ps(result + i + 8, _mm_add_ps(a2, b2));
+        _mm_stream_ps(result + i + 12, _mm_add_ps(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+
+    // Non-temporal stores are weakly ordered, they must be visible before the job signals that it's
+    // done.
+    _mm_sfence();
+}
+
+static uint64_t private__find_add_mismatch_sse2(const float *a, const float *b, const float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128 ne0 = _mm_xor_ps(_mm_loadu_ps(result + i + 0), _mm_add_ps(_mm_loadu_ps(a + i + 0), _mm_loadu_ps(b + i + 0)));
+        const __m128 ne1 = _mm_xor_ps(_mm_loadu_ps(result + i + 4), _mm_add_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        const __m128 ne2 = _mm_xor_ps(_mm_loadu_ps(result + i + 8), _mm_add_ps(_mm_loadu_ps(a + i + 8), _mm_loadu_ps(b + i + 8)));
+        const __m128 ne3 = _mm_xor_ps(_mm_loadu_ps(result + i + 12), _mm_add_ps(_mm_loadu_ps(a + i + 12), _mm_loadu_ps(b + i + 12)));
+        const __m128i ne = _mm_castps_si128(_mm_or_ps(_mm_or_ps(ne0, ne1), _mm_or_ps(ne2, ne3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(ne, _mm_setzero_si128())) != 0xffff)
+            break;
+    }
+    return i + private__find_add_mismatch_scalar(a + i, b + i, result + i, n - i);
+}
+
+// SSE2 has no 32-bit multiply keeping the low halves (`_mm_mullo_epi32` is SSE4.1), so the even and
+// odd lanes are multiplied to 64 bits separately and the low halves are shuffled back together.
+static inline __m128i private__mullo_epi32_sse2(__m128i x, uint32_t m)
+{
+    const __m128i mm = _mm_set1_epi32((int)m);
+    const __m128i even = _mm_mul_epu32(x, mm);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), mm);
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i private__hash32_sse2(__m128i x)
+{
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = private__mullo_epi32_sse2(x, 0x7feb352dU);
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = private__mullo_epi32_sse2(x, 0x846ca68bU);
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    return x;
+}
+
+static void private__random_run_sse2(float *data, uint32_t first, uint64_t n, uint32_t key0, uint32_t key1)
+{
+    const __m128i k0 = _mm_set1_epi32((int)key0);
+    const __m128i k1 = _mm_set1_epi32((int)key1);
+    const __m128 scale = _mm_set1_ps(1.0f / 16777216.0f);
+    __m128i index = _mm_add_epi32(_mm_set1_epi32((int)first), _mm_setr_epi32(0, 1, 2, 3));
+    uint64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i h = private__hash32_sse2(_mm_add_epi32(private__hash32_sse2(_mm_xor_si128(index, k0)), k1));
+        _mm_storeu_ps(data + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(h, 8)), scale));
+        index = _mm_add_epi32(index, _mm_set1_epi32(4));
+    }
+    private__random_run_scalar(data + i, first + (uint32_t)i, n - i, key0, key1);
+}
+
+static void private__random_floats_sse2(float *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    private__random_runs(data, first, n, key, private__random_run_sse2);
+}
+
+// Four independent accumulators per kernel, so the loop isn't bound by the latency of the adds.
+
+static double private__sum_sse2(const float *a, uint64_t n)
+{
+    __m128 s[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m128 y = _mm_sub_ps(_mm_loadu_ps(a + i + 4 * k), c[k]);
+            const __m128 t = _mm_add_ps(s[k], y);
+            c[k] = _mm_sub_ps(_mm_sub_ps(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[16], lc[16];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm_storeu_ps(ls + 4 * k, s[k]);
+        _mm_storeu_ps(lc + 4 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 16) + private__sum_scalar(a + i, n - i);
+}
+
+static double private__dot_sse2(const float *a, const float *b, uint64_t n)
+{
+    __m128 s[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m128 y = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(a + i + 4 * k), _mm_loadu_ps(b + i + 4 * k)), c[k]);
+            const __m128 t = _mm_add_ps(s[k], y);
+            c[k] = _mm_sub_ps(_mm_sub_ps(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[16], lc[16];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm_storeu_ps(ls + 4 * k, s[k]);
+        _mm_storeu_ps(lc + 4 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 16) + private__dot_scalar(a + i, b + i, n - i);
+}
+
+// `_mm_min_ps(x, lo)` returns `lo` when `x` is NaN, which matches the scalar loop.
+static void private__min_max_sse2(const float *a, uint64_t n, float *min, float *max)
+{
+    __m128 lo[4], hi[4];
+    for (uint32_t k = 0; k < 4; ++k) {
+        lo[k] = _mm_set1_ps(*min);
+        hi[k] = _mm_set1_ps(*max);
+    }
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m128 x = _mm_loadu_ps(a + i + 4 * k);
+            lo[k] = _mm_min_ps(x, lo[k]);
+            hi[k] = _mm_max_ps(x, hi[k]);
+        }
+    }
+    float llo[16], lhi[16];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm_storeu_ps(llo + 4 * k, lo[k]);
+        _mm_storeu_ps(lhi + 4 * k, hi[k]);
+    }
+    private__merge_min_max(llo, lhi, 16, min, max);
+    private__min_max_scalar(a + i, n - i, min, max);
+}
+#endif
+
+#if defined(TM_CPU_SSE)
+
+// The AVX2 and AVX-512 kernels are compiled for their instruction set with target attributes, the
+// rest of the build only assumes SSE2. They must only be called if `private__cpu_supports()` says
+// so.
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+AVX2_TARGET static void private__add_arrays_avx2(const float *a, const float *b, float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256 a0 = _mm256_loadu_ps(a + i + 0), b0 = _mm256_loadu_ps(b + i + 0);
+        const __m256 a1 = _mm256_loadu_ps(a + i + 8), b1 = _mm256_loadu_ps(b + i + 8);
+        const __m256 a2 = _mm256_loadu_ps(a + i + 16), b2 = _mm256_loadu_ps(b + i + 16);
+        const __m256 a3 = _mm256_loadu_ps(a + i + 24), b3 = _mm256_loadu_ps(b + i + 24);
+        _mm256_storeu_ps(result + i + 0, _mm256_add_ps(a0, b0));
+        _mm256_storeu_ps(result + i + 8, _mm256_add_ps(a1, b1));
+        _mm256_storeu_ps(result + i + 16, _mm256_add_ps(a2, b2));
+        _mm256_storeu_ps(result + i + 24, _mm256_add_ps(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+}
+
+AVX2_TARGET static void private__add_arrays_streaming_avx2(const float *a, const float *b, float *result, uint64_t n, uint64_t prefetch_distance)
+{
+    uint64_t i = private__unaligned_head(result, 32, sizeof(float), n);
+    private__add_arrays_scalar(a, b, result, i);
+    for (; i + 32 <= n; i += 32) {
+        _mm_prefetch((const char *)(a + i) + prefetch_distance, _MM_HINT_T0);
+        _mm_prefetch((const char *)(a + i + 16) + prefetch_distance, _MM_HINT_T0);
+        _mm_prefetch((const char *)(b + i) + prefetch_distance, _MM_HINT_T0);
+        _mm_prefetch((const char *)(b + i + 16) + prefetch_distance, _MM_HINT_T0);
+        const __m256 a0 = _mm256_loadu_ps(a + i + 0), b0 = _mm256_loadu_ps(b + i + 0);
+        const __m256 a1 = _mm256_loadu_ps(a + i + 8), b1 = _mm256_loadu_ps(b + i + 8);
+        const __m256 a2 = _mm256_loadu_ps(a + i + 16), b2 = _mm256_loadu_ps(b + i + 16);
+        const __m256 a3 = _mm256_loadu_ps(a + i + 24), b3 = _mm256_loadu_ps(b + i + 24);
+        _mm256_stream_ps(result + i + 0, _mm256_add_ps(a0, b0));
+        _mm256_stream_ps(result + i + 8, _mm256_add_ps(a1, b1));
+        _mm256_stream_ps(result + i + 16, _mm256_add_ps(a2, b2));
+        _mm256_stream_ps(result + i + 24, _mm256_add_ps(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+    _mm_sfence();
+}
+
+AVX2_TARGET static uint64_t private__find_add_mismatch_avx2(const float *a, const float *b, const float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256 ne0 = _mm256_xor_ps(_mm256_loadu_ps(result + i + 0), _mm256_add_ps(_mm256_loadu_ps(a + i + 0), _mm256_loadu_ps(b + i + 0)));
+        const __m256 ne1 = _mm256_xor_ps(_mm256_loadu_ps(result + i + 8), _mm256_add_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+        const __m256 ne2 = _mm256_xor_ps(_mm256_loadu_ps(result + i + 16), _mm256_add_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16)));
+        const __m256 ne3 = _mm256_xor_ps(_mm256_loadu_ps(result + i + 24), _mm256_add_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24)));
+        const __m256i ne = _mm256_castps_si256(_mm256_or_ps(_mm256_or_ps(ne0, ne1), _mm256_or_ps(ne2, ne3)));
+        if (!_mm256_testz_si256(ne, ne))
+            break;
+    }
+    return i + private__find_add_mismatch_scalar(a + i, b + i, result + i, n - i);
+}
+
+AVX2_TARGET static inline __m256i private__hash32_avx2(__m256i x)
+{
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x846ca68bU));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    return x;
+}
+
+AVX2_TARGET static void private__random_run_avx2(float *data, uint32_t first, uint64_t n, uint32_t key0, uint32_t key1)
+{
+    const __m256i k0 = _mm256_set1_epi32((int)key0);
+    const __m256i k1 = _mm256_set1_epi32((int)key1);
+    const __m256 scale = _mm256_set1_ps(1.0f / 16777216.0f);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32((int)first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i h = private__hash32_avx2(_mm256_add_epi32(private__hash32_avx2(_mm256_xor_si256(index, k0)), k1));
+        _mm256_storeu_ps(data + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(h, 8)), scale));
+        index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+    }
+    private__random_run_scalar(data + i, first + (uint32_t)i, n - i, key0, key1);
+}
+
+static void private__random_floats_avx2(float *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    private__random_runs(data, first, n, key, private__random_run_avx2);
+}
+
+AVX2_TARGET static double private__sum_avx2(const float *a, uint64_t n)
+{
+    __m256 s[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m256 y = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8 * k), c[k]);
+            const __m256 t = _mm256_add_ps(s[k], y);
+            c[k] = _mm256_sub_ps(_mm256_sub_ps(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[32], lc[32];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm256_storeu_ps(ls + 8 * k, s[k]);
+        _mm256_storeu_ps(lc + 8 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 32) + private__sum_scalar(a + i, n - i);
+}
+
+AVX2_TARGET static double private__dot_avx2(const float *a, const float *b, uint64_t n)
+{
+    __m256 s[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i + 8 * k), _mm256_loadu_ps(b + i + 8 * k)), c[k]);
+            const __m256 t = _mm256_add_ps(s[k], y);
+            c[k] = _mm256_sub_ps(_mm256_sub_ps(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[32], lc[32];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm256_storeu_ps(ls + 8 * k, s[k]);
+        _mm256_storeu_ps(lc + 8 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 32) + private__dot_scalar(a + i, b + i, n - i);
+}
+
+AVX2_TARGET static void private__min_max_avx2(const float *a, uint64_t n, float *min, float *max)
+{
+    __m256 lo[4], hi[4];
+    for (uint32_t k = 0; k < 4; ++k) {
+        lo[k] = _mm256_set1_ps(*min);
+        hi[k] = _mm256_set1_ps(*max);
+    }
+    uint64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m256 x = _mm256_loadu_ps(a + i + 8 * k);
+            lo[k] = _mm256_min_ps(x, lo[k]);
+            hi[k] = _mm256_max_ps(x, hi[k]);
+        }
+    }
+    float llo[32], lhi[32];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm256_storeu_ps(llo + 8 * k, lo[k]);
+        _mm256_storeu_ps(lhi + 8 * k, hi[k]);
+    }
+    private__merge_min_max(llo, lhi, 32, min, max);
+    private__min_max_scalar(a + i, n - i, min, max);
+}
+
+// The AVX-512 kernels use the same loops with 16 lanes per register.
+
+AVX512_TARGET static void private__add_arrays_avx512(const float *a, const float *b, float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const __m512 a0 = _mm512_loadu_ps(a + i + 0), b0 = _mm512_loadu_ps(b + i + 0);
+        const __m512 a1 = _mm512_loadu_ps(a + i + 16), b1 = _mm512_loadu_ps(b + i + 16);
+        const __m512 a2 = _mm512_loadu_ps(a + i + 32), b2 = _mm512_loadu_ps(b + i + 32);
+        const __m512 a3 = _mm512_loadu_ps(a + i + 48), b3 = _mm512_loadu_ps(b + i + 48);
+        _mm512_storeu_ps(result + i + 0, _mm512_add_ps(a0, b0));
+        _mm512_storeu_ps(result + i + 16, _mm512_add_ps(a1, b1));
+        _mm512_storeu_ps(result + i + 32, _mm512_add_ps(a2, b2));
+        _mm512_storeu_ps(result + i + 48, _mm512_add_ps(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+}
+
+AVX512_TARGET static void private__add_arrays_streaming_avx512(const float *a, const float *b, float *result, uint64_t n, uint64_t prefetch_distance)
+{
+    uint64_t i = private__unaligned_head(result, 64, sizeof(float), n);
+    private__add_arrays_scalar(a, b, result, i);
+    for (; i + 64 <= n; i += 64) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            _mm_prefetch((const char *)(a + i + 16 * k) + prefetch_distance, _MM_HINT_T0);
+            _mm_prefetch((const char *)(b + i + 16 * k) + prefetch_distance, _MM_HINT_T0);
+        }
+        const __m512 a0 = _mm512_loadu_ps(a + i + 0), b0 = _mm512_loadu_ps(b + i + 0);
+        const __m512 a1 = _mm512_loadu_ps(a + i + 16), b1 = _mm512_loadu_ps(b + i + 16);
+        const __m512 a2 = _mm512_loadu_ps(a + i + 32), b2 = _mm512_loadu_ps(b + i + 32);
+        const __m512 a3 = _mm512_loadu_ps(a + i + 48), b3 = _mm512_loadu_ps(b + i + 48);
+        _mm512_stream_ps(result + i + 0, _mm512_add_ps(a0, b0));
+        _mm512_stream_ps(result + i + 16, _mm512_add_ps(a1, b1));
+        _mm512_stream_ps(result + i + 32, _mm512_add_ps(a2, b2));
+        _mm512_stream_ps(result + i + 48, _mm512_add_ps(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+    _mm_sfence();
+}
+
+AVX512_TARGET static uint64_t private__find_add_mismatch_avx512(const float *a, const float *b, const float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const __mmask16 ne0 = _mm512_cmpneq_epi32_mask(_mm512_castps_si512(_mm512_loadu_ps(result + i + 0)), _mm512_castps_si512(_mm512_add_ps(_mm512_loadu_ps(a + i + 0), _mm512_loadu_ps(b + i + 0))));
+        const __mmask16 ne1 = _mm512_cmpneq_epi32_mask(_mm512_castps_si512(_mm512_loadu_ps(result + i + 16)), _mm512_castps_si512(_mm512_add_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16))));
+        const __mmask16 ne2 = _mm512_cmpneq_epi32_mask(_mm512_castps_si512(_mm512_loadu_ps(result + i + 32)), _mm512_castps_si512(_mm512_add_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32))));
+        const __mmask16 ne3 = _mm512_cmpneq_epi32_mask(_mm512_castps_si512(_mm512_loadu_ps(result + i + 48)), _mm512_castps_si512(_mm512_add_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48))));
+        if (ne0 | ne1 | ne2 | ne3)
+            break;
+    }
+    return i + private__find_add_mismatch_scalar(a + i, b + i, result + i, n - i);
+}
+
+AVX512_TARGET static inline __m512i private__hash32_avx512(__m512i x)
+{
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(0x7feb352d));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 15));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32((int)0x846ca68bU));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    return x;
+}
+
+AVX512_TARGET static void private__random_run_avx512(float *data, uint32_t first, uint64_t n, uint32_t key0, uint32_t key1)
+{
+    const __m512i k0 = _mm512_set1_epi32((int)key0);
+    const __m512i k1 = _mm512_set1_epi32((int)key1);
+    const __m512 scale = _mm512_set1_ps(1.0f / 16777216.0f);
+    __m512i index = _mm512_add_epi32(_mm512_set1_epi32((int)first), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512i h = private__hash32_avx512(_mm512_add_epi32(private__hash32_avx512(_mm512_xor_si512(index, k0)), k1));
+        _mm512_storeu_ps(data + i, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(h, 8)), scale));
+        index = _mm512_add_epi32(index, _mm512_set1_epi32(16));
+    }
+    private__random_run_scalar(data + i, first + (uint32_t)i, n - i, key0, key1);
+}
+
+static void private__random_floats_avx512(float *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    private__random_runs(data, first, n, key, private__random_run_avx512);
+}
+
+AVX512_TARGET static double private__sum_avx512(const float *a, uint64_t n)
+{
+    __m512 s[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m512 y = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16 * k), c[k]);
+            const __m512 t = _mm512_add_ps(s[k], y);
+            c[k] = _mm512_sub_ps(_mm512_sub_ps(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[64], lc[64];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm512_storeu_ps(ls + 16 * k, s[k]);
+        _mm512_storeu_ps(lc + 16 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 64) + private__sum_scalar(a + i, n - i);
+}
+
+AVX512_TARGET static double private__dot_avx512(const float *a, const float *b, uint64_t n)
+{
+    __m512 s[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m512 y = _mm512_sub_ps(_mm512_mul_ps(_mm512_loadu_ps(a + i + 16 * k), _mm512_loadu_ps(b + i + 16 * k)), c[k]);
+            const __m512 t = _mm512_add_ps(s[k], y);
+            c[k] = _mm512_sub_ps(_mm512_sub_ps(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[64], lc[64];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm512_storeu_ps(ls + 16 * k, s[k]);
+        _mm512_storeu_ps(lc + 16 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 64) + private__dot_scalar(a + i, b + i, n - i);
+}
+
+AVX512_TARGET static void private__min_max_avx512(const float *a, uint64_t n, float *min, float *max)
+{
+    __m512 lo[4], hi[4];
+    for (uint32_t k = 0; k < 4; ++k) {
+        lo[k] = _mm512_set1_ps(*min);
+        hi[k] = _mm512_set1_ps(*max);
+    }
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const __m512 x = _mm512_loadu_ps(a + i + 16 * k);
+            lo[k] = _mm512_min_ps(x, lo[k]);
+            hi[k] = _mm512_max_ps(x, hi[k]);
+        }
+    }
+    float llo[64], lhi[64];
+    for (uint32_t k = 0; k < 4; ++k) {
+        _mm512_storeu_ps(llo + 16 * k, lo[k]);
+        _mm512_storeu_ps(lhi + 16 * k, hi[k]);
+    }
+    private__merge_min_max(llo, lhi, 64, min, max);
+    private__min_max_scalar(a + i, n - i, min, max);
+}
+#endif
+
+#if defined(TM_CPU_NEON)
+static void private__add_arrays_neon(const float *a, const float *b, float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const float32x4_t a0 = vld1q_f32(a + i + 0), b0 = vld1q_f32(b + i + 0);
+        const float32x4_t a1 = vld1q_f32(a + i + 4), b1 = vld1q_f32(b + i + 4);
+        const float32x4_t a2 = vld1q_f32(a + i + 8), b2 = vld1q_f32(b + i + 8);
+        const float32x4_t a3 = vld1q_f32(a + i + 12), b3 = vld1q_f32(b + i + 12);
+        vst1q_f32(result + i + 0, vaddq_f32(a0, b0));
+        vst1q_f32(result + i + 4, vaddq_f32(a1, b1));
+        vst1q_f32(result + i + 8, vaddq_f32(a2, b2));
+        vst1q_f32(result + i + 12, vaddq_f32(a3, b3));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+}
+
+// NEON has no intrinsic for non-temporal stores, the builtin compiles to `stnp`.
+static void private__add_arrays_streaming_neon(const float *a, const float *b, float *result, uint64_t n, uint64_t prefetch_distance)
+{
+    uint64_t i = private__unaligned_head(result, 16, sizeof(float), n);
+    private__add_arrays_scalar(a, b, result, i);
+    for (; i + 16 <= n; i += 16) {
+        __builtin_prefetch((const char *)(a + i) + prefetch_distance);
+        __builtin_prefetch((const char *)(b + i) + prefetch_distance);
+        const float32x4_t a0 = vld1q_f32(a + i + 0), b0 = vld1q_f32(b + i + 0);
+        const float32x4_t a1 = vld1q_f32(a + i + 4), b1 = vld1q_f32(b + i + 4);
+        const float32x4_t a2 = vld1q_f32(a + i + 8), b2 = vld1q_f32(b + i + 8);
+        const float32x4_t a3 = vld1q_f32(a + i + 12), b3 = vld1q_f32(b + i + 12);
+        __builtin_nontemporal_store(vaddq_f32(a0, b0), (float32x4_t *)(result + i + 0));
+        __builtin_nontemporal_store(vaddq_f32(a1, b1), (float32x4_t *)(result + i + 4));
+        __builtin_nontemporal_store(vaddq_f32(a2, b2), (float32x4_t *)(result + i + 8));
+        __builtin_nontemporal_store(vaddq_f32(a3, b3), (float32x4_t *)(result + i + 12));
+    }
+    private__add_arrays_scalar(a + i, b + i, result + i, n - i);
+}
+
+static uint64_t private__find_add_mismatch_neon(const float *a, const float *b, const float *result, uint64_t n)
+{
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint32x4_t eq0 = vceqq_u32(vreinterpretq_u32_f32(vld1q_f32(result + i + 0)), vreinterpretq_u32_f32(vaddq_f32(vld1q_f32(a + i + 0), vld1q_f32(b + i + 0))));
+        const uint32x4_t eq1 = vceqq_u32(vreinterpretq_u32_f32(vld1q_f32(result + i + 4)), vreinterpretq_u32_f32(vaddq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4))));
+        const uint32x4_t eq2 = vceqq_u32(vreinterpretq_u32_f32(vld1q_f32(result + i + 8)), vreinterpretq_u32_f32(vaddq_f32(vld1q_f32(a + i + 8), vld1q_f32(b + i + 8))));
+        const uint32x4_t eq3 = vceqq_u32(vreinterpretq_u32_f32(vld1q_f32(result + i + 12)), vreinterpretq_u32_f32(vaddq_f32(vld1q_f32(a + i + 12), vld1q_f32(b + i + 12))));
+        if (vminvq_u32(vandq_u32(vandq_u32(eq0, eq1), vandq_u32(eq2, eq3))) == 0)
+            break;
+    }
+    return i + private__find_add_mismatch_scalar(a + i, b + i, result + i, n - i);
+}
+
+static inline uint32x4_t private__hash32_neon(uint32x4_t x)
+{
+    x = veorq_u32(x, vshrq_n_u32(x, 16));
+    x = vmulq_u32(x, vdupq_n_u32(0x7feb352dU));
+    x = veorq_u32(x, vshrq_n_u32(x, 15));
+    x = vmulq_u32(x, vdupq_n_u32(0x846ca68bU));
+    x = veorq_u32(x, vshrq_n_u32(x, 16));
+    return x;
+}
+
+static void private__random_run_neon(float *data, uint32_t first, uint64_t n, uint32_t key0, uint32_t key1)
+{
+    static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+    const uint32x4_t k0 = vdupq_n_u32(key0);
+    const uint32x4_t k1 = vdupq_n_u32(key1);
+    uint32x4_t index = vaddq_u32(vdupq_n_u32(first), vld1q_u32(lanes));
+    uint64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const uint32x4_t h = private__hash32_neon(vaddq_u32(private__hash32_neon(veorq_u32(index, k0)), k1));
+        vst1q_f32(data + i, vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(h, 8)), 1.0f / 16777216.0f));
+        index = vaddq_u32(index, vdupq_n_u32(4));
+    }
+    private__random_run_scalar(data + i, first + (uint32_t)i, n - i, key0, key1);
+}
+
+static void private__random_floats_neon(float *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    private__random_runs(data, first, n, key, private__random_run_neon);
+}
+
+static double private__sum_neon(const float *a, uint64_t n)
+{
+    float32x4_t s[4] = { vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0) }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const float32x4_t y = vsubq_f32(vld1q_f32(a + i + 4 * k), c[k]);
+            const float32x4_t t = vaddq_f32(s[k], y);
+            c[k] = vsubq_f32(vsubq_f32(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[16], lc[16];
+    for (uint32_t k = 0; k < 4; ++k) {
+        vst1q_f32(ls + 4 * k, s[k]);
+        vst1q_f32(lc + 4 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 16) + private__sum_scalar(a + i, n - i);
+}
+
+// Uses `vmulq_f32` rather than `vfmaq_f32`, so the products round the same way as on x64.
+static double private__dot_neon(const float *a, const float *b, uint64_t n)
+{
+    float32x4_t s[4] = { vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0) }, c[4] = { s[0], s[0], s[0], s[0] };
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const float32x4_t y = vsubq_f32(vmulq_f32(vld1q_f32(a + i + 4 * k), vld1q_f32(b + i + 4 * k)), c[k]);
+            const float32x4_t t = vaddq_f32(s[k], y);
+            c[k] = vsubq_f32(vsubq_f32(t, s[k]), y);
+            s[k] = t;
+        }
+    }
+    float ls[16], lc[16];
+    for (uint32_t k = 0; k < 4; ++k) {
+        vst1q_f32(ls + 4 * k, s[k]);
+        vst1q_f32(lc + 4 * k, c[k]);
+    }
+    return private__sum_lanes(ls, lc, 16) + private__dot_scalar(a + i, b + i, n - i);
+}
+
+// `vminnmq_f32` returns the other operand when one is NaN, unlike `vminq_f32`.
+static void private__min_max_neon(const float *a, uint64_t n, float *min, float *max)
+{
+    float32x4_t lo[4], hi[4];
+    for (uint32_t k = 0; k < 4; ++k) {
+        lo[k] = vdupq_n_f32(*min);
+        hi[k] = vdupq_n_f32(*max);
+    }
+    uint64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            const float32x4_t x = vld1q_f32(a + i + 4 * k);
+            lo[k] = vminnmq_f32(x, lo[k]);
+            hi[k] = vmaxnmq_f32(x, hi[k]);
+        }
+    }
+    float llo[16], lhi[16];
+    for (uint32_t k = 0; k < 4; ++k) {
+        vst1q_f32(llo + 4 * k, lo[k]);
+        vst1q_f32(lhi + 4 * k, hi[k]);
+    }
+    private__merge_min_max(llo, lhi, 16, min, max);
+    private__min_max_scalar(a + i, n - i, min, max);
+}
+#endif
+
+// Element types other than float. The loops are written once as templates over `dtype_traits`,
+// which defines the arithmetic of each type, and specialized for each type at compile time.
+
+// Storage of the 16-bit float types, which have no native arithmetic on the CPU.
+typedef struct half_t
+{
+    uint16_t bits;
+} half_t;
+
+typedef struct bfloat16_t
+{
+    uint16_t bits;
+} bfloat16_t;
+
+// Float to half and back, by Fabian Giesen. Rounds to nearest even, overflows to infinity and keeps
+// NaNs.
+static inline float private__half_to_float(uint16_t h)
+{
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t u = (uint32_t)(h & 0x7fff) << 13;
+    const uint32_t exp = shifted_exp & u;
+    u += (127 - 15) << 23;
+    float f;
+    if (exp == shifted_exp) {
+        u += (128 - 16) << 23;
+        memcpy(&f, &u, sizeof(f));
+    } else if (exp == 0) {
+        // Zero or subnormal, renormalized by the float subtraction.
+        u += 1 << 23;
+        const uint32_t magic_bits = 113u << 23;
+        float magic;
+        memcpy(&f, &u, sizeof(f));
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        f -= magic;
+    } else {
+        memcpy(&f, &u, sizeof(f));
+    }
+    memcpy(&u, &f, sizeof(u));
+    u |= (uint32_t)(h & 0x8000) << 16;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static inline uint16_t private__float_to_half(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    const uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+    u &= 0x7fffffff;
+
+    // Infinity, NaN or too large for a half.
+    if (u >= 0x47800000)
+        return sign | (u > 0x7f800000 ? 0x7e00 : 0x7c00);
+
+    // Subnormal half or zero. Adding 0.5 aligns the half's ulp with the last float bit, so the float
+    // addition does the rounding.
+    if (u < 0x38800000) {
+        float x;
+        memcpy(&x, &u, sizeof(x));
+        x += 0.5f;
+        memcpy(&u, &x, sizeof(u));
+        return sign | (uint16_t)(u - 0x3f000000);
+    }
+
+    // Normal, rebias the exponent and round the mantissa to nearest even.
+    const uint32_t mantissa_odd = (u >> 13) & 1;
+    u += 0xc8000fffu + mantissa_odd;
+    return sign | (uint16_t)(u >> 13);
+}
+
+static inline float private__bfloat16_to_float(uint16_t b)
+{
+    const uint32_t u = (uint32_t)b << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+static inline uint16_t private__float_to_bfloat16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return (uint16_t)((u >> 16) | 0x40);
+    u += 0x7fff + ((u >> 16) & 1);
+    return (uint16_t)(u >> 16);
+}
+
+// Maps sign-magnitude float bits to an integer that is ordered the same way as the floats, so the
+// distance between two mapped values is their distance in ulps. Both zeros map to 0.
+static inline int64_t private__ordered(uint64_t bits, uint64_t sign_bit)
+{
+    const int64_t magnitude = (int64_t)(bits & (sign_bit - 1));
+    return bits & sign_bit ? -magnitude : magnitude;
+}
+
+// Folds 64 bits to 32 for checksums, the high word is rotated so equal halves don't cancel.
+static inline uint32_t private__fold64(uint64_t x)
+{
+    const uint32_t hi = (uint32_t)(x >> 32);
+    return (uint32_t)x ^ (hi << 16 | hi >> 16);
+}
+
+template <typename T> struct dtype_traits;
+
+template <> struct dtype_traits<float>
+{
+    static float add(float x, float y) { return x + y; }
+    static float from_random(float r) { return r; }
+    static double to_double(float x) { return x; }
+    static bool is_nan(float x) { return isnan(x); }
+    static uint32_t bits32(float x)
+    {
+        uint32_t u;
+        memcpy(&u, &x, sizeof(u));
+        return u;
+    }
+    static int64_t ordered(float x)
+    {
+        uint32_t u;
+        memcpy(&u, &x, sizeof(u));
+        return private__ordered(u, 0x80000000u);
+    }
+};
+
+// Half and bfloat16 sums are computed in float and rounded once. Float has more than twice their
+// precision plus two bits, so the double rounding gives the correctly rounded sum.
+template <> struct dtype_traits<half_t>
+{
+    static half_t add(half_t x, half_t y) { return { private__float_to_half(private__half_to_float(x.bits) + private__half_to_float(y.bits)) }; }
+    static half_t from_random(float r) { return { private__float_to_half(r) }; }
+    static double to_double(half_t x) { return private__half_to_float(x.bits); }
+    static bool is_nan(half_t x) { return (x.bits & 0x7fff) > 0x7c00; }
+    static uint32_t bits32(half_t x) { return x.bits; }
+    static int64_t ordered(half_t x) { return private__ordered(x.bits, 0x8000); }
+};
+
+template <> struct dtype_traits<bfloat16_t>
+{
+    static bfloat16_t add(bfloat16_t x, bfloat16_t y) { return { private__float_to_bfloat16(private__bfloat16_to_float(x.bits) + private__bfloat16_to_float(y.bits)) }; }
+    static bfloat16_t from_random(float r) { return { private__float_to_bfloat16(r) }; }
+    static double to_double(bfloat16_t x) { return private__bfloat16_to_float(x.bits); }
+    static bool is_nan(bfloat16_t x) { return (x.bits & 0x7fff) > 0x7f80; }
+    static uint32_t bits32(bfloat16_t x) { return x.bits; }
+    static int64_t ordered(bfloat16_t x) { return private__ordered(x.bits, 0x8000); }
+};
+
+template <> struct dtype_traits<double>
+{
+    static double add(double x, double y) { return x + y; }
+    static double from_random(float r) { return r; }
+    static double to_double(double x) { return x; }
+    static bool is_nan(double x) { return isnan(x); }
+    static uint32_t bits32(double x)
+    {
+        uint64_t u;
+        memcpy(&u, &x, sizeof(u));
+        return private__fold64(u);
+    }
+    static int64_t ordered(double x)
+    {
+        uint64_t u;
+        memcpy(&u, &x, sizeof(u));
+        return private__ordered(u, 0x8000000000000000ull);
+    }
+};
+
+// The random floats are multiples of 2^-24, so scaling them gives exact integers in [0, 2^24).
+template <> struct dtype_traits<int32_t>
+{
+    static int32_t add(int32_t x, int32_t y) { return (int32_t)((uint32_t)x + (uint32_t)y); }
+    static int32_t from_random(float r) { return (int32_t)(r * 16777216.0f); }
+    static double to_double(int32_t x) { return x; }
+    static bool is_nan(int32_t) { return false; }
+    static uint32_t bits32(int32_t x) { return (uint32_t)x; }
+    static int64_t ordered(int32_t x) { return x; }
+};
+
+template <> struct dtype_traits<int64_t>
+{
+    static int64_t add(int64_t x, int64_t y) { return (int64_t)((uint64_t)x + (uint64_t)y); }
+    static int64_t from_random(float r) { return (int64_t)(r * 16777216.0f); }
+    static double to_double(int64_t x) { return (double)x; }
+    static bool is_nan(int64_t) { return false; }
+    static uint32_t bits32(int64_t x) { return private__fold64((uint64_t)x); }
+    static int64_t ordered(int64_t x) { return x; }
+};
+
+template <typename T>
+static void private__add_arrays_typed(const void *a, const void *b, void *result, uint64_t n)
+{
+    const T *x = (const T *)a, *y = (const T *)b;
+    T *r = (T *)result;
+    for (uint64_t i = 0; i < n; ++i)
+        r[i] = dtype_traits<T>::add(x[i], y[i]);
+}
+
+// Copies the cache line at `src` to `dst` with non-temporal stores, see
+// `private__add_arrays_streaming_sse2()`. Both must be aligned to `CACHE_LINE_SIZE`.
+#define CACHE_LINE_SIZE 64
+
+static inline void private__stream_line(void *dst, const void *src)
+{
+#if defined(TM_CPU_SSE)
+    for (uint32_t k = 0; k < CACHE_LINE_SIZE / 16; ++k)
+        _mm_stream_si128((__m128i *)dst + k, _mm_load_si128((const __m128i *)src + k));
+#elif defined(TM_CPU_NEON)
+    for (uint32_t k = 0; k < CACHE_LINE_SIZE / 16; ++k)
+        __builtin_nontemporal_store(vld1q_u8((const uint8_t *)src + 16 * k), (uint8x16_t *)dst + k);
+#else
+    memcpy(dst, src, CACHE_LINE_SIZE);
+#endif
+}
+
+// The sums of each cache line are computed into a line on the stack, which stays in L1, and then
+// streamed to `result`.
+template <typename T>
+static void private__add_arrays_streaming_typed(const void *a, const void *b, void *result, uint64_t n, uint64_t prefetch_distance)
+{
+    const T *x = (const T *)a, *y = (const T *)b;
+    T *r = (T *)result;
+    const uint64_t per_line = CACHE_LINE_SIZE / sizeof(T);
+    uint64_t i = private__unaligned_head(r, CACHE_LINE_SIZE, sizeof(T), n);
+    private__add_arrays_typed<T>(x, y, r, i);
+    for (; i + per_line <= n; i += per_line) {
+        __builtin_prefetch((const char *)(x + i) + prefetch_distance);
+        __builtin_prefetch((const char *)(y + i) + prefetch_distance);
+        alignas(CACHE_LINE_SIZE) T line[CACHE_LINE_SIZE / sizeof(T)];
+        for (uint64_t k = 0; k < per_line; ++k)
+            line[k] = dtype_traits<T>::add(x[i + k], y[i + k]);
+        private__stream_line(r + i, line);
+    }
+    private__add_arrays_typed<T>(x + i, y + i, r + i, n - i);
+#if defined(TM_CPU_SSE)
+    _mm_sfence();
+#endif
+}
+
+template <typename T>
+static uint64_t private__find_add_mismatch_typed(const void *a, const void *b, const void *result, uint64_t n)
+{
+    const T *x = (const T *)a, *y = (const T *)b, *r = (const T *)result;
+    for (uint64_t i = 0; i < n; ++i) {
+        const T expected = dtype_traits<T>::add(x[i], y[i]);
+        if (memcmp(r + i, &expected, sizeof(T)))
+            return i;
+    }
+    return n;
+}
+
+template <typename T>
+static uint64_t private__add_error_typed(const void *a, const void *b, const void *result, uint64_t i, double *abs_error)
+{
+    const T expected = dtype_traits<T>::add(((const T *)a)[i], ((const T *)b)[i]);
+    const T r = ((const T *)result)[i];
+    *abs_error = fabs(dtype_traits<T>::to_double(r) - dtype_traits<T>::to_double(expected));
+    if (dtype_traits<T>::is_nan(r) || dtype_traits<T>::is_nan(expected))
+        return dtype_traits<T>::is_nan(r) && dtype_traits<T>::is_nan(expected) ? 0 : UINT64_MAX;
+
+    // The difference can exceed `INT64_MAX`, but always fits in a `uint64_t`.
+    const uint64_t x = (uint64_t)dtype_traits<T>::ordered(r), y = (uint64_t)dtype_traits<T>::ordered(expected);
+    return dtype_traits<T>::ordered(r) > dtype_traits<T>::ordered(expected) ? x - y : y - x;
+}
+
+// The checksum of an element is its bits folded to 32 bits, mixed with its index so that moved
+// elements are caught too. Element checksums are added with wrap-around, so they can be summed in
+// any order and split into ranges. Must match `checksum_term()` in metal_adder.metal.
+static inline uint32_t private__checksum_term(uint32_t bits, uint64_t i)
+{
+    return (bits ^ ((uint32_t)i * 0x9e3779b9u)) * 0x85ebca6bu;
+}
+
+template <typename T>
+static uint32_t private__checksum_typed(const void *data, uint64_t first, uint64_t n)
+{
+    const T *d = (const T *)data;
+    uint32_t checksum = 0;
+    for (uint64_t i = 0; i < n; ++i)
+        checksum += private__checksum_term(dtype_traits<T>::bits32(d[i]), first + i);
+    return checksum;
+}
+
+template <typename T>
+static void private__random_typed(void *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    T *d = (T *)data;
+    for (uint64_t i = 0; i < n; ++i)
+        d[i] = dtype_traits<T>::from_random(private__random_float(first + i, key));
+}
+
+// Adapters from the typed kernel signatures to the float kernels of a `cpu_kernels_t`.
+
+template <void (*F)(const float *, const float *, float *, uint64_t)>
+static void private__add_arrays_float(const void *a, const void *b, void *result, uint64_t n)
+{
+    F((const float *)a, (const float *)b, (float *)result, n);
+}
+
+template <void (*F)(const float *, const float *, float *, uint64_t, uint64_t)>
+static void private__add_arrays_streaming_float(const void *a, const void *b, void *result, uint64_t n, uint64_t prefetch_distance)
+{
+    F((const float *)a, (const float *)b, (float *)result, n, prefetch_distance);
+}
+
+template <uint64_t (*F)(const float *, const float *, const float *, uint64_t)>
+static uint64_t private__find_add_mismatch_float(const void *a, const void *b, const void *result, uint64_t n)
+{
+    return F((const float *)a, (const float *)b, (const float *)result, n);
+}
+
+template <void (*F)(float *, uint64_t, uint64_t, const uint32_t[2])>
+static void private__random_float_adapter(void *data, uint64_t first, uint64_t n, const uint32_t key[2])
+{
+    F((float *)data, first, n, key);
+}
+
+#define TYPED_KERNELS(DTYPE, T, NAME)                                                                         \
+    { .dtype = DTYPE, .element_size = sizeof(T), .name = NAME, .add_arrays = private__add_arrays_typed<T>,    \
+        .add_arrays_streaming = private__add_arrays_streaming_typed<T>,                                       \
+        .find_add_mismatch = private__find_add_mismatch_typed<T>, .add_error = private__add_error_typed<T>,   \
+        .checksum = private__checksum_typed<T>, .random = private__random_typed<T> }
+
+#define FLOAT_KERNELS(ADD, STREAMING, MISMATCH, RANDOM)                                                       \
+    { .dtype = METAL_ADDER_DTYPE_FLOAT, .element_size = sizeof(float), .name = "float",                      \
+        .add_arrays = private__add_arrays_float<ADD>, .add_arrays_streaming = private__add_arrays_streaming_float<STREAMING>, \
+        .find_add_mismatch = private__find_add_mismatch_float<MISMATCH>, \
+        .add_error = private__add_error_typed<float>, .checksum = private__checksum_typed<float>,                  \
+        .random = private__random_float_adapter<RANDOM> }
+
+// Kernel sets compiled into this build, ordered from narrowest to widest. The x64 sets past SSE2
+// are only used if `private__cpu_supports()` their instruction set.
+static const cpu_kernels_t kernel_sets[] = {
+    { .isa = CPU_KERNELS_ISA_SCALAR, .name = "scalar", .add_arrays = private__add_arrays_scalar, .add_arrays_streaming = private__add_arrays_streaming_scalar, .find_add_mismatch = private__find_add_mismatch_scalar, .random_floats = private__random_floats_scalar, .sum = private__sum_scalar, .dot = private__dot_scalar, .min_max = private__min_max_scalar },
+#if defined(TM_CPU_SSE)
+    { .isa = CPU_KERNELS_ISA_SSE2, .name = "sse2", .add_arrays = private__add_arrays_sse2, .add_arrays_streaming = private__add_arrays_streaming_sse2, .find_add_mismatch = private__find_add_mismatch_sse2, .random_floats = private__random_floats_sse2, .sum = private__sum_sse2, .dot = private__dot_sse2, .min_max = private__min_max_sse2 },
+    { .isa = CPU_KERNELS_ISA_AVX2, .name = "avx2", .add_arrays = private__add_arrays_avx2, .add_arrays_streaming = private__add_arrays_streaming_avx2, .find_add_mismatch = private__find_add_mismatch_avx2, .random_floats = private__random_floats_avx2, .sum = private__sum_avx2, .dot = private__dot_avx2, .min_max = private__min_max_avx2 },
+    { .isa = CPU_KERNELS_ISA_AVX512, .name = "avx512", .add_arrays = private__add_arrays_avx512, .add_arrays_streaming = private__add_arrays_streaming_avx512, .find_add_mismatch = private__find_add_mismatch_avx512, .random_floats = private__random_floats_avx512, .sum = private__sum_avx512, .dot = private__dot_avx512, .min_max = private__min_max_avx512 },
+#endif
+#if defined(TM_CPU_NEON)
+    { .isa = CPU_KERNELS_ISA_NEON, .name = "neon", .add_arrays = private__add_arrays_neon, .add_arrays_streaming = private__add_arrays_streaming_neon, .find_add_mismatch = private__find_add_mismatch_neon, .random_floats = private__random_floats_neon, .sum = private__sum_neon, .dot = private__dot_neon, .min_max = private__min_max_neon },
+#endif
+};
+
+// The float kernels of each entry of `kernel_sets`.
+static const cpu_kernels_dtype_t float_kernels[] = {
+    FLOAT_KERNELS(private__add_arrays_scalar, private__add_arrays_streaming_scalar, private__find_add_mismatch_scalar, private__random_floats_scalar),
+#if defined(TM_CPU_SSE)
+    FLOAT_KERNELS(private__add_arrays_sse2, private__add_arrays_streaming_sse2, private__find_add_mismatch_sse2, private__random_floats_sse2),
+    FLOAT_KERNELS(private__add_arrays_avx2, private__add_arrays_streaming_avx2, private__find_add_mismatch_avx2, private__random_floats_avx2),
+    FLOAT_KERNELS(private__add_arrays_avx512, private__add_arrays_streaming_avx512, private__find_add_mismatch_avx512, private__random_floats_avx512),
+#endif
+#if defined(TM_CPU_NEON)
+    FLOAT_KERNELS(private__add_arrays_neon, private__add_arrays_streaming_neon, private__find_add_mismatch_neon, private__random_floats_neon),
+#endif
+};
+
+// Kernels of the other element types, indexed by `enum metal_adder_dtype`.
+static const cpu_kernels_dtype_t dtype_kernels[METAL_ADDER_DTYPE_COUNT] = {
+    TYPED_KERNELS(METAL_ADDER_DTYPE_FLOAT, float, "float"),
+    TYPED_KERNELS(METAL_ADDER_DTYPE_HALF, half_t, "half"),
+    TYPED_KERNELS(METAL_ADDER_DTYPE_BFLOAT16, bfloat16_t, "bfloat16"),
+    TYPED_KERNELS(METAL_ADDER_DTYPE_DOUBLE, double, "double"),
+    TYPED_KERNELS(METAL_ADDER_DTYPE_INT32, int32_t, "int32"),
+    TYPED_KERNELS(METAL_ADDER_DTYPE_INT64, int64_t, "int64"),
+};
+
+#if defined(TM_CPU_X64)
+
+static uint64_t private__xgetbv(uint32_t index)
+{
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return (uint64_t)edx << 32 | eax;
+}
+
+// Checks the CPUID feature bits of `isa`, and that the OS saves the registers it uses on context
+// switches, which XCR0 reports. Without the latter, the instructions fault even if the CPU has them.
+static bool private__cpu_supports(enum cpu_kernels_isa isa)
+{
+    if (isa != CPU_KERNELS_ISA_AVX2 && isa != CPU_KERNELS_ISA_AVX512)
+        return true;
+
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    const bool osxsave = ecx >> 27 & 1, avx = ecx >> 28 & 1, fma = ecx >> 12 & 1;
+    if (!osxsave || !avx || !fma)
+        return false;
+
+    // XMM and YMM state, plus the opmask and ZMM state for AVX-512.
+    const uint64_t xcr0 = private__xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6)
+        return false;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    if (isa == CPU_KERNELS_ISA_AVX2)
+        return ebx >> 5 & 1;
+    return (ebx >> 16 & 1) && (xcr0 & 0xe6) == 0xe6;
+}
+
+#else
+
+static bool private__cpu_supports(enum cpu_kernels_isa isa)
+{
+    return true;
+}
+
+#endif
+
+const cpu_kernels_t *cpu_kernels__select(const char *name)
+{
+    const cpu_kernels_t *widest = kernel_sets;
+    for (const cpu_kernels_t *k = kernel_sets; k != kernel_sets + TM_ARRAY_COUNT(kernel_sets); ++k) {
+        if (private__cpu_supports(k->isa))
+            widest = k;
+    }
+    if (!name)
+        return widest;
+
+    for (const cpu_kernels_t *k = kernel_sets; k != kernel_sets + TM_ARRAY_COUNT(kernel_sets); ++k) {
+        if (!strcmp(k->name, name) && private__cpu_supports(k->isa))
+            return k;
+    }
+    TM_LOG("CPU kernels `%s` aren't supported by this build or CPU, using %s\n", name, widest->name);
+    return widest;
+}
+
+const cpu_kernels_t *cpu_kernels__select_isa(enum cpu_kernels_isa isa)
+{
+    for (const cpu_kernels_t *k = kernel_sets; k != kernel_sets + TM_ARRAY_COUNT(kernel_sets); ++k) {
+        if (k->isa == isa)
+            return k;
+    }
+    return cpu_kernels__select(NULL);
+}
+
+const cpu_kernels_dtype_t *cpu_kernels__select_dtype(const cpu_kernels_t *kernels, enum metal_adder_dtype dtype)
+{
+    if (dtype == METAL_ADDER_DTYPE_FLOAT)
+        return &float_kernels[kernels - kernel_sets];
+    return &dtype_kernels[dtype];
+}
+
+#if defined(TM_OS_LINUX)
+
+// Reads the first line of `path` into `line`.
+static bool private__read_line(const char *path, char *line, int size)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    const bool ok = fgets(line, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+uint64_t cpu_kernels__llc_size(void)
+{
+    // The caches of CPU 0 are listed as `index0`, `index1`, ... in no particular order.
+    uint64_t size = 0;
+    uint32_t level = 0;
+    for (uint32_t i = 0; i < 16; ++i) {
+        char path[128], line[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/type", i);
+        if (!private__read_line(path, line, sizeof(line)))
+            break;
+        if (!strncmp(line, "Instruction", 11))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/level", i);
+        if (!private__read_line(path, line, sizeof(line)))
+            continue;
+        const uint32_t l = (uint32_t)strtoul(line, NULL, 10);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/size", i);
+        if (l < level || !private__read_line(path, line, sizeof(line)))
+            continue;
+        char *unit;
+        uint64_t bytes = strtoull(line, &unit, 10);
+        bytes <<= *unit == 'K' ? 10 : *unit == 'M' ? 20 : 0;
+        if (bytes) {
+            level = l;
+            size = bytes;
+        }
+    }
+    return size ? size : CPU_KERNELS_DEFAULT_LLC_SIZE;
+}
+
+#elif defined(TM_OS_MACOSX)
+
+uint64_t cpu_kernels__llc_size(void)
+{
+    // Apple silicon has no L3 and reports its shared L2 as the last level.
+    const char *const names[] = { "hw.l3cachesize", "hw.l2cachesize" };
+    for (uint32_t i = 0; i < TM_ARRAY_COUNT(names); ++i) {
+        uint64_t size = 0;
+        size_t len = sizeof(size);
+        if (!sysctlbyname(names[i], &size, &len, NULL, 0) && size)
+            return size;
+    }
+    return CPU_KERNELS_DEFAULT_LLC_SIZE;
+}
+
+#else
+
+uint64_t cpu_kernels__llc_size(void)
+{
+    return CPU_KERNELS_DEFAULT_LLC_SIZE;
+}
+
+#endif
+
+// State of one of the parallel-fors of a `cpu_kernels_async_o`.
+typedef struct parallel_for_state_t
+{
+    // Counts down the ranges that haven't finished yet. The last range to finish records `end`.
+    std::atomic<uint64_t> remaining;
+    tm_clock_o end;
+} parallel_for_state_t;
+
+typedef struct parallel_for_job_t
+{
+    void (*f)(void *data, uint64_t begin, uint64_t end);
+    void *data;
+    uint64_t begin;
+    uint64_t end;
+
+    parallel_for_state_t *state;
+    struct cpu_kernels_async_o *async;
+} parallel_for_job_t;
+
+struct cpu_kernels_async_o
+{
+    tm_allocator_i *allocator;
+    uint64_t bytes;
+
+    tm_atomic_counter_o *counter;
+
+    uint32_t num_fors;
+    TM_PAD(4);
+    parallel_for_state_t *states;
+
+    // One entry per range, interleaved across the parallel-fors.
+    parallel_for_job_t *jobs;
+    uint64_t num_ranges;
+
+    // With a job limit, each job runs the next range that hasn't been started until there are none
+    // left.
+    std::atomic<uint64_t> next;
+
+    // Counts down the ranges that haven't finished yet. The last range to finish records the time
+    // and then sets `done`.
+    std::atomic<uint64_t> remaining;
+    std::atomic<bool> done;
+    TM_PAD(7);
+    tm_clock_o start;
+    tm_clock_o end;
+
+    // Followed by the `parallel_for_state_t`, `parallel_for_job_t` and `tm_jobdecl_t` arrays.
+};
+
+static void private__run_range(const parallel_for_job_t *job)
+{
+    job->f(job->data, job->begin, job->end);
+
+    const tm_clock_o now = tm_os_api->time->now();
+    if (job->state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        job->state->end = now;
+    if (job->async->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        job->async->end = now;
+        job->async->done.store(true, std::memory_order_release);
+    }
+}
+
+static void private__parallel_for_job(void *data)
+{
+    private__run_range((const parallel_for_job_t *)data);
+}
+
+static void private__parallel_for_limited_job(void *data)
+{
+    cpu_kernels_async_o *async = (cpu_kernels_async_o *)data;
+    for (uint64_t i = async->next.fetch_add(1, std::memory_order_relaxed); i < async->num_ranges;
+         i = async->next.fetch_add(1, std::memory_order_relaxed))
+        private__run_range(async->jobs + i);
+}
+
+static uint64_t private__num_ranges(const cpu_kernels_parallel_for_t *pf)
+{
+    return (pf->n + pf->grain_size - 1) / pf->grain_size;
+}
+
+cpu_kernels_async_o *cpu_kernels__parallel_for_group_async(tm_allocator_i *allocator, const cpu_kernels_parallel_for_t *fors,
+    uint32_t num_fors, uint32_t max_jobs)
+{
+    uint64_t num_ranges = 0, max_ranges = 0;
+    for (uint32_t p = 0; p < num_fors; ++p) {
+        num_ranges += private__num_ranges(fors + p);
+        max_ranges = tm_max(max_ranges, private__num_ranges(fors + p));
+    }
+    const bool limited = max_jobs && max_jobs < num_ranges;
+    const uint64_t num_jobs = limited ? max_jobs : num_ranges;
+
+    const uint64_t bytes = sizeof(cpu_kernels_async_o) + num_fors * sizeof(parallel_for_state_t)
+        + num_ranges * sizeof(parallel_for_job_t) + num_jobs * sizeof(tm_jobdecl_t);
+    cpu_kernels_async_o *async = (cpu_kernels_async_o *)tm_alloc(allocator, bytes);
+    memset((void *)async, 0, sizeof(*async) + num_fors * sizeof(parallel_for_state_t));
+    async->allocator = allocator;
+    async->bytes = bytes;
+    async->num_fors = num_fors;
+    async->states = (parallel_for_state_t *)(async + 1);
+    async->jobs = (parallel_for_job_t *)(async->states + num_fors);
+    async->num_ranges = num_ranges;
+    async->remaining.store(num_ranges, std::memory_order_relaxed);
+
+    for (uint32_t p = 0; p < num_fors; ++p)
+        async->states[p].remaining.store(private__num_ranges(fors + p), std::memory_order_relaxed);
+    async->start = tm_os_api->time->now();
+
+    // Taking the k-th range of each parallel-for in turn spreads limited jobs over all of them.
+    uint64_t r = 0;
+    for (uint64_t k = 0; k < max_ranges; ++k) {
+        for (uint32_t p = 0; p < num_fors; ++p) {
+            const cpu_kernels_parallel_for_t *pf = fors + p;
+            if (k >= private__num_ranges(pf))
+                continue;
+            async->jobs[r++] = { .f = pf->f, .data = pf->data, .begin = tm_min(k * pf->grain_size, pf->n),
+                .end = tm_min((k + 1) * pf->grain_size, pf->n), .state = async->states + p, .async = async };
+        }
+    }
+
+    tm_jobdecl_t *decls = (tm_jobdecl_t *)(async->jobs + num_ranges);
+    for (uint64_t i = 0; i < num_jobs; ++i) {
+        if (limited)
+            decls[i] = { .task = private__parallel_for_limited_job, .data = async };
+        else
+            decls[i] = { .task = private__parallel_for_job, .data = async->jobs + i };
+    }
+
+    // Empty parallel-fors have no ranges, and finish as soon as they start.
+    for (uint32_t p = 0; p < num_fors; ++p) {
+        if (!private__num_ranges(fors + p))
+            async->states[p].end = async->start;
+    }
+    if (!num_ranges) {
+        async->end = async->start;
+        async->done.store(true, std::memory_order_relaxed);
+        return async;
+    }
+
+    async->counter = tm_job_system_api->run_jobs(decls, (uint32_t)num_jobs);
+    return async;
+}
+
+cpu_kernels_async_o *cpu_kernels__parallel_for_async(tm_allocator_i *allocator, uint64_t n, uint64_t grain_size,
+    void (*f)(void *data, uint64_t begin, uint64_t end), void *data)
+{
+    const cpu_kernels_parallel_for_t pf = { .n = n, .grain_size = grain_size, .f = f, .data = data };
+    return cpu_kernels__parallel_for_group_async(allocator, &pf, 1, 0);
+}
+
+bool cpu_kernels__is_done(const cpu_kernels_async_o *async)
+{
+    return async->done.load(std::memory_order_acquire);
+}
+
+static void private__wait_for_counter(tm_atomic_counter_o *counter)
+{
+    // Without a main fiber the application runs on the main OS thread, which can't yield to the job
+    // system.
+    if (TM_IS_DEFINED(TM_NO_MAIN_FIBER))
+        tm_job_system_api->wait_for_counter_and_free_from_os_thread(counter, 0.0);
+    else
+        tm_job_system_api->wait_for_counter_and_free(counter);
+}
+
+double cpu_kernels__wait_group(cpu_kernels_async_o *async, double *seconds)
+{
+    if (async->counter)
+        private__wait_for_counter(async->counter);
+
+    for (uint32_t p = 0; seconds && p < async->num_fors; ++p)
+        seconds[p] = tm_os_api->time->delta(async->states[p].end, async->start);
+    const double total = tm_os_api->time->delta(async->end, async->start);
+    tm_free(async->allocator, async, async->bytes);
+    return total;
+}
+
+double cpu_kernels__wait(cpu_kernels_async_o *async)
+{
+    return cpu_kernels__wait_group(async, NULL);
+}
+
+void cpu_kernels__parallel_for(uint64_t n, uint64_t grain_size, void (*f)(void *data, uint64_t begin, uint64_t end), void *data)
+{
+    if (n <= grain_size) {
+        f(data, 0, n);
+        return;
+    }
+
+    cpu_kernels__wait(cpu_kernels__parallel_for_async(tm_allocator_api->system, n, grain_size, f, data));
+}
+
+typedef struct job_list_job_t
+{
+    void (*f)(void *data, uint64_t begin, uint64_t end);
+    void *data;
+    uint64_t begin;
+    uint64_t end;
+} job_list_job_t;
+
+struct cpu_kernels_job_list_o
+{
+    tm_allocator_i *allocator;
+
+    // carrays of the jobs and of their declarations, which point into `jobs`.
+    job_list_job_t *jobs;
+    tm_jobdecl_t *decls;
+};
+
+static void private__job_list_job(void *data)
+{
+    const job_list_job_t *job = (const job_list_job_t *)data;
+    job->f(job->data, job->begin, job->end);
+}
+
+cpu_kernels_job_list_o *cpu_kernels__job_list_create(tm_allocator_i *allocator)
+{
+    cpu_kernels_job_list_o *list = (cpu_kernels_job_list_o *)tm_alloc(allocator, sizeof(cpu_kernels_job_list_o));
+    *list = (cpu_kernels_job_list_o){ .allocator = allocator };
+    return list;
+}
+
+void cpu_kernels__job_list_add(cpu_kernels_job_list_o *list, uint64_t n, uint64_t grain_size,
+    void (*f)(void *data, uint64_t begin, uint64_t end), void *data)
+{
+    for (uint64_t begin = 0; begin < n; begin += grain_size) {
+        const job_list_job_t job = { .f = f, .data = data, .begin = begin, .end = tm_min(begin + grain_size, n) };
+        tm_carray_push(list->jobs, job, list->allocator);
+    }
+
+    // Pushing can move the jobs, so all the declarations are pointed at them again.
+    tm_carray_resize(list->decls, tm_carray_size(list->jobs), list->allocator);
+    for (uint64_t i = 0; i < tm_carray_size(list->jobs); ++i)
+        list->decls[i] = (tm_jobdecl_t){ .task = private__job_list_job, .data = list->jobs + i };
+}
+
+void cpu_kernels__job_list_run(const cpu_kernels_job_list_o *list)
+{
+    const uint64_t num_jobs = tm_carray_size(list->jobs);
+    if (num_jobs <= 1) {
+        if (num_jobs)
+            private__job_list_job(list->jobs);
+        return;
+    }
+    private__wait_for_counter(tm_job_system_api->run_jobs(list->decls, (uint32_t)num_jobs));
+}
+
+void cpu_kernels__job_list_free(cpu_kernels_job_list_o *list)
+{
+    tm_allocator_i *allocator = list->allocator;
+    tm_carray_free(list->jobs, allocator);
+    tm_carray_free(list->decls, allocator);
+    tm_free(allocator, list, sizeof(cpu_kernels_job_list_o));
+}
+
+typedef struct random_job_t
+{
+    const cpu_kernels_dtype_t *kernels;
+    void *data;
+    uint32_t key[2];
+} random_job_t;
+
+static void private__random_job(void *data, uint64_t begin, uint64_t end)
+{
+    const random_job_t *job = (const random_job_t *)data;
+    job->kernels->random((char *)job->data + begin * job->kernels->element_size, begin, end - begin, job->key);
+}
+
+// SplitMix64 finalizer, used to derive stream keys from the seed.
+static uint64_t private__mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void cpu_kernels__generate_random(const cpu_kernels_dtype_t *kernels, void *data, uint64_t n, uint64_t seed,
+    uint64_t stream, uint64_t grain_size)
+{
+    const uint64_t key = private__mix64(private__mix64(seed) ^ stream);
+    random_job_t job = {
+        .kernels = kernels,
+        .data = data,
+        .key = { (uint32_t)key, (uint32_t)(key >> 32) },
+    };
+    cpu_kernels__parallel_for(n, grain_size, private__random_job, &job);
+}
+
+typedef struct verify_add_job_t
+{
+    const cpu_kernels_dtype_t *kernels;
+    const char *a;
+    const char *b;
+    const char *result;
+    uint64_t n;
+    uint64_t grain_size;
+    uint32_t ulp_tolerance;
+    TM_PAD(4);
+
+    // Indices of the blocks of `grain_size` elements to verify, used by
+    // `private__verify_blocks_job()`.
+    const uint64_t *blocks;
+
+    // One partial report per block, merged in index order once all jobs are done.
+    cpu_kernels_verify_report_t *reports;
+} verify_add_job_t;
+
+static void private__verify_add_job(void *data, uint64_t begin, uint64_t end)
+{
+    const verify_add_job_t *job = (const verify_add_job_t *)data;
+    cpu_kernels_verify_report_t *report = job->reports + begin / job->grain_size;
+
+    // The vector kernel skips ahead to the next result that isn't bit-exact, only those are measured
+    // one by one.
+    const uint64_t size = job->kernels->element_size;
+    report->num_diffed += end - begin;
+    uint64_t i = begin;
+    while ((i += job->kernels->find_add_mismatch(job->a + i * size, job->b + i * size, job->result + i * size, end - i)) < end) {
+        double abs_error;
+        const uint64_t ulp_error = job->kernels->add_error(job->a, job->b, job->result, i, &abs_error);
+        report->max_ulp_error = (uint32_t)tm_min(tm_max((uint64_t)report->max_ulp_error, ulp_error), (uint64_t)UINT32_MAX);
+        report->max_abs_error = tm_max(report->max_abs_error, abs_error);
+        if (ulp_error > job->ulp_tolerance) {
+            if (report->num_reported < CPU_KERNELS_MAX_REPORTED_MISMATCHES)
+                report->first_mismatches[report->num_reported++] = i;
+            ++report->num_mismatches;
+        }
+        ++i;
+    }
+}
+
+static void private__verify_blocks_job(void *data, uint64_t begin, uint64_t end)
+{
+    const verify_add_job_t *job = (const verify_add_job_t *)data;
+    for (uint64_t j = begin; j < end; ++j) {
+        const uint64_t first = job->blocks[j] * job->grain_size;
+        private__verify_add_job(data, first, tm_min(first + job->grain_size, job->n));
+    }
+}
+
+// Merges the per-block reports of `job` and logs the outcome.
+static bool private__finish_verify(const verify_add_job_t *job, cpu_kernels_verify_report_t *report)
+{
+    const uint64_t num_blocks = (job->n + job->grain_size - 1) / job->grain_size;
+    cpu_kernels_verify_report_t total = { 0 };
+    for (uint64_t j = 0; j < num_blocks; ++j) {
+        const cpu_kernels_verify_report_t *r = job->reports + j;
+        for (uint32_t k = 0; k < r->num_reported && total.num_reported < CPU_KERNELS_MAX_REPORTED_MISMATCHES; ++k)
+            total.first_mismatches[total.num_reported++] = r->first_mismatches[k];
+        total.num_mismatches += r->num_mismatches;
+        total.num_diffed += r->num_diffed;
+        total.max_ulp_error = tm_max(total.max_ulp_error, r->max_ulp_error);
+        total.max_abs_error = tm_max(total.max_abs_error, r->max_abs_error);
+    }
+
+    if (total.num_mismatches) {
+        char indices[CPU_KERNELS_MAX_REPORTED_MISMATCHES * 22] = { 0 };
+        uint32_t len = 0;
+        for (uint32_t k = 0; k < total.num_reported; ++k)
+            len += (uint32_t)snprintf(indices + len, sizeof(indices) - len, " %llu", (unsigned long long)total.first_mismatches[k]);
+        TM_LOG("Compute ERROR: %llu of %llu results off by more than %u ulp (max error %g, %u ulp), first at:%s\n",
+            (unsigned long long)total.num_mismatches, (unsigned long long)job->n, job->ulp_tolerance, total.max_abs_error, total.max_ulp_error, indices);
+    } else if (total.max_ulp_error)
+        TM_LOG("Compute results as expected (max error %g, %u ulp)\n", total.max_abs_error, total.max_ulp_error);
+    else
+        TM_LOG("Compute results as expected\n");
+
+    if (report)
+        *report = total;
+    return total.num_mismatches == 0;
+}
+
+bool cpu_kernels__verify_add(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, const void *result,
+    uint64_t n, uint64_t grain_size, uint32_t ulp_tolerance, cpu_kernels_verify_report_t *report)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    const uint64_t num_blocks = (n + grain_size - 1) / grain_size;
+    verify_add_job_t job = {
+        .kernels = kernels,
+        .a = (const char *)a,
+        .b = (const char *)b,
+        .result = (const char *)result,
+        .n = n,
+        .grain_size = grain_size,
+        .ulp_tolerance = ulp_tolerance,
+        .reports = (cpu_kernels_verify_report_t *)tm_temp_alloc(ta, num_blocks * sizeof(cpu_kernels_verify_report_t)),
+    };
+    memset(job.reports, 0, num_blocks * sizeof(cpu_kernels_verify_report_t));
+    cpu_kernels__parallel_for(n, grain_size, private__verify_add_job, &job);
+    const bool ok = private__finish_verify(&job, report);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return ok;
+}
+
+// Elements per chunk when checksumming sums that aren't stored anywhere. The chunk is added into a
+// buffer on the stack, which stays in L1.
+#define CHECKSUM_CHUNK 1024
+
+typedef struct add_checksums_job_t
+{
+    const cpu_kernels_dtype_t *kernels;
+    const char *a;
+    const char *b;
+    uint64_t first;
+    uint64_t block_size;
+    uint32_t *checksums;
+} add_checksums_job_t;
+
+static void private__add_checksums_job(void *data, uint64_t begin, uint64_t end)
+{
+    const add_checksums_job_t *job = (const add_checksums_job_t *)data;
+    const uint64_t size = job->kernels->element_size;
+    uint64_t sum[CHECKSUM_CHUNK];
+    uint32_t checksum = 0;
+    for (uint64_t i = begin; i < end; i += CHECKSUM_CHUNK) {
+        const uint64_t n = tm_min(end - i, (uint64_t)CHECKSUM_CHUNK);
+        job->kernels->add_arrays(job->a + i * size, job->b + i * size, sum, n);
+        checksum += job->kernels->checksum(sum, job->first + i, n);
+    }
+    job->checksums[begin / job->block_size] = checksum;
+}
+
+void cpu_kernels__add_checksums(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, uint64_t first,
+    uint64_t n, uint64_t block_size, uint32_t *checksums)
+{
+    add_checksums_job_t job = {
+        .kernels = kernels,
+        .a = (const char *)a,
+        .b = (const char *)b,
+        .first = first,
+        .block_size = block_size,
+        .checksums = checksums,
+    };
+    cpu_kernels__parallel_for(n, block_size, private__add_checksums_job, &job);
+}
+
+bool cpu_kernels__verify_add_blocks(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, const void *result,
+    uint64_t n, uint64_t block_size, const uint64_t *blocks, uint64_t num_blocks, uint32_t ulp_tolerance,
+    cpu_kernels_verify_report_t *report)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    const uint64_t total_blocks = (n + block_size - 1) / block_size;
+    verify_add_job_t job = {
+        .kernels = kernels,
+        .a = (const char *)a,
+        .b = (const char *)b,
+        .result = (const char *)result,
+        .n = n,
+        .grain_size = block_size,
+        .ulp_tolerance = ulp_tolerance,
+        .blocks = blocks,
+        .reports = (cpu_kernels_verify_report_t *)tm_temp_alloc(ta, total_blocks * sizeof(cpu_kernels_verify_report_t)),
+    };
+    memset(job.reports, 0, total_blocks * sizeof(cpu_kernels_verify_report_t));
+    if (num_blocks)
+        cpu_kernels__parallel_for(num_blocks, 1, private__verify_blocks_job, &job);
+    const bool ok = private__finish_verify(&job, report);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return ok;
+}
+
+bool cpu_kernels__verify_add_checksums(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, const void *result,
+    uint64_t n, uint64_t block_size, const uint32_t *expected, const uint32_t *checksums, uint32_t ulp_tolerance,
+    cpu_kernels_verify_report_t *report)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    const uint64_t num_blocks = (n + block_size - 1) / block_size;
+    uint64_t *blocks = (uint64_t *)tm_temp_alloc(ta, num_blocks * sizeof(uint64_t));
+    uint64_t num_flagged = 0;
+    for (uint64_t j = 0; j < num_blocks; ++j) {
+        if (checksums[j] != expected[j])
+            blocks[num_flagged++] = j;
+    }
+    const bool ok = cpu_kernels__verify_add_blocks(kernels, a, b, result, n, block_size, blocks, num_flagged, ulp_tolerance, report);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return ok;
+}
+
+double cpu_kernels__pairwise_sum(const double *values, uint64_t n)
+{
+    if (n <= 2)
+        return n == 2 ? values[0] + values[1] : n ? values[0] : 0.0;
+    const uint64_t half = n / 2;
+    return cpu_kernels__pairwise_sum(values, half) + cpu_kernels__pairwise_sum(values + half, n - half);
+}
+
+typedef struct reduce_job_t
+{
+    const cpu_kernels_t *kernels;
+    const float *a;
+    const float *b;
+    uint64_t grain_size;
+
+    // One partial result per job, combined in index order once all jobs are done. `sums` is used by
+    // `cpu_kernels__sum()`, `mins` and `maxs` by `cpu_kernels__min_max()`.
+    double *sums;
+    float *mins;
+    float *maxs;
+} reduce_job_t;
+
+static void private__sum_job(void *data, uint64_t begin, uint64_t end)
+{
+    const reduce_job_t *job = (const reduce_job_t *)data;
+    job->sums[begin / job->grain_size] = job->b ? job->kernels->dot(job->a + begin, job->b + begin, end - begin)
+                                                : job->kernels->sum(job->a + begin, end - begin);
+}
+
+static void private__min_max_job(void *data, uint64_t begin, uint64_t end)
+{
+    const reduce_job_t *job = (const reduce_job_t *)data;
+    const uint64_t j = begin / job->grain_size;
+    job->kernels->min_max(job->a + begin, end - begin, job->mins + j, job->maxs + j);
+}
+
+double cpu_kernels__sum(const cpu_kernels_t *kernels, const float *a, const float *b, uint64_t n, uint64_t grain_size)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    const uint64_t num_jobs = tm_max((n + grain_size - 1) / grain_size, 1);
+    reduce_job_t job = {
+        .kernels = kernels,
+        .a = a,
+        .b = b,
+        .grain_size = grain_size,
+        .sums = (double *)tm_temp_alloc(ta, num_jobs * sizeof(double)),
+    };
+    job.sums[0] = 0;
+    cpu_kernels__parallel_for(n, grain_size, private__sum_job, &job);
+    const double sum = cpu_kernels__pairwise_sum(job.sums, num_jobs);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return sum;
+}
+
+void cpu_kernels__min_max(const cpu_kernels_t *kernels, const float *a, uint64_t n, uint64_t grain_size, float *min,
+    float *max)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    const uint64_t num_jobs = tm_max((n + grain_size - 1) / grain_size, 1);
+    reduce_job_t job = {
+        .kernels = kernels,
+        .a = a,
+        .grain_size = grain_size,
+        .mins = (float *)tm_temp_alloc(ta, num_jobs * sizeof(float)),
+        .maxs = (float *)tm_temp_alloc(ta, num_jobs * sizeof(float)),
+    };
+    for (uint64_t j = 0; j < num_jobs; ++j) {
+        job.mins[j] = INFINITY;
+        job.maxs[j] = -INFINITY;
+    }
+    cpu_kernels__parallel_for(n, grain_size, private__min_max_job, &job);
+
+    *min = INFINITY;
+    *max = -INFINITY;
+    private__merge_min_max(job.mins, job.maxs, num_jobs, min, max);
+    if (*min > *max)
+        *min = *max = NAN;
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+}
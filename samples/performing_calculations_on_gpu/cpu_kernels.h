@@ -0,0 +1,249 @@
+#pragma once
+
+#include "metal_adder.h"
+
+#include <foundation/api_types.h>
+
+// Vectorized loops shared by the adder backends. The Metal backend uses them for everything that
+// runs on the host (filling and verifying buffers), the CPU backend also uses them for the compute
+// kernels themselves.
+
+// Instruction set a kernel set was compiled for. On x64, all sets are built into the same binary
+// and the widest one the CPU supports is selected at runtime.
+enum cpu_kernels_isa {
+    CPU_KERNELS_ISA_SCALAR,
+    CPU_KERNELS_ISA_SSE2,
+    CPU_KERNELS_ISA_AVX2, // With FMA.
+    CPU_KERNELS_ISA_AVX512, // AVX-512F.
+    CPU_KERNELS_ISA_NEON,
+};
+
+typedef struct cpu_kernels_t
+{
+    enum cpu_kernels_isa isa;
+    TM_PAD(4);
+
+    const char *name;
+
+    // Computes `result[i] = a[i] + b[i]` for `i` in `[0, n)`.
+    void (*add_arrays)(const float *a, const float *b, float *result, uint64_t n);
+
+    // As `add_arrays`, but writes `result` with non-temporal stores and prefetches `a` and `b`
+    // `prefetch_distance` bytes ahead. The stores skip reading the result's cache lines before
+    // overwriting them, which saves a third of the memory traffic once the arrays don't fit in the
+    // cache, but leaves the results in memory rather than in the cache.
+    void (*add_arrays_streaming)(const float *a, const float *b, float *result, uint64_t n, uint64_t prefetch_distance);
+
+    // Returns the first index `i` in `[0, n)` where `result[i]` is not bit-equal to `a[i] + b[i]`,
+    // or `n` if there is none.
+    uint64_t (*find_add_mismatch)(const float *a, const float *b, const float *result, uint64_t n);
+
+    // Sets `data[i]` to the random float for element `first + i` of the stream identified by `key`.
+    // See `cpu_kernels__generate_random()`.
+    void (*random_floats)(float *data, uint64_t first, uint64_t n, const uint32_t key[2]);
+
+    // Returns the sum of `a[i]` for `i` in `[0, n)`. Each vector lane keeps a Kahan-compensated
+    // float sum and the lanes are added up in double, in lane order.
+    double (*sum)(const float *a, uint64_t n);
+
+    // As `sum`, for the products `a[i] * b[i]`.
+    double (*dot)(const float *a, const float *b, uint64_t n);
+
+    // Sets `*min` and `*max` to the smallest and largest `a[i]`, ignoring NaNs. They are left as
+    // they are if there are no other values, so callers should start them at `INFINITY` and
+    // `-INFINITY`.
+    void (*min_max)(const float *a, uint64_t n, float *min, float *max);
+} cpu_kernels_t;
+
+// Kernels for one element type of the adder's buffers, see `cpu_kernels__select_dtype()`. The
+// arrays are passed untyped and hold elements of `element_size` bytes.
+typedef struct cpu_kernels_dtype_t
+{
+    enum metal_adder_dtype dtype;
+    uint32_t element_size;
+
+    const char *name;
+
+    // Computes `result[i] = a[i] + b[i]` for `i` in `[0, n)`. Half and bfloat16 are added in float
+    // and rounded once, which gives the correctly rounded sum. Integers wrap around.
+    void (*add_arrays)(const void *a, const void *b, void *result, uint64_t n);
+
+    // As `add_arrays`, with non-temporal stores, see `cpu_kernels_t::add_arrays_streaming`.
+    void (*add_arrays_streaming)(const void *a, const void *b, void *result, uint64_t n, uint64_t prefetch_distance);
+
+    // Returns the first index `i` in `[0, n)` where `result[i]` is not bit-equal to `a[i] + b[i]`,
+    // or `n` if there is none.
+    uint64_t (*find_add_mismatch)(const void *a, const void *b, const void *result, uint64_t n);
+
+    // Returns the distance from `result[i]` to `a[i] + b[i]` in ulps of the element type, or in
+    // units for integers, and sets `*abs_error` to the absolute difference. `+0` and `-0` are 0 ulps
+    // apart, as are any two NaNs, so results that `find_add_mismatch` flags only for the sign of a
+    // zero or a NaN's payload pass any tolerance. A NaN and a number are `UINT64_MAX` ulps apart.
+    uint64_t (*add_error)(const void *a, const void *b, const void *result, uint64_t i, double *abs_error);
+
+    // Returns the checksum of the `n` elements at `data`, which are the elements `[first, first + n)`
+    // of an array. The checksum of a range is the wrapping sum of the checksums of its elements, see
+    // `cpu_kernels__add_checksums()`.
+    uint32_t (*checksum)(const void *data, uint64_t first, uint64_t n);
+
+    // The random floats of `cpu_kernels_t::random_floats`, converted to the element type. Integers
+    // get the random bits as a value in `[0, 2^24)`.
+    void (*random)(void *data, uint64_t first, uint64_t n, const uint32_t key[2]);
+} cpu_kernels_dtype_t;
+
+// Maximum number of mismatching indices recorded in a `cpu_kernels_verify_report_t`.
+#define CPU_KERNELS_MAX_REPORTED_MISMATCHES 16
+
+// Summary of a verification pass.
+typedef struct cpu_kernels_verify_report_t
+{
+    // Number of results that differ from the expected value by more than the ulp tolerance.
+    uint64_t num_mismatches;
+
+    // The indices of the first `num_reported` mismatches, in ascending order.
+    uint64_t first_mismatches[CPU_KERNELS_MAX_REPORTED_MISMATCHES];
+    uint32_t num_reported;
+
+    // Largest error over all results that weren't bit-exact, including the ones within tolerance.
+    uint32_t max_ulp_error;
+    double max_abs_error;
+
+    // Number of results that were compared with `a[i] + b[i]`. Less than the array length if
+    // checksums ruled out some blocks, see `cpu_kernels__verify_add_checksums()`, or only some blocks
+    // were verified, see `cpu_kernels__verify_add_blocks()`.
+    uint64_t num_diffed;
+} cpu_kernels_verify_report_t;
+
+// Size assumed for the last-level cache when it can't be detected.
+#define CPU_KERNELS_DEFAULT_LLC_SIZE (8 * 1024 * 1024)
+
+// Returns the size in bytes of the last-level data cache of the CPU, or
+// `CPU_KERNELS_DEFAULT_LLC_SIZE` if it can't be detected. On systems with several LLCs, such as
+// multi-socket machines, this is the size of one of them.
+uint64_t cpu_kernels__llc_size(void);
+
+// Returns the kernel set called `name` ("scalar", "sse2", "avx2", "avx512" or "neon"). If `name` is
+// NULL, or this build or the CPU doesn't have that set, returns the widest set the CPU supports.
+const cpu_kernels_t *cpu_kernels__select(const char *name);
+
+// Returns the kernel set for `isa`, which must have been returned by `cpu_kernels__select()`. Used
+// to find the set again after a hot reload.
+const cpu_kernels_t *cpu_kernels__select_isa(enum cpu_kernels_isa isa);
+
+// Returns the kernels for `dtype`. Floats use the vector loops of `kernels`, the other types use
+// loops specialized for the type at compile time and vectorized by the compiler.
+const cpu_kernels_dtype_t *cpu_kernels__select_dtype(const cpu_kernels_t *kernels, enum metal_adder_dtype dtype);
+
+// Splits `[0, n)` into ranges of at most `grain_size` elements, runs `f` on each range as a job on
+// `tm_job_system_api` and waits for all of them to finish.
+void cpu_kernels__parallel_for(uint64_t n, uint64_t grain_size, void (*f)(void *data, uint64_t begin, uint64_t end), void *data);
+
+// A parallel-for that is still running, see `cpu_kernels__parallel_for_async()`.
+typedef struct cpu_kernels_async_o cpu_kernels_async_o;
+
+// As `cpu_kernels__parallel_for()`, but returns as soon as the jobs have been started. The returned
+// object is allocated from `allocator` and freed by `cpu_kernels__wait()`, which must be called
+// exactly once.
+cpu_kernels_async_o *cpu_kernels__parallel_for_async(struct tm_allocator_i *allocator, uint64_t n, uint64_t grain_size,
+    void (*f)(void *data, uint64_t begin, uint64_t end), void *data);
+
+// One of the parallel-fors started by `cpu_kernels__parallel_for_group_async()`.
+typedef struct cpu_kernels_parallel_for_t
+{
+    uint64_t n;
+    uint64_t grain_size;
+    void (*f)(void *data, uint64_t begin, uint64_t end);
+    void *data;
+} cpu_kernels_parallel_for_t;
+
+// As `cpu_kernels__parallel_for_async()` for each of the `num_fors` parallel-fors, as one object
+// that finishes when all of them have. If `max_jobs` is non-zero, at most that many jobs run at once
+// across all of them, each running ranges until there are none left. The ranges are the same either
+// way, so a limit only changes how many workers run them. Parallel-fors with `n` zero run no jobs.
+// Wait for it with `cpu_kernels__wait_group()` or `cpu_kernels__wait()`.
+cpu_kernels_async_o *cpu_kernels__parallel_for_group_async(struct tm_allocator_i *allocator, const cpu_kernels_parallel_for_t *fors,
+    uint32_t num_fors, uint32_t max_jobs);
+
+// Returns `true` if all the jobs of `async` have finished. Never blocks.
+bool cpu_kernels__is_done(const cpu_kernels_async_o *async);
+
+// Waits for all the jobs of `async` to finish and frees it. Returns the time in seconds from when
+// the jobs were started until the last one finished.
+double cpu_kernels__wait(cpu_kernels_async_o *async);
+
+// As `cpu_kernels__wait()`, and sets `seconds[i]` to the time from when the jobs were started until
+// the last range of parallel-for `i` of `cpu_kernels__parallel_for_group_async()` finished.
+double cpu_kernels__wait_group(cpu_kernels_async_o *async, double *seconds);
+
+// Jobs of parallel-fors that are built once and run many times, see `cpu_kernels__job_list_create()`.
+typedef struct cpu_kernels_job_list_o cpu_kernels_job_list_o;
+
+// Returns an empty job list allocated from `allocator`. Running a job list skips building and
+// allocating the jobs that `cpu_kernels__parallel_for()` does on every call.
+cpu_kernels_job_list_o *cpu_kernels__job_list_create(struct tm_allocator_i *allocator);
+
+// Adds the jobs that `cpu_kernels__parallel_for(n, grain_size, f, data)` would run to `list`.
+void cpu_kernels__job_list_add(cpu_kernels_job_list_o *list, uint64_t n, uint64_t grain_size,
+    void (*f)(void *data, uint64_t begin, uint64_t end), void *data);
+
+// Runs all the jobs of `list` concurrently and waits for them to finish. A single job runs on the
+// calling thread.
+void cpu_kernels__job_list_run(const cpu_kernels_job_list_o *list);
+
+// Frees a job list returned by `cpu_kernels__job_list_create()`.
+void cpu_kernels__job_list_free(cpu_kernels_job_list_o *list);
+
+// Fills `data` with `n` random elements, using jobs of `grain_size` elements. Floating point types
+// get values in the range [0, 1), see `cpu_kernels_dtype_t::random` for integers.
+//
+// The generator is counter based: each element is a keyed hash of its index, with the key derived
+// from `seed` and `stream`. The output only depends on these and is bit-identical regardless of
+// kernel set, job split or platform. Use different streams for buffers that should hold different
+// data.
+void cpu_kernels__generate_random(const cpu_kernels_dtype_t *kernels, void *data, uint64_t n, uint64_t seed,
+    uint64_t stream, uint64_t grain_size);
+
+// Checks that `result[i]` is within `ulp_tolerance` ulps of `a[i] + b[i]` for all `n` elements,
+// using `kernels` on jobs of `grain_size` elements. Logs a single summary of the outcome and
+// optionally returns it in `report`. Returns `true` if all results are within tolerance.
+bool cpu_kernels__verify_add(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, const void *result,
+    uint64_t n, uint64_t grain_size, uint32_t ulp_tolerance, cpu_kernels_verify_report_t *report);
+
+// Sets `checksums[j]` to the checksum of the sums `a[i] + b[i]` of block `j`, where block `j` is
+// the elements `[j * block_size, (j + 1) * block_size)`. The sums aren't stored, so this only reads
+// the inputs. A kernel that produces the same checksums for its results as it writes them can be
+// verified with `cpu_kernels__verify_add_checksums()`. `a` and `b` are the elements `[first, first
+// + n)` of the arrays, which the checksums hash by their index in the whole array, `first` must be
+// a multiple of `block_size`.
+void cpu_kernels__add_checksums(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, uint64_t first,
+    uint64_t n, uint64_t block_size, uint32_t *checksums);
+
+// As `cpu_kernels__verify_add()`, but only diffs the `num_blocks` blocks listed in `blocks`, where
+// block `j` is the elements `[j * block_size, (j + 1) * block_size)`. Used when the other blocks are
+// known to be correct, such as results that weren't recomputed.
+bool cpu_kernels__verify_add_blocks(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, const void *result,
+    uint64_t n, uint64_t block_size, const uint64_t *blocks, uint64_t num_blocks, uint32_t ulp_tolerance,
+    cpu_kernels_verify_report_t *report);
+
+// As `cpu_kernels__verify_add()`, but only diffs the blocks of `block_size` results whose
+// `checksums` differ from the `expected` checksums of `cpu_kernels__add_checksums()`. The other
+// blocks are bit-exact, barring a checksum collision, and are never read.
+bool cpu_kernels__verify_add_checksums(const cpu_kernels_dtype_t *kernels, const void *a, const void *b, const void *result,
+    uint64_t n, uint64_t block_size, const uint32_t *expected, const uint32_t *checksums, uint32_t ulp_tolerance,
+    cpu_kernels_verify_report_t *report);
+
+// Returns the sum of `a[i]`, or of `a[i] * b[i]` if `b` is non-NULL, for `i` in `[0, n)`, using
+// `kernels` on jobs of `grain_size` elements.
+//
+// Each job computes a compensated partial sum and the partial sums are added pairwise in job order,
+// so the result only depends on the kernel set and `grain_size`, never on how the jobs were
+// scheduled.
+double cpu_kernels__sum(const cpu_kernels_t *kernels, const float *a, const float *b, uint64_t n, uint64_t grain_size);
+
+// Sets `*min` and `*max` to the smallest and largest of the `n` elements of `a`, ignoring NaNs, using
+// `kernels` on jobs of `grain_size` elements. Both are NaN if there are no other values.
+void cpu_kernels__min_max(const cpu_kernels_t *kernels, const float *a, uint64_t n, uint64_t grain_size, float *min,
+    float *max);
+
+// Returns the pairwise sum of the `n` values, which keeps the error growth logarithmic in `n`.
+double cpu_kernels__pairwise_sum(const double *values, uint64_t n);
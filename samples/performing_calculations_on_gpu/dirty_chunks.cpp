@@ -0,0 +1,108 @@
+extern "C" {
+#include "cpu_kernels.h"
+#include "dirty_chunks.h"
+
+#include <foundation/allocator.h>
+#include <foundation/math.inl>
+#include <foundation/murmurhash64a.inl>
+}
+
+#include <string.h>
+
+void dirty_chunks__init(dirty_chunks_t *chunks, tm_allocator_i *allocator, uint64_t n, uint64_t chunk_length, bool hash)
+{
+    const uint64_t num_chunks = (n + chunk_length - 1) / chunk_length;
+    *chunks = (dirty_chunks_t){
+        .n = n,
+        .chunk_length = chunk_length,
+        .num_chunks = num_chunks,
+        .input_generations = (uint32_t *)tm_alloc(allocator, num_chunks * sizeof(uint32_t)),
+        .result_generations = (uint32_t *)tm_alloc(allocator, num_chunks * sizeof(uint32_t)),
+        .hashes = hash ? (uint64_t *)tm_alloc(allocator, num_chunks * sizeof(uint64_t)) : NULL,
+        .stale = (uint64_t *)tm_alloc(allocator, num_chunks * sizeof(uint64_t)),
+    };
+
+    // Nothing has been computed yet.
+    for (uint64_t i = 0; i < num_chunks; ++i)
+        chunks->input_generations[i] = 1;
+    memset(chunks->result_generations, 0, num_chunks * sizeof(uint32_t));
+    if (hash)
+        memset(chunks->hashes, 0, num_chunks * sizeof(uint64_t));
+}
+
+void dirty_chunks__free(dirty_chunks_t *chunks, tm_allocator_i *allocator)
+{
+    tm_free(allocator, chunks->input_generations, chunks->num_chunks * sizeof(uint32_t));
+    tm_free(allocator, chunks->result_generations, chunks->num_chunks * sizeof(uint32_t));
+    if (chunks->hashes)
+        tm_free(allocator, chunks->hashes, chunks->num_chunks * sizeof(uint64_t));
+    tm_free(allocator, chunks->stale, chunks->num_chunks * sizeof(uint64_t));
+}
+
+void dirty_chunks__mark(dirty_chunks_t *chunks, uint64_t first, uint64_t count)
+{
+    const uint64_t end = tm_min(first + tm_min(count, chunks->n), chunks->n);
+    if (first >= end)
+        return;
+    for (uint64_t i = first / chunks->chunk_length; i <= (end - 1) / chunks->chunk_length; ++i)
+        ++chunks->input_generations[i];
+}
+
+void dirty_chunks__mark_collected(dirty_chunks_t *chunks)
+{
+    for (uint64_t j = 0; j < chunks->num_stale; ++j)
+        ++chunks->input_generations[chunks->stale[j]];
+}
+
+typedef struct hash_chunks_job_t
+{
+    dirty_chunks_t *chunks;
+    const char *a;
+    const char *b;
+    uint64_t element_size;
+} hash_chunks_job_t;
+
+static void private__hash_chunks_job(void *data, uint64_t begin, uint64_t end)
+{
+    const hash_chunks_job_t *job = (const hash_chunks_job_t *)data;
+    dirty_chunks_t *chunks = job->chunks;
+    for (uint64_t i = begin; i < end; ++i) {
+        const uint64_t first = i * chunks->chunk_length;
+        const uint64_t offset = first * job->element_size;
+        const uint64_t size = (tm_min(first + chunks->chunk_length, chunks->n) - first) * job->element_size;
+        const uint64_t hash = tm_murmur_hash_64a(job->a + offset, size, tm_murmur_hash_64a(job->b + offset, size, 0));
+        if (hash != chunks->hashes[i]) {
+            chunks->hashes[i] = hash;
+            ++chunks->input_generations[i];
+        }
+    }
+}
+
+uint64_t dirty_chunks__collect(dirty_chunks_t *chunks, const void *a, const void *b, uint32_t element_size)
+{
+    if (chunks->hashes) {
+        hash_chunks_job_t job = { .chunks = chunks, .a = (const char *)a, .b = (const char *)b, .element_size = element_size };
+        cpu_kernels__parallel_for(chunks->num_chunks, 1, private__hash_chunks_job, &job);
+    }
+
+    chunks->num_stale = 0;
+    chunks->num_stale_elements = 0;
+    for (uint64_t i = 0; i < chunks->num_chunks; ++i) {
+        if (chunks->input_generations[i] == chunks->result_generations[i])
+            continue;
+        chunks->result_generations[i] = chunks->input_generations[i];
+        chunks->stale[chunks->num_stale++] = i;
+        chunks->num_stale_elements += tm_min(chunks->chunk_length, chunks->n - i * chunks->chunk_length);
+    }
+    return chunks->num_stale;
+}
+
+uint64_t dirty_chunks__run(const dirty_chunks_t *chunks, uint64_t j, uint64_t *first, uint64_t *n)
+{
+    uint64_t k = j + 1;
+    while (k < chunks->num_stale && chunks->stale[k] == chunks->stale[k - 1] + 1)
+        ++k;
+    *first = chunks->stale[j] * chunks->chunk_length;
+    *n = tm_min((chunks->stale[k - 1] + 1) * chunks->chunk_length, chunks->n) - *first;
+    return k;
+}
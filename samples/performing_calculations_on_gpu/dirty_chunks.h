@@ -0,0 +1,61 @@
+#pragma once
+
+#include <foundation/api_types.h>
+
+// Tracks which chunks of a buffer set's result are stale because its inputs have changed since the
+// result was computed, so a dispatch only has to recompute and verify those chunks. See
+// `metal_adder_settings_t::incremental`.
+//
+// Writers mark the ranges they change with `dirty_chunks__mark()`, which bumps the generation of
+// the chunks they touch. Optionally each chunk's inputs are also hashed on every
+// `dirty_chunks__collect()`, which finds writes that weren't marked at the cost of reading both
+// inputs.
+
+struct tm_allocator_i;
+
+typedef struct dirty_chunks_t
+{
+    // Number of elements tracked, and the number of elements per chunk. The last chunk may be
+    // shorter.
+    uint64_t n;
+    uint64_t chunk_length;
+    uint64_t num_chunks;
+
+    // Chunk `i` is stale while `input_generations[i]` differs from `result_generations[i]`, which
+    // is set to the input generation when the chunk is collected for recomputing.
+    uint32_t *input_generations;
+    uint32_t *result_generations;
+
+    // With hashing, the murmurhash64a of both inputs of each chunk at the last collect. Otherwise
+    // NULL.
+    uint64_t *hashes;
+
+    // The chunks returned by the last `dirty_chunks__collect()`, in ascending order, and the number
+    // of elements they cover.
+    uint64_t *stale;
+    uint64_t num_stale;
+    uint64_t num_stale_elements;
+} dirty_chunks_t;
+
+// Initializes `chunks` to track `n` elements in chunks of `chunk_length`, all of them stale. If
+// `hash` is set, changes are also found by hashing the inputs.
+void dirty_chunks__init(dirty_chunks_t *chunks, struct tm_allocator_i *allocator, uint64_t n, uint64_t chunk_length, bool hash);
+
+void dirty_chunks__free(dirty_chunks_t *chunks, struct tm_allocator_i *allocator);
+
+// Marks the elements `[first, first + count)` as changed. The range is clamped to the tracked
+// elements.
+void dirty_chunks__mark(dirty_chunks_t *chunks, uint64_t first, uint64_t count);
+
+// Marks the chunks of the last `dirty_chunks__collect()` as changed again, so the next collect
+// returns them even if their inputs haven't changed. Used when their results failed verification.
+void dirty_chunks__mark_collected(dirty_chunks_t *chunks);
+
+// Fills `chunks->stale` with the chunks that are stale and treats them as recomputed from now on.
+// With hashing, the `n` elements of `element_size` bytes at `a` and `b` are hashed first, using jobs
+// of one chunk each, and chunks whose hash changed are stale too. Returns `chunks->num_stale`.
+uint64_t dirty_chunks__collect(dirty_chunks_t *chunks, const void *a, const void *b, uint32_t element_size);
+
+// Sets `[*first, *first + *n)` to the elements of the run of consecutive chunks in `chunks->stale`
+// that starts at index `j`, and returns the index after the run.
+uint64_t dirty_chunks__run(const dirty_chunks_t *chunks, uint64_t j, uint64_t *first, uint64_t *n);
@@ -0,0 +1,341 @@
+extern "C" {
+#include "cpu_kernels.h"
+#include "fused_expr.h"
+#include "loader.h"
+
+#include <foundation/allocator.h>
+#include <foundation/carray_print.inl>
+#include <foundation/log.h>
+#include <foundation/math.inl>
+}
+
+#include <math.h>
+#include <string.h>
+
+uint32_t fused_expr__num_args(enum metal_adder_expr_op op)
+{
+    switch (op) {
+    case METAL_ADDER_EXPR_OP_INPUT:
+    case METAL_ADDER_EXPR_OP_CONSTANT:
+        return 0;
+    case METAL_ADDER_EXPR_OP_FMA:
+    case METAL_ADDER_EXPR_OP_CLAMP:
+    case METAL_ADDER_EXPR_OP_SELECT:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+bool fused_expr__validate(const metal_adder_expr_t *expr)
+{
+    if (!expr->num_nodes || expr->num_nodes > METAL_ADDER_MAX_EXPR_NODES) {
+        TM_LOG("Expression has %u nodes, expected 1 to %u\n", expr->num_nodes, METAL_ADDER_MAX_EXPR_NODES);
+        return false;
+    }
+    if (expr->num_inputs > METAL_ADDER_MAX_EXPR_INPUTS) {
+        TM_LOG("Expression has %u inputs, at most %u are supported\n", expr->num_inputs, METAL_ADDER_MAX_EXPR_INPUTS);
+        return false;
+    }
+    for (uint32_t i = 0; i < expr->num_nodes; ++i) {
+        const metal_adder_expr_node_t *node = expr->nodes + i;
+        if ((uint32_t)node->op >= METAL_ADDER_EXPR_OP_COUNT) {
+            TM_LOG("Expression node %u has unknown op %u\n", i, (uint32_t)node->op);
+            return false;
+        }
+        if (node->op == METAL_ADDER_EXPR_OP_INPUT && node->input >= expr->num_inputs) {
+            TM_LOG("Expression node %u reads input %u of %u\n", i, node->input, expr->num_inputs);
+            return false;
+        }
+        for (uint32_t a = 0; a < fused_expr__num_args(node->op); ++a) {
+            if (node->args[a] >= i) {
+                TM_LOG("Expression node %u uses node %u, operands must come before the node\n", i, node->args[a]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void private__print_constant(char **msl, tm_allocator_i *allocator, float f)
+{
+    // Bit cast, so the kernel uses exactly the same value as the CPU.
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    tm_carray_printf(msl, allocator, "as_type<float>(0x%08xu)", bits);
+}
+
+char *fused_expr__generate_msl(const metal_adder_expr_t *expr, tm_allocator_i *allocator)
+{
+    char *msl = NULL;
+    tm_carray_printf(&msl, allocator, "#include <metal_stdlib>\nusing namespace metal;\n\nkernel void fused_expr(");
+    for (uint32_t i = 0; i < expr->num_inputs; ++i)
+        tm_carray_printf(&msl, allocator, "device const float *in%u [[buffer(%u)]],\n    ", i, i);
+    tm_carray_printf(&msl, allocator, "device float *result [[buffer(%u)]],\n    uint index [[thread_position_in_grid]])\n{\n", expr->num_inputs);
+
+    // One SSA value per node. Comparisons are spelled out instead of using `min()`, `max()` and
+    // `clamp()`, so NaNs propagate the same way as in the CPU loops.
+    for (uint32_t i = 0; i < expr->num_nodes; ++i) {
+        const metal_adder_expr_node_t *node = expr->nodes + i;
+        const uint32_t x = node->args[0], y = node->args[1], z = node->args[2];
+        if (node->op == METAL_ADDER_EXPR_OP_CLAMP)
+            tm_carray_printf(&msl, allocator, "    const float t%u_max = t%u > t%u ? t%u : t%u;\n", i, x, y, x, y);
+        tm_carray_printf(&msl, allocator, "    const float t%u = ", i);
+        switch (node->op) {
+        case METAL_ADDER_EXPR_OP_INPUT:
+            tm_carray_printf(&msl, allocator, "in%u[index]", node->input);
+            break;
+        case METAL_ADDER_EXPR_OP_CONSTANT:
+            private__print_constant(&msl, allocator, node->constant);
+            break;
+        case METAL_ADDER_EXPR_OP_ADD:
+            tm_carray_printf(&msl, allocator, "t%u + t%u", x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_SUB:
+            tm_carray_printf(&msl, allocator, "t%u - t%u", x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_MUL:
+            tm_carray_printf(&msl, allocator, "t%u * t%u", x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_DIV:
+            tm_carray_printf(&msl, allocator, "t%u / t%u", x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_MIN:
+            tm_carray_printf(&msl, allocator, "t%u < t%u ? t%u : t%u", x, y, x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_MAX:
+            tm_carray_printf(&msl, allocator, "t%u > t%u ? t%u : t%u", x, y, x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_LESS:
+            tm_carray_printf(&msl, allocator, "t%u < t%u ? 1.0f : 0.0f", x, y);
+            break;
+        case METAL_ADDER_EXPR_OP_FMA:
+            tm_carray_printf(&msl, allocator, "fma(t%u, t%u, t%u)", x, y, z);
+            break;
+        case METAL_ADDER_EXPR_OP_CLAMP:
+            tm_carray_printf(&msl, allocator, "t%u_max < t%u ? t%u_max : t%u", i, z, i, z);
+            break;
+        case METAL_ADDER_EXPR_OP_SELECT:
+            tm_carray_printf(&msl, allocator, "t%u != 0.0f ? t%u : t%u", x, y, z);
+            break;
+        case METAL_ADDER_EXPR_OP_COUNT:
+            break;
+        }
+        tm_carray_printf(&msl, allocator, ";\n");
+    }
+    tm_carray_printf(&msl, allocator, "    result[index] = t%u;\n}\n", expr->num_nodes - 1);
+    return msl;
+}
+
+// The CPU program works on slots, each pointing to a tile of values: first the inputs, then the
+// constants, then the intermediate tiles.
+enum {
+    CONSTANT_SLOTS = METAL_ADDER_MAX_EXPR_INPUTS,
+    TEMP_SLOTS = CONSTANT_SLOTS + METAL_ADDER_MAX_EXPR_NODES,
+    NUM_SLOTS = TEMP_SLOTS + FUSED_EXPR_MAX_TEMPS,
+};
+
+// Destination of the instruction that computes the final value, it writes directly to the result.
+#define RESULT_SLOT UINT32_MAX
+
+typedef struct fused_expr_instruction_t
+{
+    enum metal_adder_expr_op op;
+    uint32_t dst;
+    uint32_t src[3];
+} fused_expr_instruction_t;
+
+struct fused_expr_program_t
+{
+    tm_allocator_i *allocator;
+
+    uint32_t num_inputs;
+    uint32_t num_constants;
+    uint32_t num_instructions;
+
+    // Slot holding the result if the expression has no instructions, i.e. if it's just an input or a
+    // constant.
+    uint32_t result_slot;
+
+    fused_expr_instruction_t instructions[METAL_ADDER_MAX_EXPR_NODES];
+
+    // A tile filled with each constant.
+    float constant_tiles[METAL_ADDER_MAX_EXPR_NODES][FUSED_EXPR_TILE_SIZE];
+};
+
+fused_expr_program_t *fused_expr__compile_cpu(const metal_adder_expr_t *expr, tm_allocator_i *allocator)
+{
+    if (!fused_expr__validate(expr))
+        return NULL;
+
+    fused_expr_program_t *p = (fused_expr_program_t *)tm_alloc(allocator, sizeof(fused_expr_program_t));
+    memset(p, 0, sizeof(fused_expr_program_t));
+    p->allocator = allocator;
+    p->num_inputs = expr->num_inputs;
+
+    const uint32_t root = expr->num_nodes - 1;
+    uint32_t last_use[METAL_ADDER_MAX_EXPR_NODES];
+    for (uint32_t i = 0; i < expr->num_nodes; ++i) {
+        last_use[i] = i;
+        for (uint32_t a = 0; a < fused_expr__num_args(expr->nodes[i].op); ++a)
+            last_use[expr->nodes[i].args[a]] = i;
+    }
+
+    // Intermediate tiles are allocated in node order and released after their last use, so the
+    // number of live tiles is the width of the expression tree rather than the number of nodes.
+    uint32_t slots[METAL_ADDER_MAX_EXPR_NODES];
+    uint32_t free_temps = (1u << FUSED_EXPR_MAX_TEMPS) - 1;
+    for (uint32_t i = 0; i < expr->num_nodes; ++i) {
+        const metal_adder_expr_node_t *node = expr->nodes + i;
+        if (node->op == METAL_ADDER_EXPR_OP_INPUT) {
+            slots[i] = node->input;
+            continue;
+        }
+        if (node->op == METAL_ADDER_EXPR_OP_CONSTANT) {
+            float *tile = p->constant_tiles[p->num_constants];
+            for (uint32_t k = 0; k < FUSED_EXPR_TILE_SIZE; ++k)
+                tile[k] = node->constant;
+            slots[i] = CONSTANT_SLOTS + p->num_constants++;
+            continue;
+        }
+
+        fused_expr_instruction_t *ins = p->instructions + p->num_instructions++;
+        ins->op = node->op;
+        const uint32_t num_args = fused_expr__num_args(node->op);
+        for (uint32_t a = 0; a < num_args; ++a) {
+            const uint32_t arg = node->args[a];
+            ins->src[a] = slots[arg];
+            if (slots[arg] >= TEMP_SLOTS && last_use[arg] == i)
+                free_temps |= 1u << (slots[arg] - TEMP_SLOTS);
+        }
+
+        if (i == root) {
+            ins->dst = RESULT_SLOT;
+        } else {
+            if (!free_temps) {
+                TM_LOG("Expression needs more than %u intermediate values at once\n", FUSED_EXPR_MAX_TEMPS);
+                fused_expr__free_cpu(p);
+                return NULL;
+            }
+            const uint32_t t = (uint32_t)__builtin_ctz(free_temps);
+            free_temps &= ~(1u << t);
+            ins->dst = slots[i] = TEMP_SLOTS + t;
+
+            // Unused nodes release their tile right away.
+            if (last_use[i] == i)
+                free_temps |= 1u << t;
+        }
+    }
+    p->result_slot = slots[root];
+    return p;
+}
+
+void fused_expr__free_cpu(fused_expr_program_t *program)
+{
+    if (program)
+        tm_free(program->allocator, program, sizeof(fused_expr_program_t));
+}
+
+// Each operation is a separate loop over the tile, so the compiler can vectorize it with the widest
+// instruction set enabled for the build.
+static void private__execute(enum metal_adder_expr_op op, float *d, const float *x, const float *y, const float *z, uint64_t n)
+{
+    switch (op) {
+    case METAL_ADDER_EXPR_OP_ADD:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] + y[i];
+        break;
+    case METAL_ADDER_EXPR_OP_SUB:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] - y[i];
+        break;
+    case METAL_ADDER_EXPR_OP_MUL:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] * y[i];
+        break;
+    case METAL_ADDER_EXPR_OP_DIV:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] / y[i];
+        break;
+    case METAL_ADDER_EXPR_OP_MIN:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] < y[i] ? x[i] : y[i];
+        break;
+    case METAL_ADDER_EXPR_OP_MAX:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] > y[i] ? x[i] : y[i];
+        break;
+    case METAL_ADDER_EXPR_OP_LESS:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] < y[i] ? 1.0f : 0.0f;
+        break;
+    case METAL_ADDER_EXPR_OP_FMA:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = fmaf(x[i], y[i], z[i]);
+        break;
+    case METAL_ADDER_EXPR_OP_CLAMP:
+        for (uint64_t i = 0; i < n; ++i) {
+            const float m = x[i] > y[i] ? x[i] : y[i];
+            d[i] = m < z[i] ? m : z[i];
+        }
+        break;
+    case METAL_ADDER_EXPR_OP_SELECT:
+        for (uint64_t i = 0; i < n; ++i)
+            d[i] = x[i] != 0.0f ? y[i] : z[i];
+        break;
+    default:
+        break;
+    }
+}
+
+void fused_expr__run_cpu_range(const fused_expr_program_t *program, const float *const *inputs, float *result, uint64_t begin,
+    uint64_t end)
+{
+    const fused_expr_program_t *p = program;
+
+    float temps[FUSED_EXPR_MAX_TEMPS][FUSED_EXPR_TILE_SIZE];
+    const float *slots[NUM_SLOTS] = { 0 };
+    for (uint32_t c = 0; c < p->num_constants; ++c)
+        slots[CONSTANT_SLOTS + c] = p->constant_tiles[c];
+    for (uint32_t t = 0; t < FUSED_EXPR_MAX_TEMPS; ++t)
+        slots[TEMP_SLOTS + t] = temps[t];
+
+    for (uint64_t first = begin; first < end; first += FUSED_EXPR_TILE_SIZE) {
+        const uint64_t n = tm_min(end - first, FUSED_EXPR_TILE_SIZE);
+        for (uint32_t k = 0; k < p->num_inputs; ++k)
+            slots[k] = inputs[k] + first;
+        float *tile_result = result + first;
+
+        if (!p->num_instructions) {
+            memcpy(tile_result, slots[p->result_slot], n * sizeof(float));
+            continue;
+        }
+
+        for (const fused_expr_instruction_t *ins = p->instructions; ins != p->instructions + p->num_instructions; ++ins) {
+            float *d = ins->dst == RESULT_SLOT ? tile_result : temps[ins->dst - TEMP_SLOTS];
+            private__execute(ins->op, d, slots[ins->src[0]], slots[ins->src[1]], slots[ins->src[2]], n);
+        }
+    }
+}
+
+typedef struct run_job_t
+{
+    const fused_expr_program_t *program;
+    const float *const *inputs;
+    float *result;
+} run_job_t;
+
+static void private__run_job(void *data, uint64_t begin, uint64_t end)
+{
+    const run_job_t *job = (const run_job_t *)data;
+    fused_expr__run_cpu_range(job->program, job->inputs, job->result, begin, end);
+}
+
+void fused_expr__run_cpu(const fused_expr_program_t *program, const float *const *inputs, float *result, uint64_t count,
+    uint64_t grain_size)
+{
+    // Keep the job ranges tile aligned, so only the last tile of the whole range is partial.
+    const uint64_t grain = tm_max(grain_size / FUSED_EXPR_TILE_SIZE, 1) * FUSED_EXPR_TILE_SIZE;
+    run_job_t job = { .program = program, .inputs = inputs, .result = result };
+    cpu_kernels__parallel_for(count, grain, private__run_job, &job);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "metal_adder.h"
+
+#include <foundation/api_types.h>
+
+// Compilation of `metal_adder_expr_t` expressions into fused passes, shared by the adder backends.
+
+struct tm_allocator_i;
+
+// Number of elements the CPU program evaluates at a time. The intermediate values of a tile stay in
+// L1, so only the inputs and the result touch memory.
+#define FUSED_EXPR_TILE_SIZE 256
+
+// Maximum number of intermediate tiles that can be live at the same time in a CPU program.
+#define FUSED_EXPR_MAX_TEMPS 8
+
+// Returns `true` if `expr` is well formed, otherwise logs the problem and returns `false`.
+bool fused_expr__validate(const metal_adder_expr_t *expr);
+
+// Returns the number of operands used by `op`.
+uint32_t fused_expr__num_args(enum metal_adder_expr_op op);
+
+// Returns the Metal Shading Language source of a kernel `fused_expr` that evaluates `expr`, with the
+// inputs bound to buffers `[0, num_inputs)` and the result to buffer `num_inputs`. The returned
+// carray is allocated from `allocator`. `expr` must be valid.
+char *fused_expr__generate_msl(const metal_adder_expr_t *expr, struct tm_allocator_i *allocator);
+
+// An expression compiled into a sequence of tile operations for the CPU.
+typedef struct fused_expr_program_t fused_expr_program_t;
+
+// Compiles `expr` for the CPU. Returns NULL and logs the problem if it's invalid or needs more than
+// `FUSED_EXPR_MAX_TEMPS` intermediate tiles.
+fused_expr_program_t *fused_expr__compile_cpu(const metal_adder_expr_t *expr, struct tm_allocator_i *allocator);
+
+// Frees a program returned by `fused_expr__compile_cpu()`.
+void fused_expr__free_cpu(fused_expr_program_t *program);
+
+// Evaluates `program` for `count` elements, using jobs of `grain_size` elements.
+void fused_expr__run_cpu(const fused_expr_program_t *program, const float *const *inputs, float *result, uint64_t count,
+    uint64_t grain_size);
+
+// Evaluates `program` for the elements `[begin, end)` on the calling thread. `begin` should be a
+// multiple of `FUSED_EXPR_TILE_SIZE`, so only the last tile of a range is partial.
+void fused_expr__run_cpu_range(const fused_expr_program_t *program, const float *const *inputs, float *result, uint64_t begin,
+    uint64_t end);
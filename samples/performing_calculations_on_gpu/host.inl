@@ -11,6 +11,7 @@
 #include <foundation/temp_allocator.h>
 #include <foundation/unicode.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 typedef struct run_application_t
@@ -89,6 +90,54 @@ static void free_console(void)
 }
 #endif
 
+// Threads and fibers of the job and task systems. The defaults can be overridden from the command
+// line, see `parse_topology()`.
+typedef struct topology_t
+{
+    uint32_t job_workers;
+    uint32_t job_fibers;
+    uint32_t fiber_stack_size;
+    uint32_t task_workers;
+
+    // Pin the application's fiber to the first worker thread. Without pinning, it can resume on
+    // any worker after waiting for jobs.
+    bool pin_main_fiber;
+    TM_PAD(3);
+} topology_t;
+
+static topology_t parse_topology(int argc, char *argv[])
+{
+    const uint32_t num_logical_processors = tm_os_api->info->num_logical_processors();
+
+    // By default we are limiting the number of worker threads in the job system to 8 to avoid the
+    // overhead caused by the fiber pinning feature. Use `--scaling-run` with `--job-workers` to see
+    // what the limit costs on larger machines.
+    topology_t t = {
+        .job_workers = tm_min(num_logical_processors, 8),
+        .job_fibers = 128,
+        .fiber_stack_size = 128 * 1024,
+        .task_workers = tm_max(num_logical_processors / 2, 1),
+        .pin_main_fiber = true,
+    };
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--job-workers") && i + 1 < argc)
+            t.job_workers = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--job-fibers") && i + 1 < argc)
+            t.job_fibers = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--fiber-stack-size") && i + 1 < argc)
+            t.fiber_stack_size = (uint32_t)strtoul(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--task-workers") && i + 1 < argc)
+            t.task_workers = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--no-fiber-pinning"))
+            t.pin_main_fiber = false;
+    }
+    t.job_workers = tm_max(t.job_workers, 1);
+    t.job_fibers = tm_max(t.job_fibers, 1);
+    t.fiber_stack_size = tm_max(t.fiber_stack_size, 16 * 1024);
+    t.task_workers = tm_max(t.task_workers, 1);
+    return t;
+}
+
 int run(int argc, char *argv[])
 {
     attach_console();
@@ -104,11 +153,14 @@ int run(int argc, char *argv[])
     tm_init_global_api_registry(&allocator);
     tm_register_all_foundation_apis(tm_global_api_registry);
 
-    // Currently we are limiting the number of worker threads in the job system to 8 to avoid the overhead caused by the fiber pinning feature.
-    struct tm_job_system_api *job_system = tm_create_job_system(tm_os_api->thread, tm_min(tm_os_api->info->num_logical_processors(), 8), 128, 128 * 1024);
+    const topology_t topology = parse_topology(argc, argv);
+    TM_LOG("Job system: %u workers, %u fibers of %u KB, %s main fiber. Task system: %u workers\n", topology.job_workers,
+        topology.job_fibers, topology.fiber_stack_size / 1024, topology.pin_main_fiber ? "pinned" : "unpinned", topology.task_workers);
+
+    struct tm_job_system_api *job_system = tm_create_job_system(tm_os_api->thread, topology.job_workers, topology.job_fibers, topology.fiber_stack_size);
     tm_set_or_remove_api(tm_global_api_registry, true, tm_job_system_api, job_system);
 
-    struct tm_task_system_api *task_system = tm_create_task_system(&allocator, tm_max(tm_os_api->info->num_logical_processors() / 2, 1));
+    struct tm_task_system_api *task_system = tm_create_task_system(&allocator, topology.task_workers);
     tm_set_or_remove_api(tm_global_api_registry, true, tm_task_system_api, task_system);
 
     // Load the main DLL.
@@ -129,7 +181,7 @@ int run(int argc, char *argv[])
         if (TM_IS_DEFINED(TM_NO_MAIN_FIBER))
             run_application(&run);
         else {
-            tm_jobdecl_t j = { .task = (void (*)(void *))run_application, .data = &run, .pin_thread_handle = job_system->pin_thread_handle(0) };
+            tm_jobdecl_t j = { .task = (void (*)(void *))run_application, .data = &run, .pin_thread_handle = topology.pin_main_fiber ? job_system->pin_thread_handle(0) : 0 };
             tm_atomic_counter_o *completed = job_system->run_jobs(&j, 1);
             job_system->wait_for_counter_and_free_from_os_thread(completed, 0.0);
         }
@@ -0,0 +1,24 @@
+extern "C" {
+#include "kernel_cache.h"
+#include "loader.h"
+
+#include <foundation/murmurhash64a.inl>
+#include <foundation/os.h>
+#include <foundation/temp_allocator.h>
+}
+
+#include <string.h>
+
+uint64_t kernel_cache__key(const void *source, uint64_t source_size, const char *options)
+{
+    const uint64_t options_hash = tm_murmur_hash_64a(options, strlen(options), 0);
+    return tm_murmur_hash_64a(source, source_size, options_hash);
+}
+
+const char *kernel_cache__path(tm_temp_allocator_i *ta, const char *data_dir, uint64_t key, const char *ext)
+{
+    const char *dir = tm_temp_allocator_api->printf(ta, "%skernel_cache", data_dir);
+    if (!tm_os_api->file_system->stat(dir).is_directory)
+        tm_os_api->file_system->make_directory(dir);
+    return tm_temp_allocator_api->printf(ta, "%s/%016llx.%s", dir, (unsigned long long)key, ext);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <foundation/api_types.h>
+
+// On-disk cache of compiled kernels, stored in `<data_dir>/kernel_cache/`. Entries are keyed by a
+// hash of everything that affects the compiled result, so editing a shader or changing the compile
+// options selects a new entry instead of loading a stale one.
+
+struct tm_temp_allocator_i;
+
+// Returns the cache key for compiling the `source_size` bytes at `source` with `options`, a string
+// that describes the compile options and the target (such as the device name).
+uint64_t kernel_cache__key(const void *source, uint64_t source_size, const char *options);
+
+// Returns the path of the cache entry for `key` with the file extension `ext`, creating the cache
+// directory if needed.
+const char *kernel_cache__path(struct tm_temp_allocator_i *ta, const char *data_dir, uint64_t key, const char *ext);
@@ -8,6 +8,7 @@
 #include <foundation/color_spaces.h>
 #include <foundation/error.h>
 #include <foundation/input.h>
+#include <foundation/job_system.h>
 #include <foundation/localizer.h>
 #include <foundation/log.h>
 #include <foundation/math.inl>
@@ -20,6 +21,7 @@
 #include <foundation/rect.inl>
 #include <foundation/sprintf.h>
 #include <foundation/string.inl>
+#include <foundation/task_system.h>
 #include <foundation/unicode.h>
 #include <foundation/the_truth.h>
 
@@ -31,6 +33,7 @@ struct tm_allocator_api *tm_allocator_api;
 struct tm_camera_api *tm_camera_api;
 struct tm_error_api *tm_error_api;
 struct tm_input_api *tm_input_api;
+struct tm_job_system_api *tm_job_system_api;
 struct tm_localizer_api *tm_localizer_api;
 struct tm_logger_api *tm_logger_api;
 struct tm_memory_tracker_api *tm_memory_tracker_api;
@@ -39,6 +42,7 @@ struct tm_path_api *tm_path_api;
 struct tm_plugins_api *tm_plugins_api;
 struct tm_profiler_api *tm_profiler_api;
 struct tm_sprintf_api *tm_sprintf_api;
+struct tm_task_system_api *tm_task_system_api;
 struct tm_unicode_api *tm_unicode_api;
 struct tm_temp_allocator_api *tm_temp_allocator_api;
 struct tm_the_truth_api *tm_the_truth_api;
@@ -48,6 +52,7 @@ struct tm_os_window_api *tm_os_window_api;
 
 extern void main_app_load_plugin(struct tm_api_registry_api *reg, bool load);
 extern void load_metal_adder(struct tm_api_registry_api *reg, bool load);
+extern void load_cpu_adder(struct tm_api_registry_api *reg, bool load);
 
 TM_DLL_EXPORT void tm_load_plugin(struct tm_api_registry_api *reg, bool load)
 {
@@ -58,6 +63,7 @@ TM_DLL_EXPORT void tm_load_plugin(struct tm_api_registry_api *reg, bool load)
     tm_camera_api = tm_get_api(reg, tm_camera_api);
     tm_error_api = tm_get_api(reg, tm_error_api);
     tm_input_api = tm_get_api(reg, tm_input_api);
+    tm_job_system_api = tm_get_api(reg, tm_job_system_api);
     tm_localizer_api = tm_get_api(reg, tm_localizer_api);
     tm_logger_api = tm_get_api(reg, tm_logger_api);
     tm_memory_tracker_api = tm_get_api(reg, tm_memory_tracker_api);
@@ -66,6 +72,7 @@ TM_DLL_EXPORT void tm_load_plugin(struct tm_api_registry_api *reg, bool load)
     tm_plugins_api = tm_get_api(reg, tm_plugins_api);
     tm_profiler_api = tm_get_api(reg, tm_profiler_api);
     tm_sprintf_api = tm_get_api(reg, tm_sprintf_api);
+    tm_task_system_api = tm_get_api(reg, tm_task_system_api);
     tm_unicode_api = tm_get_api(reg, tm_unicode_api);
     tm_temp_allocator_api = tm_get_api(reg, tm_temp_allocator_api);
     tm_the_truth_api = tm_get_api(reg, tm_the_truth_api);
@@ -74,7 +81,11 @@ TM_DLL_EXPORT void tm_load_plugin(struct tm_api_registry_api *reg, bool load)
     tm_os_display_api = tm_get_api(reg, tm_os_display_api);
     tm_os_window_api = tm_get_api(reg, tm_os_window_api);
 
+#if defined(TM_OS_MACOSX)
     load_metal_adder(reg, load);
+#else
+    load_cpu_adder(reg, load);
+#endif
     main_app_load_plugin(reg, load);
 
 }
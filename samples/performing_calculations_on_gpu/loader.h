@@ -10,6 +10,7 @@ extern struct tm_buffer_format_api *tm_buffer_format_api;
 extern struct tm_camera_api *tm_camera_api;
 extern struct tm_error_api *tm_error_api;
 extern struct tm_input_api *tm_input_api;
+extern struct tm_job_system_api *tm_job_system_api;
 extern struct tm_localizer_api *tm_localizer_api;
 extern struct tm_logger_api *tm_logger_api;
 extern struct tm_memory_tracker_api *tm_memory_tracker_api;
@@ -18,6 +19,7 @@ extern struct tm_path_api *tm_path_api;
 extern struct tm_plugins_api *tm_plugins_api;
 extern struct tm_profiler_api *tm_profiler_api;
 extern struct tm_sprintf_api *tm_sprintf_api;
+extern struct tm_task_system_api *tm_task_system_api;
 extern struct tm_unicode_api *tm_unicode_api;
 extern struct tm_temp_allocator_api *tm_temp_allocator_api;
 extern struct tm_the_truth_api *tm_the_truth_api;
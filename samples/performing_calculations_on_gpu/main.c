@@ -10,6 +10,7 @@
 #include <foundation/color_spaces.h>
 #include <foundation/error.h>
 #include <foundation/input.h>
+#include <foundation/job_system.h>
 #include <foundation/localizer.h>
 #include <foundation/log.h>
 #include <foundation/math.inl>
@@ -26,6 +27,9 @@
 #include <plugins/os_window/os_window.h>
 
 #include <float.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
 
 #if defined(TM_OS_POSIX)
 #include <unistd.h>
@@ -41,7 +45,6 @@ typedef struct frame_parameters_t
     double smooth_delta;
 } frame_parameters_t;
 
-enum { MAX_DEVICES = 8 };
 struct tm_application_o
 {
     tm_allocator_i allocator;
@@ -61,7 +64,42 @@ struct tm_application_o
     uint64_t reload_count;
 
     struct metal_adder_o *metal_adder;
-
+    metal_adder_ticket_t last_ticket;
+
+    // The application runs `warmup` untimed dispatches followed by `iterations` timed ones, then
+    // prints a summary of the timings and exits.
+    uint32_t warmup;
+    uint32_t iterations;
+    uint64_t num_submitted;
+    uint64_t num_retired;
+    uint64_t bytes_per_dispatch;
+
+    // Size of the elements of the adder's arrays, see `metal_adder_settings_t::dtype`.
+    uint32_t element_size;
+    TM_PAD(4);
+
+    // With `--update`, each dispatch is preceded by swapping `update_length` elements of its inputs,
+    // starting at `update_offset`, which moves through the arrays from one dispatch to the next.
+    uint64_t update_length;
+    uint64_t update_offset;
+
+    // Wall clock time from submitting the first timed dispatch until the last one was retired.
+    tm_clock_o timed_start;
+    tm_clock_o timed_end;
+
+    // carray of the timings of all timed dispatches.
+    metal_adder_timings_t *timings;
+
+    // With `--stream`, the application streams these files through the adder instead of running
+    // dispatches.
+    metal_adder_stream_t stream;
+    bool streaming;
+
+    // With `--scaling-run`, the application runs the benchmark once for each number of workers in
+    // `run_scaling()` instead, with adders created from `adder_settings`.
+    bool scaling_run;
+    TM_PAD(6);
+    metal_adder_settings_t adder_settings;
 };
 
 #define TM_RUNNING_APPLICATION_STATIC_VARIABLE TM_STATIC_HASH("tm_running_application_static_variable", 0x1d288e6042152ac8ULL)
@@ -73,15 +111,174 @@ static tm_the_truth_o *setup_the_truth(tm_allocator_i *allocator)
     return tm_the_truth_api->create(allocator, TM_THE_TRUTH_CREATE_TYPES_ALL);
 }
 
+static void adder_completed(void *ud, const metal_adder_result_t *result)
+{
+    tm_application_o *app = ud;
+    ++app->num_retired;
+    app->bytes_per_dispatch = 3ULL * app->element_size * result->count;
+    if (result->ticket.id > app->warmup) {
+        tm_carray_push(app->timings, result->timings, &app->allocator);
+        app->timed_end = tm_os_api->time->now();
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Nearest-rank percentile of the `n` sorted values.
+static double percentile(const double *sorted, uint64_t n, double p)
+{
+    const uint64_t rank = (uint64_t)ceil(p * (double)n);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+// Simulates a small change to the inputs by swapping a range of `a` with the same range of `b`, which
+// works for every element type. The pointers of `write_input()` stay valid until the next `submit()`,
+// so both ranges can be held at once.
+static void update_inputs(tm_application_o *app)
+{
+    char *a = metal_adder_api->write_input(app->metal_adder, METAL_ADDER_ARRAY_A, app->update_offset, app->update_length);
+    if (!a) {
+        app->update_offset = 0;
+        a = metal_adder_api->write_input(app->metal_adder, METAL_ADDER_ARRAY_A, 0, app->update_length);
+    }
+    char *b = metal_adder_api->write_input(app->metal_adder, METAL_ADDER_ARRAY_B, app->update_offset, app->update_length);
+    if (!a || !b)
+        return;
+    for (uint64_t i = 0; i < app->update_length * app->element_size; ++i) {
+        const char t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+    app->update_offset += app->update_length;
+}
+
+static void print_timings(tm_application_o *app)
+{
+    const uint64_t n = tm_carray_size(app->timings);
+    if (!n)
+        return;
+
+    static const struct
+    {
+        const char *name;
+        uint64_t offset;
+    } phases[] = {
+        { "encode", offsetof(metal_adder_timings_t, encode) },
+        { "execute", offsetof(metal_adder_timings_t, execute) },
+        { "wait", offsetof(metal_adder_timings_t, wait) },
+        { "verify", offsetof(metal_adder_timings_t, verify) },
+    };
+
+    TM_INIT_TEMP_ALLOCATOR(ta);
+    double *sorted = tm_temp_alloc(ta, n * sizeof(double));
+
+    TM_LOG("%llu timed dispatches after %u warmup, times in ms:\n", (unsigned long long)n, app->warmup);
+    TM_LOG("%-8s %10s %10s %10s %10s\n", "phase", "min", "median", "p99", "max");
+    double median_execute = 0;
+    for (uint32_t p = 0; p < TM_ARRAY_COUNT(phases); ++p) {
+        for (uint64_t i = 0; i < n; ++i)
+            sorted[i] = *(const double *)((const char *)(app->timings + i) + phases[p].offset);
+        qsort(sorted, n, sizeof(double), compare_doubles);
+        TM_LOG("%-8s %10.3f %10.3f %10.3f %10.3f\n", phases[p].name, sorted[0] * 1e3, percentile(sorted, n, 0.5) * 1e3,
+            percentile(sorted, n, 0.99) * 1e3, sorted[n - 1] * 1e3);
+        if (phases[p].offset == offsetof(metal_adder_timings_t, execute))
+            median_execute = percentile(sorted, n, 0.5);
+    }
+
+    // Each dispatch reads both inputs and writes the result.
+    const double wall = tm_os_api->time->delta(app->timed_end, app->timed_start);
+    TM_LOG("Effective bandwidth: %.2f GB/s (median execute), %.2f GB/s (wall clock, %.3f s)\n",
+        median_execute > 0 ? (double)app->bytes_per_dispatch / median_execute * 1e-9 : 0.0,
+        wall > 0 ? (double)(app->bytes_per_dispatch * n) / wall * 1e-9 : 0.0, wall);
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+}
+
+// Median execute time of the timed dispatches.
+static double median_execute(tm_application_o *app)
+{
+    const uint64_t n = tm_carray_size(app->timings);
+    if (!n)
+        return 0.0;
+
+    TM_INIT_TEMP_ALLOCATOR(ta);
+    double *sorted = tm_temp_alloc(ta, n * sizeof(double));
+    for (uint64_t i = 0; i < n; ++i)
+        sorted[i] = app->timings[i].execute;
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    const double median = percentile(sorted, n, 0.5);
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return median;
+}
+
+// Runs the benchmark with adders limited to 1, 2, 4, ... workers, up to all the workers of the job
+// system, and prints the throughput of each and its parallel efficiency: the speedup over one worker
+// divided by the number of workers. The dispatches run one at a time, so each has the job system to
+// itself.
+static void run_scaling(tm_application_o *app)
+{
+    const uint32_t num_workers = tm_job_system_api->num_worker_threads();
+    TM_LOG("Scaling run over 1 to %u workers, %u warmup and %u timed dispatches each\n", num_workers, app->warmup, app->iterations);
+
+    TM_LOG("%8s %10s %12s %8s %10s\n", "workers", "GB/s", "elements/ns", "speedup", "efficiency");
+    double base_throughput = 0;
+    for (uint32_t workers = 1; workers;) {
+        metal_adder_settings_t settings = app->adder_settings;
+        settings.max_workers = workers;
+        app->metal_adder = metal_adder_api->init(&app->allocator, app->data_dir, &settings);
+        if (!app->metal_adder)
+            return;
+
+        tm_carray_free(app->timings, &app->allocator);
+        const metal_adder_completion_t completion = { .f = adder_completed, .ud = app };
+        for (uint32_t i = 0; i < app->warmup + app->iterations; ++i) {
+            if (app->update_length)
+                update_inputs(app);
+            metal_adder_api->wait_for_completion(app->metal_adder, metal_adder_api->submit(app->metal_adder, &completion));
+        }
+        metal_adder_api->shutdown(app->metal_adder);
+        app->metal_adder = NULL;
+
+        // Elements per second, from the median execute time.
+        const double execute = median_execute(app);
+        const double elements = (double)(app->bytes_per_dispatch / (3 * app->element_size));
+        const double throughput = execute > 0 ? elements / execute : 0.0;
+        if (workers == 1)
+            base_throughput = throughput;
+        const double speedup = base_throughput > 0 ? throughput / base_throughput : 0.0;
+        TM_LOG("%8u %10.2f %12.3f %8.2f %9.1f%%\n", workers, throughput * 3 * app->element_size * 1e-9, throughput * 1e-9, speedup,
+            speedup / workers * 100.0);
+
+        workers = workers == num_workers ? 0 : tm_min(2 * workers, num_workers);
+    }
+}
+
 static bool tick_application(tm_application_o *app)
 {
     TM_PROFILER_BEGIN_FUNC_SCOPE();
 
     tm_temp_allocator_api->tick_frame();
     tm_the_truth_api->garbage_collect(app->tt);
+    if (app->scaling_run) {
+        run_scaling(app);
+        app->exit = true;
+        return TM_PROFILER_END_FUNC_SCOPE_WITH(false);
+    }
+
+    // Nothing to run if the adder failed to initialize, it has already logged why.
+    if (!app->metal_adder)
+        return TM_PROFILER_END_FUNC_SCOPE_WITH(false);
+
     const uint64_t rc = tm_plugins_api->reload_count();
     if (rc != app->reload_count) {
         tm_the_truth_api->hot_reload(app->tt);
+        // `adder_completed` has moved with the reload, so the dispatch in flight reports to the new one.
+        const metal_adder_completion_t completion = { .f = adder_completed, .ud = app };
+        metal_adder_api->reload(app->metal_adder, &completion);
         app->reload_count = rc;
     }
 
@@ -93,9 +290,36 @@ static bool tick_application(tm_application_o *app)
     app->frame_parameters.smooth_delta = smooth_delta_weight * delta + (1 - smooth_delta_weight) * app->frame_parameters.smooth_delta;
     app->frame_parameters.clock = now;
     app->frame_parameters.time += delta;
-    app->exit = true;
 
-    metal_adder_api->send_compute_command(app->metal_adder);
+    if (app->streaming) {
+        const tm_clock_o start = tm_os_api->time->now();
+        const uint64_t n = metal_adder_api->stream_files(app->metal_adder, &app->stream);
+        const double wall = tm_os_api->time->delta(tm_os_api->time->now(), start);
+        if (n)
+            TM_LOG("Streamed %llu elements in %.3f s, %.2f GB/s\n", (unsigned long long)n, wall, wall > 0 ? (double)(3 * sizeof(float) * n) / wall * 1e-9 : 0.0);
+        app->exit = true;
+        return TM_PROFILER_END_FUNC_SCOPE_WITH(false);
+    }
+
+    // Start this frame's dispatch, then retire the previous one while this one executes.
+    const uint64_t num_dispatches = (uint64_t)app->warmup + app->iterations;
+    metal_adder_ticket_t ticket = { 0 };
+    if (app->num_submitted < num_dispatches) {
+        if (app->num_submitted == app->warmup)
+            app->timed_start = tm_os_api->time->now();
+        if (app->update_length)
+            update_inputs(app);
+        const metal_adder_completion_t completion = { .f = adder_completed, .ud = app };
+        ticket = metal_adder_api->submit(app->metal_adder, &completion);
+        ++app->num_submitted;
+    }
+    if (app->last_ticket.id)
+        metal_adder_api->wait_for_completion(app->metal_adder, app->last_ticket);
+    app->last_ticket = ticket;
+
+    app->exit = app->num_retired == num_dispatches;
+    if (app->exit)
+        print_timings(app);
 
     return TM_PROFILER_END_FUNC_SCOPE_WITH(!app->exit);
 }
@@ -106,6 +330,15 @@ static const char *default_data_dir(tm_temp_allocator_i *ta, const char *exe)
     return tm_temp_allocator_api->printf(ta, "%.*sdata/", (int)(exe_name - exe), exe);
 }
 
+// Names of `enum metal_adder_dtype` for `--dtype`.
+static const char *dtype_names[METAL_ADDER_DTYPE_COUNT] = { "float", "half", "bfloat16", "double", "int32", "int64" };
+
+// Names of `enum metal_adder_stores` for `--stores`.
+static const char *stores_names[] = { "auto", "cached", "streaming" };
+
+// Names of `enum metal_adder_incremental` for `--incremental`.
+static const char *incremental_names[] = { "off", "tracked", "hashed" };
+
 static tm_application_o *create_application(int argc, char **argv)
 {
     tm_os_api->socket->init();
@@ -120,9 +353,89 @@ static tm_application_o *create_application(int argc, char **argv)
     TM_PROFILER_BEGIN_FUNC_SCOPE();
 
     bool hot_reload_plugins = true;
+    metal_adder_settings_t adder_settings = { .frames_in_flight = 2 };
+    metal_adder_stream_t stream = { 0 };
+    bool streaming = false;
+    bool scaling_run = false;
+    uint32_t warmup = 0, iterations = 1;
+    uint64_t update_length = 0;
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--no-hot-reload"))
             hot_reload_plugins = false;
+        else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+            iterations = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--warmup") && i + 1 < argc)
+            warmup = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--array-length") && i + 1 < argc)
+            adder_settings.array_length = strtoull(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--grain-size") && i + 1 < argc)
+            adder_settings.grain_size = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--ulp-tolerance") && i + 1 < argc)
+            adder_settings.ulp_tolerance = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--frames-in-flight") && i + 1 < argc)
+            adder_settings.frames_in_flight = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--devices") && i + 1 < argc)
+            adder_settings.num_devices = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--fused-verify"))
+            adder_settings.fused_verify = true;
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            adder_settings.seed = strtoull(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            adder_settings.trace_path = argv[++i];
+        else if (!strcmp(argv[i], "--input-a") && i + 1 < argc)
+            adder_settings.input_a_path = argv[++i];
+        else if (!strcmp(argv[i], "--input-b") && i + 1 < argc)
+            adder_settings.input_b_path = argv[++i];
+        else if (!strcmp(argv[i], "--result") && i + 1 < argc)
+            adder_settings.result_path = argv[++i];
+        else if (!strcmp(argv[i], "--dtype") && i + 1 < argc) {
+            const char *name = argv[++i];
+            uint32_t dtype = 0;
+            while (dtype < METAL_ADDER_DTYPE_COUNT && strcmp(name, dtype_names[dtype]))
+                ++dtype;
+            if (dtype < METAL_ADDER_DTYPE_COUNT)
+                adder_settings.dtype = (enum metal_adder_dtype)dtype;
+            else
+                TM_LOG("Unknown dtype `%s`, using float\n", name);
+        } else if (!strcmp(argv[i], "--stores") && i + 1 < argc) {
+            const char *name = argv[++i];
+            uint32_t stores = 0;
+            while (stores < TM_ARRAY_COUNT(stores_names) && strcmp(name, stores_names[stores]))
+                ++stores;
+            if (stores < TM_ARRAY_COUNT(stores_names))
+                adder_settings.stores = (enum metal_adder_stores)stores;
+            else
+                TM_LOG("Unknown stores `%s`, using auto\n", name);
+        } else if (!strcmp(argv[i], "--incremental") && i + 1 < argc) {
+            const char *name = argv[++i];
+            uint32_t incremental = 0;
+            while (incremental < TM_ARRAY_COUNT(incremental_names) && strcmp(name, incremental_names[incremental]))
+                ++incremental;
+            if (incremental < TM_ARRAY_COUNT(incremental_names))
+                adder_settings.incremental = (enum metal_adder_incremental)incremental;
+            else
+                TM_LOG("Unknown incremental mode `%s`, using off\n", name);
+        } else if (!strcmp(argv[i], "--update") && i + 1 < argc)
+            update_length = strtoull(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--cpu-kernels") && i + 1 < argc)
+            adder_settings.cpu_kernels = argv[++i];
+        else if (!strcmp(argv[i], "--prefetch-distance") && i + 1 < argc)
+            adder_settings.prefetch_distance = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--stream"))
+            streaming = true;
+        else if (!strcmp(argv[i], "--stream-chunk") && i + 1 < argc)
+            stream.chunk_length = strtoull(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--scaling-run"))
+            scaling_run = true;
+    }
+    iterations = tm_max(iterations, 1);
+
+    // Streamed files are read in chunks by `stream_files()`, rather than mapped by the adder.
+    if (streaming) {
+        stream.input_a_path = adder_settings.input_a_path;
+        stream.input_b_path = adder_settings.input_b_path;
+        stream.result_path = adder_settings.result_path;
+        adder_settings.input_a_path = adder_settings.input_b_path = adder_settings.result_path = NULL;
     }
 
     // Attempt to load plugins
@@ -150,6 +463,14 @@ static tm_application_o *create_application(int argc, char **argv)
     *app = (tm_application_o){
         .allocator = a,
         .color_space = TM_COLOR_SPACE_DEFAULT_SDR,
+        .warmup = warmup,
+        .iterations = iterations,
+        .stream = stream,
+        .streaming = streaming,
+        .element_size = metal_adder_dtype_size(adder_settings.dtype),
+        .update_length = update_length,
+        .scaling_run = scaling_run,
+        .adder_settings = adder_settings,
     };
     *running_application_ptr = app;
 
@@ -165,7 +486,8 @@ static tm_application_o *create_application(int argc, char **argv)
 
     app->frame_parameters.clock = tm_os_api->time->now();
     /*app->simple_draw = init_simple_draw(&app->allocator, app->tt);*/
-    app->metal_adder = metal_adder_api->init(&app->allocator, app->data_dir);
+    if (!scaling_run)
+        app->metal_adder = metal_adder_api->init(&app->allocator, app->data_dir, &adder_settings);
 
     TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
 
@@ -178,7 +500,9 @@ static void destroy_application(tm_application_o *app)
 {
 
     /*shutdown_simple_draw(app->simple_draw);*/
-    metal_adder_api->shutdown(app->metal_adder);
+    if (app->metal_adder)
+        metal_adder_api->shutdown(app->metal_adder);
+    tm_carray_free(app->timings, &app->allocator);
     tm_free(&app->allocator, app->data_dir, strlen(app->data_dir) + 1);
 
     tm_the_truth_api->destroy(app->tt);
@@ -0,0 +1,113 @@
+extern "C" {
+#include "loader.h"
+#include "mapped_file.h"
+
+#include <foundation/log.h>
+#include <foundation/math.inl>
+}
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Metal requires no-copy buffers to cover whole pages, so mappings are always rounded up. The tail
+// of the last page beyond the end of the file reads as zeros.
+static uint64_t private__round_to_pages(uint64_t size)
+{
+    const uint64_t page = (uint64_t)getpagesize();
+    return (size + page - 1) / page * page;
+}
+
+static bool private__map(mapped_file_t *f, const char *path, int fd, uint64_t size, int flags)
+{
+    const uint64_t mapped_size = private__round_to_pages(size);
+    void *data = size ? mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, flags, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        TM_LOG("Failed to map `%s`: %s\n", path, size ? strerror(errno) : "file is empty");
+        close(fd);
+        return false;
+    }
+    *f = (mapped_file_t){ .data = data, .size = size, .mapped_size = mapped_size, .fd = fd };
+    return true;
+}
+
+bool mapped_file__open_input(mapped_file_t *f, const char *path)
+{
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        TM_LOG("Failed to open `%s`: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    return private__map(f, path, fd, (uint64_t)st.st_size, MAP_PRIVATE);
+}
+
+bool mapped_file__create_output(mapped_file_t *f, const char *path, uint64_t size)
+{
+    const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size)) {
+        TM_LOG("Failed to create `%s`: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    return private__map(f, path, fd, size, MAP_SHARED);
+}
+
+void mapped_file__close(mapped_file_t *f)
+{
+    if (!f->data)
+        return;
+    munmap(f->data, f->mapped_size);
+    close(f->fd);
+    *f = (mapped_file_t){ 0 };
+}
+
+bool mapped_file__open_adder_files(mapped_adder_files_t *files, const metal_adder_settings_t *settings, uint64_t *array_length)
+{
+    *files = (mapped_adder_files_t){ 0 };
+    *array_length = settings->array_length;
+
+    const bool has_a = settings->input_a_path && *settings->input_a_path;
+    const bool has_b = settings->input_b_path && *settings->input_b_path;
+    if (has_a != has_b) {
+        TM_LOG("File inputs need both an `a` and a `b` input\n");
+        return false;
+    }
+
+    if (has_a) {
+        if (!mapped_file__open_input(&files->a, settings->input_a_path) || !mapped_file__open_input(&files->b, settings->input_b_path)) {
+            mapped_file__close_adder_files(files);
+            return false;
+        }
+        const uint64_t file_length = tm_min(files->a.size, files->b.size) / metal_adder_dtype_size(settings->dtype);
+        *array_length = *array_length ? tm_min(*array_length, file_length) : file_length;
+        if (!*array_length) {
+            TM_LOG("Input files hold less than one element\n");
+            mapped_file__close_adder_files(files);
+            return false;
+        }
+    } else if (!*array_length) {
+        *array_length = METAL_ADDER_DEFAULT_ARRAY_LENGTH;
+    }
+
+    if (settings->result_path && *settings->result_path) {
+        if (!mapped_file__create_output(&files->result, settings->result_path, *array_length * metal_adder_dtype_size(settings->dtype))) {
+            mapped_file__close_adder_files(files);
+            return false;
+        }
+    }
+    return true;
+}
+
+void mapped_file__close_adder_files(mapped_adder_files_t *files)
+{
+    mapped_file__close(&files->a);
+    mapped_file__close(&files->b);
+    mapped_file__close(&files->result);
+}
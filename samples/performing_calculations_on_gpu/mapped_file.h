@@ -0,0 +1,53 @@
+#pragma once
+
+#include "metal_adder.h"
+
+#include <foundation/api_types.h>
+
+// Files mapped into memory, used to feed the adder with data from disk and to write its results
+// without copying them through intermediate buffers.
+
+typedef struct mapped_file_t
+{
+    // Start of the mapping, NULL if the file isn't mapped.
+    void *data;
+
+    // Size of the file in bytes.
+    uint64_t size;
+
+    // Size of the mapping, `size` rounded up to whole pages.
+    uint64_t mapped_size;
+
+    int fd;
+    TM_PAD(4);
+} mapped_file_t;
+
+// Maps the existing file at `path` for reading. The mapping is private and writable, so the data can
+// be handed to APIs that require writable memory, but changes are never written back. Returns
+// `false` and logs the error on failure.
+bool mapped_file__open_input(mapped_file_t *f, const char *path);
+
+// Creates (or truncates) the file at `path` with `size` bytes and maps it for writing. Returns
+// `false` and logs the error on failure.
+bool mapped_file__create_output(mapped_file_t *f, const char *path, uint64_t size);
+
+// Unmaps and closes `f`, writing back any changes of an output file. Does nothing if `f` isn't
+// mapped.
+void mapped_file__close(mapped_file_t *f);
+
+// The files named by `metal_adder_settings_t`, shared by the adder backends.
+typedef struct mapped_adder_files_t
+{
+    mapped_file_t a;
+    mapped_file_t b;
+    mapped_file_t result;
+} mapped_adder_files_t;
+
+// Opens the input and result files named in `settings`, leaving the ones that aren't named
+// unmapped. Sets `array_length` to the number of elements to process: the settings' array length,
+// defaulted and clamped to the length of the input files. Returns `false` and closes all files if
+// any of them fails to open.
+bool mapped_file__open_adder_files(mapped_adder_files_t *files, const metal_adder_settings_t *settings, uint64_t *array_length);
+
+// Closes all files opened by `mapped_file__open_adder_files()`.
+void mapped_file__close_adder_files(mapped_adder_files_t *files);
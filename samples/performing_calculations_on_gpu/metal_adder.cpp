@@ -1,6 +1,14 @@
 extern "C" {
+#include "adder_graph.h"
+#include "adder_stream.h"
+#include "adder_trace.h"
+#include "cpu_kernels.h"
+#include "dirty_chunks.h"
+#include "fused_expr.h"
+#include "kernel_cache.h"
 #include "metal_adder.h"
 #include "loader.h"
+#include "mapped_file.h"
 
 #include <foundation/api_registry.h>
 #include <foundation/application.h>
@@ -23,9 +31,51 @@ extern "C" {
 #define CA_PRIVATE_IMPLEMENTATION
 #include <Metal/Metal.hpp>
 
-// The number of floats in each array, and the size of the arrays in bytes.
-const uint32_t array_length = 1 << 24;
-const uint32_t buffer_size = array_length * sizeof(float);
+#include <math.h>
+
+// Threads per threadgroup of the reductions, must match `REDUCE_GROUP_SIZE` in adder_reduce.metal.
+#define METAL_ADDER_REDUCE_GROUP_SIZE 256
+
+// Upper bound on the threadgroups of a reduction. Beyond this each thread loops over more elements
+// instead, which keeps the partials that are read back small.
+#define METAL_ADDER_REDUCE_MAX_GROUPS 1024
+
+// Functions of `shaders/adder_reduce.metal`, indexed by `enum reduce_kernel`.
+enum reduce_kernel {
+    REDUCE_KERNEL_SUM,
+    REDUCE_KERNEL_DOT,
+    REDUCE_KERNEL_MIN_MAX,
+    REDUCE_KERNEL_COUNT,
+};
+
+static const char *const reduce_kernel_names[REDUCE_KERNEL_COUNT] = { "reduce_sum", "reduce_dot", "reduce_min_max" };
+
+// Inputs and result of one dispatch in the ring.
+typedef struct buffer_set_t
+{
+    MTL::Buffer *buffer_a;
+    MTL::Buffer *buffer_b;
+    MTL::Buffer *result;
+
+    // Ticket of the last dispatch submitted on this set. While `command_buffer` is non-NULL, it's
+    // still in flight and hasn't been retired.
+    metal_adder_ticket_t ticket;
+    MTL::CommandBuffer *command_buffer;
+    metal_adder_completion_t completion;
+    tm_clock_o submit_time;
+    double encode_time;
+
+    // With `metal_adder_settings_t::fused_verify`, the dispatch adds the checksums of each block of
+    // `grain_size` results to `checksums`, to be compared with the `expected` checksums of the
+    // inputs. Otherwise NULL.
+    MTL::Buffer *checksums;
+    uint32_t *expected;
+
+    // Chunks of `grain_size` elements whose inputs have changed since they were last dispatched (or
+    // since `expected` was computed). With `metal_adder_settings_t::incremental`, the dispatch only
+    // covers the chunks in `dirty.stale`.
+    dirty_chunks_t dirty;
+} buffer_set_t;
 
 struct metal_adder_o {
     tm_allocator_i allocator;
@@ -34,74 +84,402 @@ struct metal_adder_o {
     MTL::ComputePipelineState *pipeline;
     MTL::CommandQueue *command_queue;
 
-    MTL::Buffer *buffer_a;
-    MTL::Buffer *buffer_b;
-    MTL::Buffer *result;
-
     MTL::Function *adder;
+
+    // Copy of the `data_dir` passed to `init()`, which holds the shaders and the kernel cache.
+    char *data_dir;
+
+    // The `add_arrays` pipeline for `dtype`, used by `submit()`. NULL for floats, which use
+    // `pipeline`.
+    MTL::ComputePipelineState *dtype_pipeline;
+
+    // The `add_arrays_checksum` pipeline for `dtype`, used by `submit()` instead of the above with
+    // `metal_adder_settings_t::fused_verify`. Otherwise NULL.
+    MTL::ComputePipelineState *checksum_pipeline;
+
+    // Kernel cache key of the source `pipeline` was built from.
+    uint64_t shader_key;
+
+    // Pipelines for `reduce()`, indexed by `enum reduce_kernel`, and the kernel cache key of their
+    // source.
+    MTL::ComputePipelineState *reduce_pipelines[REDUCE_KERNEL_COUNT];
+    uint64_t reduce_shader_key;
+
+    // Partial results of the threadgroups of a reduction, two floats per threadgroup.
+    MTL::Buffer *reduce_partials;
+
+    // Kernels used for host-side work on the shared buffers. `kernels` is used by the float-only
+    // operations, `dtype_kernels` for the buffer sets.
+    const cpu_kernels_t *kernels;
+    const cpu_kernels_dtype_t *dtype_kernels;
+    uint64_t grain_size;
+    uint32_t ulp_tolerance;
+    uint32_t frames_in_flight;
+    enum metal_adder_dtype dtype;
+    enum cpu_kernels_isa isa;
+    enum metal_adder_incremental incremental;
+
+    // `metal_adder_settings_t::fused_verify`, unless the adder is incremental.
+    bool fused_verify;
+    TM_PAD(3);
+
+    // The number of elements in each array, and the size of the arrays in bytes.
+    uint64_t array_length;
+    uint64_t buffer_size;
+
+    // Files mapped as the inputs and the result, if they were given in the settings. Buffers that
+    // come from files are shared by all buffer sets.
+    mapped_adder_files_t files;
+
+    uint64_t next_ticket;
+    buffer_set_t buffer_sets[METAL_ADDER_MAX_FRAMES_IN_FLIGHT];
+
+    // Staging buffers that `add_batch()` packs segments into, grown on demand.
+    MTL::Buffer *batch_a;
+    MTL::Buffer *batch_b;
+    MTL::Buffer *batch_result;
+    uint64_t batch_capacity;
+
+    // Staging buffers for `run_expr()`, grown on demand.
+    MTL::Buffer *expr_inputs[METAL_ADDER_MAX_EXPR_INPUTS];
+    MTL::Buffer *expr_result;
+
+    // NULL unless `metal_adder_settings_t::trace_path` was set.
+    adder_trace_o *trace;
 };
 
-static void private__generate_random_float_data(MTL::Buffer *buffer)
+// Returns the string that identifies the compile options and target in kernel cache keys.
+static const char *private__compile_options(metal_adder_o *metal_adder, tm_temp_allocator_i *ta, bool fast_math)
 {
-    float *data = (float *)buffer->contents();
-
-    for (uint32_t i = 0; i < array_length; ++i) {
-        data[i] = (float)rand()/(float)(RAND_MAX);
-    }
+    return tm_temp_allocator_api->printf(ta, "%s;fast_math=%d;icb=1", metal_adder->device->name()->utf8String(), fast_math);
 }
 
-static struct metal_adder_o *init(struct tm_allocator_i *allocator, const char *data_dir)
+// Creates the compute pipeline state for `function` through the kernel cache. The cache entry for
+// `key` is a binary archive with the pipeline compiled for this device. If it exists, the pipeline
+// is loaded from it without compiling the function for the GPU, otherwise the pipeline is compiled
+// and added to a new archive for the next run.
+//
+// Note that the library itself is still compiled from source, Metal can't serialize libraries built
+// at runtime. That step only parses the shader into AIR, the expensive backend compile is what the
+// archive skips.
+static MTL::ComputePipelineState *private__create_pipeline(metal_adder_o *metal_adder, MTL::Function *function, uint64_t key)
 {
-    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
-
     TM_INIT_TEMP_ALLOCATOR(ta);
 
-    tm_allocator_i a = tm_allocator_api->create_child(allocator, "metal_adder");
-    metal_adder_o *m = (metal_adder_o *)tm_alloc(&a, sizeof(metal_adder_o));
-    memset(m, 0, sizeof(metal_adder_o));
-    m->allocator = a;
-
-    // Init device
-    m->device = MTL::CreateSystemDefaultDevice();
+    const char *path = kernel_cache__path(ta, metal_adder->data_dir, key, "binarchive");
+    NS::URL *url = NS::URL::fileURLWithPath(NS::String::string(path, NS::UTF8StringEncoding));
+    const bool cached = tm_os_api->file_system->stat(path).exists;
 
-    // Load shader file
     NS::Error *error = NULL;
-    const char *shader_path = tm_temp_allocator_api->printf(ta, "%sshaders/metal_adder.metal", data_dir);
+    MTL::BinaryArchiveDescriptor *archive_desc = MTL::BinaryArchiveDescriptor::alloc()->init();
+    if (cached)
+        archive_desc->setUrl(url);
+    MTL::BinaryArchive *archive = metal_adder->device->newBinaryArchive(archive_desc, &error);
+    archive_desc->release();
+
+    // Any pipeline can end up in the indirect command buffer of a recorded graph.
+    MTL::ComputePipelineDescriptor *desc = MTL::ComputePipelineDescriptor::alloc()->init();
+    desc->setComputeFunction(function);
+    desc->setSupportIndirectCommandBuffers(true);
+
+    MTL::ComputePipelineState *pipeline = NULL;
+    if (archive) {
+        desc->setBinaryArchives(NS::Array::array(archive));
+        if (cached)
+            pipeline = metal_adder->device->newComputePipelineState(desc, MTL::PipelineOptionFailOnBinaryArchiveMiss, NULL, &error);
+    }
+
+    if (!pipeline) {
+        pipeline = metal_adder->device->newComputePipelineState(desc, MTL::PipelineOptionNone, NULL, &error);
+        if (!pipeline)
+            TM_LOG("Failed to create compute pipeline state: %s\n", error->localizedDescription()->cString(NS::UTF8StringEncoding));
+        else if (archive && archive->addComputePipelineFunctions(desc, &error) && archive->serializeToURL(url, &error))
+            TM_LOG("Added %s to the kernel cache\n", path);
+        else if (error)
+            TM_LOG("Failed to write kernel cache entry %s: %s\n", path, error->localizedDescription()->cString(NS::UTF8StringEncoding));
+    }
+
+    desc->release();
+    if (archive)
+        archive->release();
+
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    return pipeline;
+}
+
+// Returns the NUL-terminated source of `shaders/<name>` allocated from `ta`, and its size without
+// the terminator in `size`.
+static char *private__load_shader(metal_adder_o *m, tm_temp_allocator_i *ta, const char *name, uint64_t *size)
+{
+    ADDER_TRACE_BEGIN_SCOPE(m->trace, load_shader);
+    const char *shader_path = tm_temp_allocator_api->printf(ta, "%sshaders/%s", m->data_dir, name);
     tm_file_o shader = tm_os_api->file_io->open_input(shader_path);
-    uint64_t size = tm_os_api->file_io->size(shader);
-    char *shader_source = (char *)tm_temp_alloc(ta, size);
-    tm_os_api->file_io->read(shader, shader_source, size);
+    *size = tm_os_api->file_io->size(shader);
+    char *shader_source = (char *)tm_temp_alloc(ta, *size + 1);
+    tm_os_api->file_io->read(shader, shader_source, *size);
     tm_os_api->file_io->close(shader);
+    shader_source[*size] = 0;
+    ADDER_TRACE_END_SCOPE(m->trace, load_shader);
+    return shader_source;
+}
+
+// Creates the pipeline for the function `name` of `library`, with its own cache entry.
+static MTL::ComputePipelineState *private__create_named_pipeline(metal_adder_o *m, tm_temp_allocator_i *ta, MTL::Library *library,
+    const char *name, const char *shader_source, uint64_t size)
+{
+    MTL::Function *function = library->newFunction(NS::String::string(name, NS::ASCIIStringEncoding));
+    const char *function_options = tm_temp_allocator_api->printf(ta, "%s;%s", private__compile_options(m, ta, true), name);
+    MTL::ComputePipelineState *pipeline = private__create_pipeline(m, function, kernel_cache__key(shader_source, size, function_options));
+    function->release();
+    return pipeline;
+}
+
+// Loads `shaders/metal_adder.metal` and builds the `add_arrays` pipeline from it, the
+// `add_arrays_<dtype>` pipeline if the adder's type isn't float and the
+// `add_arrays_checksum_<dtype>` pipeline if the adder verifies with checksums. Does nothing if the
+// pipelines were already built from the same source. Returns `false` if the shader fails to compile,
+// in which case the current pipelines (if any) are kept.
+static bool private__build_adder_pipeline(metal_adder_o *m)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    NS::Error *error = NULL;
+    uint64_t size;
+    const char *shader_source = private__load_shader(m, ta, "metal_adder.metal", &size);
 
+    const uint64_t key = kernel_cache__key(shader_source, size, private__compile_options(m, ta, true));
+    if (m->pipeline && key == m->shader_key) {
+        TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+        return true;
+    }
+
+    ADDER_TRACE_BEGIN_SCOPE(m->trace, compile_shader);
     NS::String *source = NS::String::string(shader_source, NS::ASCIIStringEncoding);
     MTL::CompileOptions *options = MTL::CompileOptions::alloc()->init();
     MTL::Library *library = m->device->newLibrary(source, options, &error);
-    if (error) {
+    options->release();
+    ADDER_TRACE_END_SCOPE(m->trace, compile_shader);
+    if (!library) {
         TM_LOG("Error in shader library creation: %s\n", error->localizedDescription()->cString(NS::UTF8StringEncoding));
-        return NULL;
+        TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+        return false;
     }
-    m->adder = library->newFunction(NS::String::string("add_arrays", NS::ASCIIStringEncoding));
+    MTL::Function *adder = library->newFunction(NS::String::string("add_arrays", NS::ASCIIStringEncoding));
 
+    // Create compute pipeline state
+    ADDER_TRACE_BEGIN_SCOPE(m->trace, create_pipeline);
+    MTL::ComputePipelineState *pipeline = private__create_pipeline(m, adder, key);
+    MTL::ComputePipelineState *dtype_pipeline = NULL;
+    if (pipeline && m->dtype != METAL_ADDER_DTYPE_FLOAT) {
+        const char *name = tm_temp_allocator_api->printf(ta, "add_arrays_%s", m->dtype_kernels->name);
+        dtype_pipeline = private__create_named_pipeline(m, ta, library, name, shader_source, size);
+    }
+    MTL::ComputePipelineState *checksum_pipeline = NULL;
+    if (pipeline && m->fused_verify) {
+        const char *name = tm_temp_allocator_api->printf(ta, "add_arrays_checksum_%s", m->dtype_kernels->name);
+        checksum_pipeline = private__create_named_pipeline(m, ta, library, name, shader_source, size);
+    }
+    ADDER_TRACE_END_SCOPE(m->trace, create_pipeline);
+    library->release();
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    if (!pipeline || (m->dtype != METAL_ADDER_DTYPE_FLOAT && !dtype_pipeline) || (m->fused_verify && !checksum_pipeline)) {
+        if (pipeline)
+            pipeline->release();
+        if (dtype_pipeline)
+            dtype_pipeline->release();
+        if (checksum_pipeline)
+            checksum_pipeline->release();
+        adder->release();
+        return false;
+    }
+
+    if (m->pipeline) {
+        m->pipeline->release();
+        m->adder->release();
+    }
+    if (m->dtype_pipeline)
+        m->dtype_pipeline->release();
+    if (m->checksum_pipeline)
+        m->checksum_pipeline->release();
+    m->adder = adder;
+    m->pipeline = pipeline;
+    m->dtype_pipeline = dtype_pipeline;
+    m->checksum_pipeline = checksum_pipeline;
+    m->shader_key = key;
+    return true;
+}
+
+// As `private__build_adder_pipeline()`, for the reduction pipelines in `shaders/adder_reduce.metal`.
+// The reductions are compiled without fast math, so the compiler keeps the Kahan compensation.
+static bool private__build_reduce_pipelines(metal_adder_o *m)
+{
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    NS::Error *error = NULL;
+    uint64_t size;
+    const char *shader_source = private__load_shader(m, ta, "adder_reduce.metal", &size);
+
+    const char *options_key = private__compile_options(m, ta, false);
+    const uint64_t key = kernel_cache__key(shader_source, size, options_key);
+    if (m->reduce_pipelines[0] && key == m->reduce_shader_key) {
+        TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+        return true;
+    }
+
+    ADDER_TRACE_BEGIN_SCOPE(m->trace, compile_reduce_shader);
+    MTL::CompileOptions *options = MTL::CompileOptions::alloc()->init();
+    options->setFastMathEnabled(false);
+    MTL::Library *library = m->device->newLibrary(NS::String::string(shader_source, NS::ASCIIStringEncoding), options, &error);
     options->release();
+    ADDER_TRACE_END_SCOPE(m->trace, compile_reduce_shader);
+    if (!library) {
+        TM_LOG("Error in reduction library creation: %s\n", error->localizedDescription()->cString(NS::UTF8StringEncoding));
+        TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+        return false;
+    }
+
+    // Each function gets its own cache entry.
+    MTL::ComputePipelineState *pipelines[REDUCE_KERNEL_COUNT] = { 0 };
+    bool ok = true;
+    for (uint32_t i = 0; i < REDUCE_KERNEL_COUNT && ok; ++i) {
+        MTL::Function *function = library->newFunction(NS::String::string(reduce_kernel_names[i], NS::ASCIIStringEncoding));
+        const char *function_options = tm_temp_allocator_api->printf(ta, "%s;%s", options_key, reduce_kernel_names[i]);
+        pipelines[i] = private__create_pipeline(m, function, kernel_cache__key(shader_source, size, function_options));
+        function->release();
+        ok = pipelines[i] != NULL;
+    }
     library->release();
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
 
-    // Create compute pipeline state
-    m->pipeline = m->device->newComputePipelineState(m->adder, &error);
-    if (!m->pipeline) {
-        TM_LOG("Failed to create compute pipeline state: %s\n", error->localizedDescription()->cString(NS::UTF8StringEncoding));
+    for (uint32_t i = 0; i < REDUCE_KERNEL_COUNT; ++i) {
+        MTL::ComputePipelineState **slot = ok ? m->reduce_pipelines + i : pipelines + i;
+        if (*slot)
+            (*slot)->release();
+        if (ok)
+            *slot = pipelines[i];
+    }
+    if (ok)
+        m->reduce_shader_key = key;
+    return ok;
+}
+
+// Returns a buffer that aliases the mapping of `f`, or NULL if `f` isn't mapped. The mapping is
+// page aligned and a whole number of pages, as `newBuffer()` requires for no-copy buffers.
+static MTL::Buffer *private__file_buffer(metal_adder_o *m, const mapped_file_t *f)
+{
+    if (!f->data)
+        return NULL;
+    return m->device->newBuffer(f->data, f->mapped_size, MTL::ResourceStorageModeShared, nullptr);
+}
+
+static struct metal_adder_o *init(struct tm_allocator_i *allocator, const char *data_dir, const metal_adder_settings_t *settings)
+{
+    if (settings->dtype == METAL_ADDER_DTYPE_DOUBLE) {
+        TM_LOG("Metal doesn't support double, use the CPU adder for double arrays\n");
         return NULL;
     }
 
+    mapped_adder_files_t files;
+    uint64_t array_length;
+    if (!mapped_file__open_adder_files(&files, settings, &array_length))
+        return NULL;
+
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    tm_allocator_i a = tm_allocator_api->create_child(allocator, "metal_adder");
+    metal_adder_o *m = (metal_adder_o *)tm_alloc(&a, sizeof(metal_adder_o));
+    memset(m, 0, sizeof(metal_adder_o));
+    m->allocator = a;
+    m->trace = adder_trace__create(&m->allocator, settings->trace_path);
+
+    ADDER_TRACE_BEGIN_SCOPE(m->trace, init);
+
+    m->kernels = cpu_kernels__select(settings->cpu_kernels);
+    m->isa = m->kernels->isa;
+    m->dtype = settings->dtype;
+    m->dtype_kernels = cpu_kernels__select_dtype(m->kernels, m->dtype);
+    m->grain_size = settings->grain_size ? settings->grain_size : METAL_ADDER_DEFAULT_GRAIN_SIZE;
+    m->ulp_tolerance = settings->ulp_tolerance;
+    m->incremental = settings->incremental;
+    m->fused_verify = settings->fused_verify && !m->incremental;
+    m->frames_in_flight = files.result.data ? 1 : tm_clamp(settings->frames_in_flight, 1, METAL_ADDER_MAX_FRAMES_IN_FLIGHT);
+    m->array_length = array_length;
+    m->buffer_size = m->array_length * m->dtype_kernels->element_size;
+    m->next_ticket = 1;
+    m->files = files;
+
+    const uint64_t data_dir_size = strlen(data_dir) + 1;
+    m->data_dir = (char *)tm_alloc(&m->allocator, data_dir_size);
+    memcpy(m->data_dir, data_dir, data_dir_size);
+
+    // Init device
+    m->device = MTL::CreateSystemDefaultDevice();
+
+    if (!private__build_adder_pipeline(m) || !private__build_reduce_pipelines(m))
+        return NULL;
+    m->reduce_partials = m->device->newBuffer(2 * METAL_ADDER_REDUCE_MAX_GROUPS * sizeof(float), MTL::ResourceStorageModeShared);
+
     m->command_queue = m->device->newCommandQueue();
 
+    // Wrap the file mappings without copying, the GPU reads and writes the page cache directly.
+    MTL::Buffer *file_a = private__file_buffer(m, &m->files.a);
+    MTL::Buffer *file_b = private__file_buffer(m, &m->files.b);
+    MTL::Buffer *file_result = private__file_buffer(m, &m->files.result);
+
     // Create and prepare data
-    m->buffer_a = m->device->newBuffer(buffer_size, MTL::ResourceStorageModeShared);
-    m->buffer_b = m->device->newBuffer(buffer_size, MTL::ResourceStorageModeShared);
-    m->result = m->device->newBuffer(buffer_size, MTL::ResourceStorageModeShared);
-    private__generate_random_float_data(m->buffer_a);
-    private__generate_random_float_data(m->buffer_b);
+    const uint64_t num_blocks = (m->array_length + m->grain_size - 1) / m->grain_size;
+    for (uint32_t i = 0; i < m->frames_in_flight; ++i) {
+        buffer_set_t *set = m->buffer_sets + i;
+
+        ADDER_TRACE_BEGIN_SCOPE(m->trace, allocate_buffers);
+        set->result = file_result ? file_result->retain() : m->device->newBuffer(m->buffer_size, MTL::ResourceStorageModeShared);
+        if (file_a) {
+            set->buffer_a = file_a->retain();
+            set->buffer_b = file_b->retain();
+        } else {
+            set->buffer_a = m->device->newBuffer(m->buffer_size, MTL::ResourceStorageModeShared);
+            set->buffer_b = m->device->newBuffer(m->buffer_size, MTL::ResourceStorageModeShared);
+        }
+        dirty_chunks__init(&set->dirty, &m->allocator, m->array_length, m->grain_size, m->incremental == METAL_ADDER_INCREMENTAL_HASHED);
+        if (m->fused_verify) {
+            set->checksums = m->device->newBuffer(num_blocks * sizeof(uint32_t), MTL::ResourceStorageModeShared);
+            set->expected = (uint32_t *)tm_alloc(&m->allocator, num_blocks * sizeof(uint32_t));
+        }
+        ADDER_TRACE_END_SCOPE(m->trace, allocate_buffers);
+
+        if (file_a)
+            continue;
+
+        ADDER_TRACE_BEGIN_SCOPE(m->trace, random_fill);
+        cpu_kernels__generate_random(m->dtype_kernels, set->buffer_a->contents(), m->array_length, settings->seed, 2 * i, m->grain_size);
+        cpu_kernels__generate_random(m->dtype_kernels, set->buffer_b->contents(), m->array_length, settings->seed, 2 * i + 1, m->grain_size);
+        ADDER_TRACE_END_SCOPE_WITH_BYTES(m->trace, random_fill, 2 * m->buffer_size);
+    }
+
+    // Each buffer set holds its own reference to the file buffers.
+    if (file_a) {
+        file_a->release();
+        file_b->release();
+    }
+    if (file_result)
+        file_result->release();
+
+    // The checksums every dispatch should produce are known up front, and only change with the
+    // inputs that are written by `write_input()`.
+    if (m->fused_verify) {
+        ADDER_TRACE_BEGIN_SCOPE(m->trace, expected_checksums);
+        for (uint32_t i = 0; i < m->frames_in_flight; ++i) {
+            buffer_set_t *set = m->buffer_sets + i;
+            cpu_kernels__add_checksums(m->dtype_kernels, set->buffer_a->contents(), set->buffer_b->contents(), 0, m->array_length, m->grain_size, set->expected);
+            dirty_chunks__collect(&set->dirty, set->buffer_a->contents(), set->buffer_b->contents(), m->dtype_kernels->element_size);
+        }
+        ADDER_TRACE_END_SCOPE_WITH_BYTES(m->trace, expected_checksums, 2 * m->buffer_size * m->frames_in_flight);
+    }
 
     TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    ADDER_TRACE_END_SCOPE(m->trace, init);
 
 
     pool->release();
@@ -109,64 +487,796 @@ static struct metal_adder_o *init(struct tm_allocator_i *allocator, const char *
     return m;
 }
 
-static void private__verify_results(metal_adder_o *metal_adder)
+static buffer_set_t *private__buffer_set(metal_adder_o *metal_adder, metal_adder_ticket_t ticket)
 {
-    float* a = (float *)metal_adder->buffer_a->contents();
-    float* b = (float *)metal_adder->buffer_b->contents();
-    float* result = (float *)metal_adder->result->contents();
+    return metal_adder->buffer_sets + (ticket.id - 1) % metal_adder->frames_in_flight;
+}
 
-    for (uint64_t i = 0; i < array_length; i++)
-    {
-        if (result[i] != (a[i] + b[i])) {
-            TM_LOG("Compute ERROR: index=%lu result=%g vs %g=a+b\n",
-                   i, result[i], a[i] + b[i]);
-            assert(result[i] == (a[i] + b[i]));
-        }
+// Waits for the command buffer of `set` (if any), then verifies the results and reports the
+// completion.
+static void private__retire(metal_adder_o *metal_adder, buffer_set_t *set)
+{
+    if (!set->command_buffer)
+        return;
+
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    const uint64_t count = metal_adder->incremental ? set->dirty.num_stale_elements : metal_adder->array_length;
+    metal_adder_result_t res = { .ticket = set->ticket, .count = count, .timings = { .encode = set->encode_time } };
+
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(wait_until_completed);
+    const tm_clock_o wait_start = tm_os_api->time->now();
+    set->command_buffer->waitUntilCompleted();
+    res.timings.execute = set->command_buffer->GPUEndTime() - set->command_buffer->GPUStartTime();
+    set->command_buffer->release();
+    set->command_buffer = NULL;
+    TM_PROFILER_END_LOCAL_SCOPE(wait_until_completed);
+
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(verify);
+    const tm_clock_o verify_start = tm_os_api->time->now();
+    cpu_kernels_verify_report_t report;
+    if (metal_adder->incremental) {
+        res.ok = cpu_kernels__verify_add_blocks(metal_adder->dtype_kernels, set->buffer_a->contents(), set->buffer_b->contents(), set->result->contents(), metal_adder->array_length,
+            metal_adder->grain_size, set->dirty.stale, set->dirty.num_stale, metal_adder->ulp_tolerance, &report);
+
+        // Failed chunks are recomputed by the next dispatch, instead of being taken as up to date.
+        if (!res.ok)
+            dirty_chunks__mark_collected(&set->dirty);
+    } else if (set->checksums) {
+        res.ok = cpu_kernels__verify_add_checksums(metal_adder->dtype_kernels, set->buffer_a->contents(), set->buffer_b->contents(), set->result->contents(), metal_adder->array_length,
+            metal_adder->grain_size, set->expected, (const uint32_t *)set->checksums->contents(), metal_adder->ulp_tolerance, &report);
+    } else {
+        res.ok = cpu_kernels__verify_add(metal_adder->dtype_kernels, set->buffer_a->contents(), set->buffer_b->contents(), set->result->contents(), metal_adder->array_length, metal_adder->grain_size, metal_adder->ulp_tolerance, &report);
     }
-    TM_LOG("Compute results as expected\n");
+    const tm_clock_o verify_end = tm_os_api->time->now();
+    TM_PROFILER_END_LOCAL_SCOPE(verify);
+
+    res.timings.wait = tm_os_api->time->delta(verify_start, wait_start);
+    res.timings.verify = tm_os_api->time->delta(verify_end, verify_start);
+
+    // The GPU timestamps use a different clock than `tm_os_api->time`, so the execution is placed at
+    // the commit time. It can start later if the GPU is busy with earlier dispatches.
+    const uint64_t dispatch_bytes = 3 * count * metal_adder->dtype_kernels->element_size;
+    const uint64_t verify_bytes = 3 * report.num_diffed * metal_adder->dtype_kernels->element_size;
+    adder_trace__event(metal_adder->trace, "execute", ADDER_TRACE_TRACK_DEVICE, set->submit_time, res.timings.execute);
+    adder_trace__event(metal_adder->trace, "wait_until_completed", ADDER_TRACE_TRACK_HOST, wait_start, res.timings.wait);
+    adder_trace__event(metal_adder->trace, "verify", ADDER_TRACE_TRACK_HOST, verify_start, res.timings.verify);
+    adder_trace__throughput(metal_adder->trace, "execute", verify_start, dispatch_bytes, res.timings.execute);
+    adder_trace__throughput(metal_adder->trace, "verify", verify_end, verify_bytes, res.timings.verify);
+
+    TM_PROFILER_END_FUNC_SCOPE();
+
+    if (set->completion.f)
+        set->completion.f(set->completion.ud, &res);
 }
 
-static void send_compute_command(struct metal_adder_o *metal_adder)
+// Returns an autoreleased command buffer with a dispatch of `pipeline` over `n` threads, with
+// `buffers[i]` bound to buffer index `i`, followed by `bytes` (if non-NULL) at index `num_buffers`.
+static MTL::CommandBuffer *private__encode_dispatch(metal_adder_o *metal_adder, MTL::ComputePipelineState *pipeline,
+    MTL::Buffer *const *buffers, uint32_t num_buffers, const void *bytes, uint32_t bytes_size, uint64_t n)
 {
-    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
     //Create command buffer to hold commands
     MTL::CommandBuffer *command_buffer = metal_adder->command_queue->commandBuffer();
 
     // Start a compute pass.
     MTL::ComputeCommandEncoder *compute_encoder = command_buffer->computeCommandEncoder();
-    compute_encoder->setComputePipelineState(metal_adder->pipeline);
-    compute_encoder->setBuffer(metal_adder->buffer_a, 0, 0);
-    compute_encoder->setBuffer(metal_adder->buffer_b, 0, 1);
-    compute_encoder->setBuffer(metal_adder->result, 0, 2);
+    compute_encoder->setComputePipelineState(pipeline);
+    for (uint32_t i = 0; i < num_buffers; ++i)
+        compute_encoder->setBuffer(buffers[i], 0, i);
+    if (bytes)
+        compute_encoder->setBytes(bytes, bytes_size, num_buffers);
 
-    MTL::Size grid_size = MTL::Size::Make(array_length, 1, 1);
+    MTL::Size grid_size = MTL::Size::Make(n, 1, 1);
 
-    NS::UInteger thread_group_size = metal_adder->pipeline->maxTotalThreadsPerThreadgroup();
-    thread_group_size = thread_group_size > array_length ? array_length : thread_group_size;
+    NS::UInteger thread_group_size = pipeline->maxTotalThreadsPerThreadgroup();
+    thread_group_size = thread_group_size > n ? n : thread_group_size;
 
     MTL::Size group_size = MTL::Size::Make(thread_group_size, 1, 1);
 
     compute_encoder->dispatchThreads(grid_size, group_size);
     compute_encoder->endEncoding();
 
+    return command_buffer;
+}
+
+// Returns an autoreleased command buffer with a dispatch of `pipeline` for each run of consecutive
+// chunks in `set->dirty.stale`, with the buffers of `set` bound at the offset of the run. The command
+// buffer is empty if no chunk is stale.
+static MTL::CommandBuffer *private__encode_stale_chunks(metal_adder_o *metal_adder, MTL::ComputePipelineState *pipeline, const buffer_set_t *set)
+{
+    MTL::CommandBuffer *command_buffer = metal_adder->command_queue->commandBuffer();
+    MTL::ComputeCommandEncoder *compute_encoder = command_buffer->computeCommandEncoder();
+    compute_encoder->setComputePipelineState(pipeline);
+
+    const uint64_t element_size = metal_adder->dtype_kernels->element_size;
+    const NS::UInteger max_group_size = pipeline->maxTotalThreadsPerThreadgroup();
+    for (uint64_t j = 0; j < set->dirty.num_stale;) {
+        uint64_t first, n;
+        j = dirty_chunks__run(&set->dirty, j, &first, &n);
+        compute_encoder->setBuffer(set->buffer_a, first * element_size, 0);
+        compute_encoder->setBuffer(set->buffer_b, first * element_size, 1);
+        compute_encoder->setBuffer(set->result, first * element_size, 2);
+        compute_encoder->dispatchThreads(MTL::Size::Make(n, 1, 1), MTL::Size::Make(max_group_size > n ? n : max_group_size, 1, 1));
+    }
+    compute_encoder->endEncoding();
+
+    return command_buffer;
+}
+
+// Returns an autoreleased command buffer with an `add_arrays` dispatch over the first `n` elements
+// of the buffers.
+static MTL::CommandBuffer *private__encode_add_arrays(metal_adder_o *metal_adder, MTL::Buffer *a, MTL::Buffer *b, MTL::Buffer *result, uint64_t n)
+{
+    MTL::Buffer *buffers[] = { a, b, result };
+    return private__encode_dispatch(metal_adder, metal_adder->pipeline, buffers, 3, NULL, 0, n);
+}
+
+static metal_adder_ticket_t submit(struct metal_adder_o *metal_adder, const metal_adder_completion_t *completion)
+{
+    TM_PROFILER_BEGIN_FUNC_SCOPE();
+
+    const metal_adder_ticket_t ticket = { metal_adder->next_ticket++ };
+    buffer_set_t *set = private__buffer_set(metal_adder, ticket);
+    private__retire(metal_adder, set);
+
+    set->ticket = ticket;
+    set->completion = completion ? *completion : (metal_adder_completion_t){ 0 };
+
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    TM_PROFILER_BEGIN_LOCAL_SCOPE(encode);
+    const tm_clock_o encode_start = tm_os_api->time->now();
+    if (metal_adder->incremental || set->checksums) {
+        const uint64_t element_size = metal_adder->dtype_kernels->element_size;
+        dirty_chunks__collect(&set->dirty, set->buffer_a->contents(), set->buffer_b->contents(), (uint32_t)element_size);
+
+        // Without incremental dispatches everything is recomputed, but the expected checksums of
+        // the changed blocks are out of date.
+        for (uint64_t j = 0; !metal_adder->incremental && j < set->dirty.num_stale;) {
+            uint64_t first, n;
+            const uint64_t next = dirty_chunks__run(&set->dirty, j, &first, &n);
+            cpu_kernels__add_checksums(metal_adder->dtype_kernels, (const char *)set->buffer_a->contents() + first * element_size,
+                (const char *)set->buffer_b->contents() + first * element_size, first, n, metal_adder->grain_size, set->expected + first / metal_adder->grain_size);
+            j = next;
+        }
+    }
+    MTL::CommandBuffer *command_buffer;
+    if (metal_adder->incremental) {
+        MTL::ComputePipelineState *pipeline = metal_adder->dtype_pipeline ? metal_adder->dtype_pipeline : metal_adder->pipeline;
+        command_buffer = private__encode_stale_chunks(metal_adder, pipeline, set);
+    } else if (set->checksums) {
+        // The set was retired above, so the GPU is done with the checksums of its last dispatch.
+        memset(set->checksums->contents(), 0, set->checksums->length());
+        MTL::Buffer *buffers[] = { set->buffer_a, set->buffer_b, set->result, set->checksums };
+        const uint32_t block_size = (uint32_t)metal_adder->grain_size;
+        command_buffer = private__encode_dispatch(metal_adder, metal_adder->checksum_pipeline, buffers, 4, &block_size, sizeof(block_size), metal_adder->array_length);
+    } else {
+        MTL::Buffer *buffers[] = { set->buffer_a, set->buffer_b, set->result };
+        MTL::ComputePipelineState *pipeline = metal_adder->dtype_pipeline ? metal_adder->dtype_pipeline : metal_adder->pipeline;
+        command_buffer = private__encode_dispatch(metal_adder, pipeline, buffers, 3, NULL, 0, metal_adder->array_length);
+    }
+    command_buffer->commit();
+    set->submit_time = tm_os_api->time->now();
+    set->encode_time = tm_os_api->time->delta(set->submit_time, encode_start);
+    TM_PROFILER_END_LOCAL_SCOPE(encode);
+    adder_trace__event(metal_adder->trace, "encode", ADDER_TRACE_TRACK_HOST, encode_start, set->encode_time);
+
+    // The command buffer is autoreleased, keep it alive until the dispatch is retired.
+    set->command_buffer = command_buffer->retain();
+
+    pool->release();
+
+    TM_PROFILER_END_FUNC_SCOPE();
+    return ticket;
+}
+
+static bool is_complete(struct metal_adder_o *metal_adder, metal_adder_ticket_t ticket)
+{
+    buffer_set_t *set = private__buffer_set(metal_adder, ticket);
+    if (set->ticket.id != ticket.id || !set->command_buffer)
+        return true;
+    const MTL::CommandBufferStatus status = set->command_buffer->status();
+    if (status != MTL::CommandBufferStatusCompleted && status != MTL::CommandBufferStatusError)
+        return false;
+    private__retire(metal_adder, set);
+    return true;
+}
+
+static void wait_for_completion(struct metal_adder_o *metal_adder, metal_adder_ticket_t ticket)
+{
+    buffer_set_t *set = private__buffer_set(metal_adder, ticket);
+    if (set->ticket.id == ticket.id)
+        private__retire(metal_adder, set);
+}
+
+static void send_compute_command(struct metal_adder_o *metal_adder)
+{
+    wait_for_completion(metal_adder, submit(metal_adder, NULL));
+}
+
+static void add_batch(struct metal_adder_o *metal_adder, const metal_adder_segment_t *segments, uint32_t num_segments)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < num_segments; ++i)
+        total += segments[i].count;
+    if (!total)
+        return;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, add_batch);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    if (total > metal_adder->batch_capacity) {
+        ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, allocate_batch_buffers);
+        if (metal_adder->batch_capacity) {
+            metal_adder->batch_a->release();
+            metal_adder->batch_b->release();
+            metal_adder->batch_result->release();
+        }
+        const uint64_t bytes = total * sizeof(float);
+        metal_adder->batch_a = metal_adder->device->newBuffer(bytes, MTL::ResourceStorageModeShared);
+        metal_adder->batch_b = metal_adder->device->newBuffer(bytes, MTL::ResourceStorageModeShared);
+        metal_adder->batch_result = metal_adder->device->newBuffer(bytes, MTL::ResourceStorageModeShared);
+        metal_adder->batch_capacity = total;
+        ADDER_TRACE_END_SCOPE(metal_adder->trace, allocate_batch_buffers);
+    }
+
+    // Pack the segments back to back, so they can be added by one dispatch over the whole range.
+    const uint64_t bytes = total * sizeof(float);
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, pack_batch);
+    float *a = (float *)metal_adder->batch_a->contents();
+    float *b = (float *)metal_adder->batch_b->contents();
+    for (uint32_t i = 0; i < num_segments; ++i) {
+        memcpy(a, segments[i].a, segments[i].count * sizeof(float));
+        memcpy(b, segments[i].b, segments[i].count * sizeof(float));
+        a += segments[i].count;
+        b += segments[i].count;
+    }
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, pack_batch, 4 * bytes);
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, dispatch_batch);
+    MTL::CommandBuffer *command_buffer = private__encode_add_arrays(metal_adder, metal_adder->batch_a, metal_adder->batch_b, metal_adder->batch_result, total);
+    command_buffer->commit();
+    command_buffer->waitUntilCompleted();
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, dispatch_batch, 3 * bytes);
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, unpack_batch);
+    const float *result = (const float *)metal_adder->batch_result->contents();
+    for (uint32_t i = 0; i < num_segments; ++i) {
+        memcpy(segments[i].result, result, segments[i].count * sizeof(float));
+        result += segments[i].count;
+    }
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, unpack_batch, 2 * bytes);
+
+    pool->release();
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, add_batch, 3 * bytes);
+}
+
+struct metal_adder_expr_o
+{
+    MTL::ComputePipelineState *pipeline;
+    uint32_t num_inputs;
+    TM_PAD(4);
+};
+
+static struct metal_adder_expr_o *compile_expr(struct metal_adder_o *metal_adder, const metal_adder_expr_t *expr)
+{
+    if (!fused_expr__validate(expr))
+        return NULL;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, compile_expr);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    TM_INIT_TEMP_ALLOCATOR(ta);
+
+    char *msl = fused_expr__generate_msl(expr, &metal_adder->allocator);
+    tm_carray_push(msl, 0, &metal_adder->allocator);
+
+    // Fast math would let the compiler reassociate and approximate division, the generated kernel
+    // should compute the same values as the CPU loops.
+    NS::Error *error = NULL;
+    MTL::CompileOptions *options = MTL::CompileOptions::alloc()->init();
+    options->setFastMathEnabled(false);
+    MTL::Library *library = metal_adder->device->newLibrary(NS::String::string(msl, NS::UTF8StringEncoding), options, &error);
+    options->release();
+
+    metal_adder_expr_o *e = NULL;
+    if (!library) {
+        TM_LOG("Error in expression library creation: %s\n", error->localizedDescription()->cString(NS::UTF8StringEncoding));
+    } else {
+        MTL::Function *function = library->newFunction(NS::String::string("fused_expr", NS::ASCIIStringEncoding));
+        const uint64_t key = kernel_cache__key(msl, tm_carray_size(msl), private__compile_options(metal_adder, ta, false));
+        MTL::ComputePipelineState *pipeline = private__create_pipeline(metal_adder, function, key);
+        function->release();
+        library->release();
+        if (pipeline) {
+            e = (metal_adder_expr_o *)tm_alloc(&metal_adder->allocator, sizeof(metal_adder_expr_o));
+            *e = (metal_adder_expr_o){ .pipeline = pipeline, .num_inputs = expr->num_inputs };
+        }
+    }
+
+    tm_carray_free(msl, &metal_adder->allocator);
+    TM_SHUTDOWN_TEMP_ALLOCATOR(ta);
+    pool->release();
+    ADDER_TRACE_END_SCOPE(metal_adder->trace, compile_expr);
+    return e;
+}
+
+// Makes sure `*buffer` holds at least `bytes` bytes, replacing it with a larger buffer if needed.
+static void private__ensure_buffer(metal_adder_o *metal_adder, MTL::Buffer **buffer, uint64_t bytes)
+{
+    if (*buffer && (*buffer)->length() >= bytes)
+        return;
+    if (*buffer)
+        (*buffer)->release();
+    *buffer = metal_adder->device->newBuffer(bytes, MTL::ResourceStorageModeShared);
+}
+
+static void run_expr(struct metal_adder_o *metal_adder, const struct metal_adder_expr_o *expr, const float *const *inputs,
+    float *result, uint64_t count)
+{
+    if (!count)
+        return;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, run_expr);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    const uint64_t bytes = count * sizeof(float);
+    MTL::Buffer *buffers[METAL_ADDER_MAX_EXPR_INPUTS + 1];
+    for (uint32_t i = 0; i < expr->num_inputs; ++i) {
+        private__ensure_buffer(metal_adder, metal_adder->expr_inputs + i, bytes);
+        memcpy(metal_adder->expr_inputs[i]->contents(), inputs[i], bytes);
+        buffers[i] = metal_adder->expr_inputs[i];
+    }
+    private__ensure_buffer(metal_adder, &metal_adder->expr_result, bytes);
+    buffers[expr->num_inputs] = metal_adder->expr_result;
+
+    MTL::CommandBuffer *command_buffer = private__encode_dispatch(metal_adder, expr->pipeline, buffers, expr->num_inputs + 1, NULL, 0, count);
+    command_buffer->commit();
+    command_buffer->waitUntilCompleted();
+
+    memcpy(result, metal_adder->expr_result->contents(), bytes);
+
+    pool->release();
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, run_expr, (expr->num_inputs + 1) * bytes);
+}
+
+static void release_expr(struct metal_adder_o *metal_adder, struct metal_adder_expr_o *expr)
+{
+    if (!expr)
+        return;
+    expr->pipeline->release();
+    tm_free(&metal_adder->allocator, expr, sizeof(metal_adder_expr_o));
+}
+
+struct metal_adder_graph_o
+{
+    // One command per operation, see `private__encode_graph()`.
+    MTL::IndirectCommandBuffer *commands;
+
+    metal_adder_graph_op_t ops[METAL_ADDER_MAX_GRAPH_OPS];
+    uint32_t num_ops;
+    uint32_t num_arrays;
+    uint64_t array_length;
+
+    // Number of elements the commands are encoded for.
+    uint64_t count;
+
+    // The arrays, also as resources for `useResources()`, since the command buffer's commands don't
+    // make them resident.
+    MTL::Buffer *arrays[METAL_ADDER_MAX_GRAPH_ARRAYS];
+    const MTL::Resource *resources[METAL_ADDER_MAX_GRAPH_ARRAYS];
+
+    // Pipelines of the operations. The graph holds a reference, so they survive a reload that
+    // replaces the adder's pipeline.
+    MTL::ComputePipelineState *pipelines[METAL_ADDER_MAX_GRAPH_OPS];
+    bool barriers[METAL_ADDER_MAX_GRAPH_OPS];
+
+    // Number of arrays read or written by all the operations, for the trace.
+    uint32_t num_accesses;
+    TM_PAD(4);
+};
+
+static uint32_t private__expr_inputs(const struct metal_adder_expr_o *expr)
+{
+    return expr->num_inputs;
+}
+
+// Encodes the commands of `graph` for `graph->count` elements. This only writes to the indirect
+// command buffer, which must not be in use by the GPU.
+static void private__encode_graph(metal_adder_graph_o *graph)
+{
+    for (uint32_t i = 0; i < graph->num_ops; ++i) {
+        const metal_adder_graph_op_t *op = graph->ops + i;
+        MTL::IndirectComputeCommand *command = graph->commands->indirectComputeCommand(i);
+        command->reset();
+        command->setComputePipelineState(graph->pipelines[i]);
+        const uint32_t num_args = adder_graph__num_args(op, private__expr_inputs);
+        for (uint32_t a = 0; a < num_args; ++a)
+            command->setKernelBuffer(graph->arrays[op->args[a]], 0, a);
+        if (graph->barriers[i])
+            command->setBarrier();
+
+        NS::UInteger thread_group_size = graph->pipelines[i]->maxTotalThreadsPerThreadgroup();
+        thread_group_size = thread_group_size > graph->count ? graph->count : thread_group_size;
+        command->concurrentDispatchThreads(MTL::Size::Make(graph->count, 1, 1), MTL::Size::Make(thread_group_size, 1, 1));
+    }
+}
+
+static MTL::ComputePipelineState *private__op_pipeline(const metal_adder_o *metal_adder, const metal_adder_graph_op_t *op)
+{
+    return op->type == METAL_ADDER_GRAPH_OP_ADD ? metal_adder->pipeline : op->expr->pipeline;
+}
+
+static struct metal_adder_graph_o *record_graph(struct metal_adder_o *metal_adder, const metal_adder_graph_t *graph)
+{
+    bool barriers[METAL_ADDER_MAX_GRAPH_OPS];
+    if (!adder_graph__plan(graph, private__expr_inputs, barriers))
+        return NULL;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, record_graph);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    metal_adder_graph_o *g = (metal_adder_graph_o *)tm_alloc(&metal_adder->allocator, sizeof(metal_adder_graph_o));
+    memset(g, 0, sizeof(metal_adder_graph_o));
+    memcpy(g->ops, graph->ops, graph->num_ops * sizeof(metal_adder_graph_op_t));
+    memcpy(g->barriers, barriers, graph->num_ops * sizeof(bool));
+    g->num_ops = graph->num_ops;
+    g->num_arrays = graph->num_arrays;
+    g->array_length = graph->array_length;
+    g->count = graph->array_length;
+    for (uint32_t i = 0; i < g->num_arrays; ++i) {
+        g->arrays[i] = metal_adder->device->newBuffer(g->array_length * sizeof(float), MTL::ResourceStorageModeShared);
+        g->resources[i] = g->arrays[i];
+    }
+    for (uint32_t i = 0; i < g->num_ops; ++i) {
+        g->pipelines[i] = private__op_pipeline(metal_adder, g->ops + i)->retain();
+        g->num_accesses += adder_graph__num_args(g->ops + i, private__expr_inputs);
+    }
+
+    if (g->num_ops) {
+        MTL::IndirectCommandBufferDescriptor *desc = MTL::IndirectCommandBufferDescriptor::alloc()->init();
+        desc->setCommandTypes(MTL::IndirectCommandTypeConcurrentDispatchThreads);
+        desc->setInheritPipelineState(false);
+        desc->setInheritBuffers(false);
+        desc->setMaxKernelBufferBindCount(METAL_ADDER_MAX_EXPR_INPUTS + 1);
+        g->commands = metal_adder->device->newIndirectCommandBuffer(desc, g->num_ops, MTL::ResourceStorageModeShared);
+        desc->release();
+        private__encode_graph(g);
+    }
+
+    pool->release();
+    ADDER_TRACE_END_SCOPE(metal_adder->trace, record_graph);
+    return g;
+}
+
+static float *graph_array(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph, uint32_t array)
+{
+    return array < graph->num_arrays ? (float *)graph->arrays[array]->contents() : NULL;
+}
+
+// Each run still needs a command buffer and an encoder, but the encoder only executes the recorded
+// commands: there are no pipelines, buffers or threadgroup sizes to set.
+static void run_graph(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph, uint64_t count)
+{
+    count = tm_min(count, graph->array_length);
+    if (!count || !graph->num_ops)
+        return;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, run_graph);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    if (count != graph->count) {
+        graph->count = count;
+        private__encode_graph(graph);
+    }
+
+    // The barriers of the commands order the dependent operations, the others can overlap.
+    MTL::CommandBuffer *command_buffer = metal_adder->command_queue->commandBuffer();
+    MTL::ComputeCommandEncoder *compute_encoder = command_buffer->computeCommandEncoder(MTL::DispatchTypeConcurrent);
+    compute_encoder->useResources(graph->resources, graph->num_arrays, MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+    compute_encoder->executeCommandsInBuffer(graph->commands, NS::Range::Make(0, graph->num_ops));
+    compute_encoder->endEncoding();
     command_buffer->commit();
     command_buffer->waitUntilCompleted();
 
-    private__verify_results(metal_adder);
+    pool->release();
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, run_graph, graph->num_accesses * count * sizeof(float));
+}
+
+// Instance of the `adder_graph_device_i` of `run_tasks()`.
+typedef struct device_tasks_t
+{
+    metal_adder_o *metal_adder;
+    metal_adder_graph_o *graph;
+} device_tasks_t;
+
+// Encodes the ready device tasks into one command buffer. They are independent, so they're
+// dispatched concurrently.
+static void *private__start_device_tasks(void *inst, const metal_adder_task_t *tasks, const uint32_t *ids, uint32_t n, uint64_t count)
+{
+    const device_tasks_t *d = (const device_tasks_t *)inst;
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    MTL::CommandBuffer *command_buffer = d->metal_adder->command_queue->commandBuffer();
+    MTL::ComputeCommandEncoder *compute_encoder = command_buffer->computeCommandEncoder(MTL::DispatchTypeConcurrent);
+    for (uint32_t i = 0; i < n; ++i) {
+        const metal_adder_graph_op_t *op = &tasks[ids[i]].op;
+        MTL::ComputePipelineState *pipeline = private__op_pipeline(d->metal_adder, op);
+        compute_encoder->setComputePipelineState(pipeline);
+        const uint32_t num_args = adder_graph__num_args(op, private__expr_inputs);
+        for (uint32_t a = 0; a < num_args; ++a)
+            compute_encoder->setBuffer(d->graph->arrays[op->args[a]], 0, a);
+
+        NS::UInteger thread_group_size = pipeline->maxTotalThreadsPerThreadgroup();
+        thread_group_size = thread_group_size > count ? count : thread_group_size;
+        compute_encoder->dispatchThreads(MTL::Size::Make(count, 1, 1), MTL::Size::Make(thread_group_size, 1, 1));
+    }
+    compute_encoder->endEncoding();
+    command_buffer->commit();
+    command_buffer->retain();
 
     pool->release();
+    return command_buffer;
+}
+
+static bool private__poll_device_tasks(void *inst, void *handle)
+{
+    MTL::CommandBuffer *command_buffer = (MTL::CommandBuffer *)handle;
+    const MTL::CommandBufferStatus status = command_buffer->status();
+    if (status != MTL::CommandBufferStatusCompleted && status != MTL::CommandBufferStatusError)
+        return false;
+    if (status == MTL::CommandBufferStatusError && command_buffer->error())
+        TM_LOG("Device tasks failed: %s\n", command_buffer->error()->localizedDescription()->cString(NS::UTF8StringEncoding));
+    command_buffer->release();
+    return true;
+}
+
+static bool run_tasks(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph, const metal_adder_task_t *tasks,
+    uint32_t num_tasks, uint64_t count)
+{
+    count = tm_min(count, graph->array_length);
+    if (!count)
+        return true;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, run_tasks);
+    float *arrays[METAL_ADDER_MAX_GRAPH_ARRAYS];
+    for (uint32_t i = 0; i < graph->num_arrays; ++i)
+        arrays[i] = (float *)graph->arrays[i]->contents();
+    device_tasks_t d = { .metal_adder = metal_adder, .graph = graph };
+    const adder_graph_device_i device = { .inst = &d, .start = private__start_device_tasks, .poll = private__poll_device_tasks };
+    const bool ok = adder_graph__run_tasks(tasks, num_tasks, arrays, graph->num_arrays, count, private__expr_inputs, &device);
+    ADDER_TRACE_END_SCOPE(metal_adder->trace, run_tasks);
+    return ok;
+}
 
+static void release_graph(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph)
+{
+    if (!graph)
+        return;
+    if (graph->commands)
+        graph->commands->release();
+    for (uint32_t i = 0; i < graph->num_arrays; ++i)
+        graph->arrays[i]->release();
+    for (uint32_t i = 0; i < graph->num_ops; ++i)
+        graph->pipelines[i]->release();
+    tm_free(&metal_adder->allocator, graph, sizeof(metal_adder_graph_o));
+}
+
+static MTL::Buffer *private__array(const buffer_set_t *set, enum metal_adder_array array)
+{
+    return array == METAL_ADDER_ARRAY_A ? set->buffer_a : array == METAL_ADDER_ARRAY_B ? set->buffer_b : set->result;
+}
+
+// Each threadgroup reduces a grid-strided slice of the array into `reduce_partials`, which are then
+// combined on the host in threadgroup order. Only the partials are read back.
+static double reduce(struct metal_adder_o *metal_adder, metal_adder_ticket_t ticket, enum metal_adder_reduce_op op,
+    enum metal_adder_array x, enum metal_adder_array y)
+{
+    buffer_set_t *set = private__buffer_set(metal_adder, ticket);
+    if (set->ticket.id != ticket.id) {
+        TM_LOG("Can't reduce dispatch %llu, its buffers have been reused\n", (unsigned long long)ticket.id);
+        return NAN;
+    }
+    if (metal_adder->dtype != METAL_ADDER_DTYPE_FLOAT) {
+        TM_LOG("Can't reduce %s arrays, only floats are supported\n", metal_adder->dtype_kernels->name);
+        return NAN;
+    }
+    private__retire(metal_adder, set);
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, reduce);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    const enum reduce_kernel kernel = op == METAL_ADDER_REDUCE_OP_SUM ? REDUCE_KERNEL_SUM
+        : op == METAL_ADDER_REDUCE_OP_DOT                              ? REDUCE_KERNEL_DOT
+                                                                       : REDUCE_KERNEL_MIN_MAX;
+    const uint32_t n = (uint32_t)metal_adder->array_length;
+    const uint64_t num_groups = tm_clamp(((uint64_t)n + METAL_ADDER_REDUCE_GROUP_SIZE - 1) / METAL_ADDER_REDUCE_GROUP_SIZE, 1, METAL_ADDER_REDUCE_MAX_GROUPS);
+
+    MTL::CommandBuffer *command_buffer = metal_adder->command_queue->commandBuffer();
+    MTL::ComputeCommandEncoder *compute_encoder = command_buffer->computeCommandEncoder();
+    compute_encoder->setComputePipelineState(metal_adder->reduce_pipelines[kernel]);
+    compute_encoder->setBuffer(private__array(set, x), 0, 0);
+    compute_encoder->setBuffer(private__array(set, y), 0, 1);
+    compute_encoder->setBuffer(metal_adder->reduce_partials, 0, 2);
+    compute_encoder->setBytes(&n, sizeof(n), 3);
+    compute_encoder->dispatchThreadgroups(MTL::Size::Make(num_groups, 1, 1), MTL::Size::Make(METAL_ADDER_REDUCE_GROUP_SIZE, 1, 1));
+    compute_encoder->endEncoding();
+    command_buffer->commit();
+    command_buffer->waitUntilCompleted();
+
+    const float *partials = (const float *)metal_adder->reduce_partials->contents();
+    double res;
+    if (kernel == REDUCE_KERNEL_MIN_MAX) {
+        float min = INFINITY, max = -INFINITY;
+        for (uint64_t g = 0; g < num_groups; ++g) {
+            min = partials[2 * g] < min ? partials[2 * g] : min;
+            max = partials[2 * g + 1] > max ? partials[2 * g + 1] : max;
+        }
+        res = min > max ? NAN : op == METAL_ADDER_REDUCE_OP_MIN ? min : max;
+    } else {
+        double sums[METAL_ADDER_REDUCE_MAX_GROUPS];
+        for (uint64_t g = 0; g < num_groups; ++g)
+            sums[g] = partials[g];
+        res = cpu_kernels__pairwise_sum(sums, num_groups);
+    }
+
+    pool->release();
+    const uint64_t num_arrays = op == METAL_ADDER_REDUCE_OP_DOT ? 2 : 1;
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, reduce, num_arrays * metal_adder->buffer_size);
+    return res;
+}
+
+// Staging buffers of `stream_files()`, with `slots` pointing at their contents.
+typedef struct stream_buffers_t
+{
+    metal_adder_o *metal_adder;
+    MTL::Buffer *a[METAL_ADDER_STREAM_RING_SIZE];
+    MTL::Buffer *b[METAL_ADDER_STREAM_RING_SIZE];
+    MTL::Buffer *result[METAL_ADDER_STREAM_RING_SIZE];
+    adder_stream_slot_t slots[METAL_ADDER_STREAM_RING_SIZE];
+} stream_buffers_t;
+
+static void private__stream_add(void *inst, uint32_t slot, const adder_stream_slot_t *buffers, uint64_t count)
+{
+    stream_buffers_t *sb = (stream_buffers_t *)inst;
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    MTL::CommandBuffer *command_buffer = private__encode_add_arrays(sb->metal_adder, sb->a[slot], sb->b[slot], sb->result[slot], count);
+    command_buffer->commit();
+    command_buffer->waitUntilCompleted();
+    pool->release();
+}
+
+// The staging buffers are shared, so the I/O jobs read and write them in place and the GPU works
+// on the same memory without copies.
+static uint64_t stream_files(struct metal_adder_o *metal_adder, const metal_adder_stream_t *stream)
+{
+    adder_stream_o *s = adder_stream__open(&metal_adder->allocator, stream);
+    if (!s)
+        return 0;
+
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, stream_files);
+
+    const uint64_t chunk_size = adder_stream__chunk_length(s) * sizeof(float);
+    stream_buffers_t sb = { .metal_adder = metal_adder };
+    for (uint32_t i = 0; i < METAL_ADDER_STREAM_RING_SIZE; ++i) {
+        sb.a[i] = metal_adder->device->newBuffer(chunk_size, MTL::ResourceStorageModeShared);
+        sb.b[i] = metal_adder->device->newBuffer(chunk_size, MTL::ResourceStorageModeShared);
+        sb.result[i] = metal_adder->device->newBuffer(chunk_size, MTL::ResourceStorageModeShared);
+        sb.slots[i] = (adder_stream_slot_t){
+            .a = (float *)sb.a[i]->contents(),
+            .b = (float *)sb.b[i]->contents(),
+            .result = (float *)sb.result[i]->contents(),
+        };
+    }
+
+    const uint64_t n = adder_stream__run(s, sb.slots, private__stream_add, &sb, metal_adder->trace);
+
+    for (uint32_t i = 0; i < METAL_ADDER_STREAM_RING_SIZE; ++i) {
+        sb.a[i]->release();
+        sb.b[i]->release();
+        sb.result[i]->release();
+    }
+    adder_stream__close(s);
+
+    ADDER_TRACE_END_SCOPE_WITH_BYTES(metal_adder->trace, stream_files, 3 * n * sizeof(float));
+    return n;
+}
+
+// Retires all dispatches in flight, in submission order, so completions are reported in the order
+// they were submitted.
+static void private__retire_all(metal_adder_o *metal_adder)
+{
+    const uint64_t num_sets = tm_min(metal_adder->next_ticket - 1, metal_adder->frames_in_flight);
+    for (uint64_t id = metal_adder->next_ticket - num_sets; id < metal_adder->next_ticket; ++id)
+        wait_for_completion(metal_adder, (metal_adder_ticket_t){ id });
+}
+
+static void *write_input(struct metal_adder_o *metal_adder, enum metal_adder_array array, uint64_t first, uint64_t count)
+{
+    if (array == METAL_ADDER_ARRAY_RESULT || first > metal_adder->array_length || count > metal_adder->array_length - first)
+        return NULL;
+
+    // Input files are read by the dispatches of every buffer set. The buffers live as long as the
+    // adder and only `submit()` dispatches on `set`, so the pointer stays valid until then.
+    buffer_set_t *set = private__buffer_set(metal_adder, (metal_adder_ticket_t){ metal_adder->next_ticket });
+    if (metal_adder->files.a.data) {
+        private__retire_all(metal_adder);
+        for (uint32_t i = 0; i < metal_adder->frames_in_flight; ++i)
+            dirty_chunks__mark(&metal_adder->buffer_sets[i].dirty, first, count);
+    } else {
+        private__retire(metal_adder, set);
+        dirty_chunks__mark(&set->dirty, first, count);
+    }
+
+    MTL::Buffer *buffer = array == METAL_ADDER_ARRAY_A ? set->buffer_a : set->buffer_b;
+    return (char *)buffer->contents() + first * metal_adder->dtype_kernels->element_size;
+}
+
+// The host-side kernel sets are static data of the DLL, so after a hot reload `kernels` still points
+// into the code that was loaded when the adder was created. The device, the buffers and the
+// pipelines are unaffected by the reload.
+static void reload(struct metal_adder_o *metal_adder, const metal_adder_completion_t *completion)
+{
+    ADDER_TRACE_BEGIN_SCOPE(metal_adder->trace, reload);
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+
+    for (uint32_t i = 0; i < metal_adder->frames_in_flight; ++i)
+        metal_adder->buffer_sets[i].completion = completion ? *completion : (metal_adder_completion_t){ 0 };
+    private__retire_all(metal_adder);
+    metal_adder->kernels = cpu_kernels__select_isa(metal_adder->isa);
+    metal_adder->dtype_kernels = cpu_kernels__select_dtype(metal_adder->kernels, metal_adder->dtype);
+    private__build_adder_pipeline(metal_adder);
+    private__build_reduce_pipelines(metal_adder);
+
+    pool->release();
+    ADDER_TRACE_END_SCOPE(metal_adder->trace, reload);
+    TM_LOG("Metal adder reloaded\n");
 }
 
 static void shutdown(struct metal_adder_o *metal_adder)
 {
+    private__retire_all(metal_adder);
+
+    for (uint32_t i = 0; i < metal_adder->frames_in_flight; ++i) {
+        buffer_set_t *set = metal_adder->buffer_sets + i;
+        set->buffer_a->release();
+        set->buffer_b->release();
+        set->result->release();
+        if (set->checksums) {
+            const uint64_t num_blocks = set->checksums->length() / sizeof(uint32_t);
+            set->checksums->release();
+            tm_free(&metal_adder->allocator, set->expected, num_blocks * sizeof(uint32_t));
+        }
+        dirty_chunks__free(&set->dirty, &metal_adder->allocator);
+    }
+    mapped_file__close_adder_files(&metal_adder->files);
+
+    if (metal_adder->batch_capacity) {
+        metal_adder->batch_a->release();
+        metal_adder->batch_b->release();
+        metal_adder->batch_result->release();
+    }
+
+    for (uint32_t i = 0; i < METAL_ADDER_MAX_EXPR_INPUTS; ++i) {
+        if (metal_adder->expr_inputs[i])
+            metal_adder->expr_inputs[i]->release();
+    }
+    if (metal_adder->expr_result)
+        metal_adder->expr_result->release();
+
     metal_adder->pipeline->release();
+    if (metal_adder->dtype_pipeline)
+        metal_adder->dtype_pipeline->release();
+    if (metal_adder->checksum_pipeline)
+        metal_adder->checksum_pipeline->release();
+    for (uint32_t i = 0; i < REDUCE_KERNEL_COUNT; ++i)
+        metal_adder->reduce_pipelines[i]->release();
+    metal_adder->reduce_partials->release();
     metal_adder->command_queue->release();
-    metal_adder->buffer_a->release();
-    metal_adder->buffer_b->release();
-    metal_adder->result->release();
     metal_adder->adder->release();
-    
+
+    adder_trace__destroy(metal_adder->trace);
+    tm_free(&metal_adder->allocator, metal_adder->data_dir, strlen(metal_adder->data_dir) + 1);
+
     tm_allocator_i a = metal_adder->allocator;
     tm_free(&a, metal_adder, sizeof(metal_adder_o));
     tm_allocator_api->destroy_child(&a);
@@ -175,7 +1285,23 @@ static void shutdown(struct metal_adder_o *metal_adder)
 static struct metal_adder_api adder_api = {
     .init = init,
     .send_compute_command = send_compute_command,
+    .submit = submit,
+    .is_complete = is_complete,
+    .wait_for_completion = wait_for_completion,
+    .add_batch = add_batch,
     .shutdown = shutdown,
+    .compile_expr = compile_expr,
+    .run_expr = run_expr,
+    .release_expr = release_expr,
+    .reload = reload,
+    .stream_files = stream_files,
+    .reduce = reduce,
+    .write_input = write_input,
+    .record_graph = record_graph,
+    .graph_array = graph_array,
+    .run_graph = run_graph,
+    .release_graph = release_graph,
+    .run_tasks = run_tasks,
 };
 
 extern "C" {
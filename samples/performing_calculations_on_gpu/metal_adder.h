@@ -1,12 +1,500 @@
 #pragma once
 
+#include <foundation/api_types.h>
+
 struct metal_adder_o;
 struct tm_allocator_i;
 
+// Element types of the adder's input and result buffers.
+enum metal_adder_dtype {
+    METAL_ADDER_DTYPE_FLOAT,    // 32-bit IEEE float
+    METAL_ADDER_DTYPE_HALF,     // 16-bit IEEE float
+    METAL_ADDER_DTYPE_BFLOAT16, // Upper 16 bits of a 32-bit float
+    METAL_ADDER_DTYPE_DOUBLE,   // 64-bit IEEE float, not supported by Metal
+    METAL_ADDER_DTYPE_INT32,    // Wraps around on overflow
+    METAL_ADDER_DTYPE_INT64,    // Wraps around on overflow
+
+    METAL_ADDER_DTYPE_COUNT,
+};
+
+// Returns the size in bytes of an element of `dtype`.
+static inline uint32_t metal_adder_dtype_size(enum metal_adder_dtype dtype)
+{
+    return dtype == METAL_ADDER_DTYPE_HALF || dtype == METAL_ADDER_DTYPE_BFLOAT16 ? 2
+        : dtype == METAL_ADDER_DTYPE_DOUBLE || dtype == METAL_ADDER_DTYPE_INT64    ? 8
+                                                                                   : 4;
+}
+
+// How the CPU backend writes the results of its dispatches.
+enum metal_adder_stores {
+    // Streaming stores if the inputs and the result of a dispatch don't fit in the last-level cache
+    // together and neither `metal_adder_settings_t::fused_verify` nor `incremental` is set, cached
+    // stores otherwise.
+    METAL_ADDER_STORES_AUTO,
+
+    // Regular stores, which read each cache line of the result before overwriting it and leave the
+    // results in the cache.
+    METAL_ADDER_STORES_CACHED,
+
+    // Non-temporal stores, which write the results straight to memory, with the inputs prefetched
+    // `metal_adder_settings_t::prefetch_distance` bytes ahead.
+    METAL_ADDER_STORES_STREAMING,
+};
+
+// Which parts of the result a dispatch recomputes, see `metal_adder_settings_t::incremental`.
+enum metal_adder_incremental {
+    // Every dispatch recomputes and verifies the whole result.
+    METAL_ADDER_INCREMENTAL_OFF,
+
+    // Dispatches only recompute and verify the chunks of `grain_size` elements whose inputs were
+    // marked as changed by `metal_adder_api->write_input()` since the buffer set's last dispatch.
+    // Writes through other pointers, such as to the input files by another process, aren't seen.
+    METAL_ADDER_INCREMENTAL_TRACKED,
+
+    // As `METAL_ADDER_INCREMENTAL_TRACKED`, but each dispatch also hashes the inputs of every chunk
+    // to find changes that weren't marked. This reads both inputs on the host, so it only saves
+    // writing the result and verifying it.
+    METAL_ADDER_INCREMENTAL_HASHED,
+};
+
+// Settings passed to `metal_adder_api->init()`. Zero-initialized fields select the defaults.
+typedef struct metal_adder_settings_t
+{
+    // Number of elements in each of the adder's input and result buffers. Defaults to
+    // `METAL_ADDER_DEFAULT_ARRAY_LENGTH`.
+    uint64_t array_length;
+
+    // Number of elements processed by each job when the CPU backend splits a dispatch across the
+    // job system. Defaults to `METAL_ADDER_DEFAULT_GRAIN_SIZE`.
+    uint32_t grain_size;
+
+    // Results are accepted if they are within this many ulps of `a + b` rounded to `dtype` (units for
+    // integer types). Zero requires bit-exact results, a larger tolerance allows validating fused or
+    // reordered kernels.
+    uint32_t ulp_tolerance;
+
+    // Number of input/result buffer sets the adder rotates through, which is also the maximum number
+    // of dispatches that can be in flight at once. Clamped to `[1, METAL_ADDER_MAX_FRAMES_IN_FLIGHT]`.
+    uint32_t frames_in_flight;
+    TM_PAD(4);
+
+    // Seed for the random input data. The same seed produces bit-identical inputs on all platforms
+    // and backends.
+    uint64_t seed;
+
+    // If set, the adder records its phases and writes them to this path as a Chrome trace JSON file
+    // on `shutdown()`.
+    const char *trace_path;
+
+    // Paths of raw `dtype` arrays to use as the inputs instead of random data, both must be set. The
+    // files are mapped directly as the input buffers of all buffer sets. `array_length` defaults to
+    // the length of the shorter file, and is clamped to it.
+    const char *input_a_path;
+    const char *input_b_path;
+
+    // If set, results are written to this file, mapped directly as the result buffer. Since there is
+    // only one result buffer, this limits `frames_in_flight` to 1.
+    const char *result_path;
+
+    // Element type of the input and result buffers. The adder's dispatches, random inputs and
+    // verification all use this type. `add_batch()`, `run_expr()`, `reduce()` and `stream_files()`
+    // always work on floats. Half-width types move half the bytes per element, so bandwidth-bound
+    // dispatches process twice the elements per second.
+    enum metal_adder_dtype dtype;
+
+    // Number of compute devices the CPU backend shards each dispatch across, see
+    // `compute_device.h`. Zero gives one device per NUMA node, more than the number of nodes splits
+    // the nodes into groups of cores. Clamped to `METAL_ADDER_MAX_DEVICES`. The Metal backend always
+    // uses the system default device.
+    uint32_t num_devices;
+
+    // If set, dispatches compute a checksum of each block of `grain_size` results as they write
+    // them. Verification then only compares these with checksums of the inputs' sums, computed by
+    // `init()` and again by `submit()` for the blocks changed with `write_input()`, and reads back the
+    // results of blocks whose checksums differ. Without it, verification re-reads the inputs and the
+    // results of every dispatch.
+    bool fused_verify;
+    TM_PAD(3);
+
+    // How the CPU backend writes results. The Metal backend ignores it.
+    enum metal_adder_stores stores;
+
+    // Distance in bytes that the CPU backend's streaming stores prefetch the inputs ahead of the
+    // elements they add. Defaults to `METAL_ADDER_DEFAULT_PREFETCH_DISTANCE`.
+    uint32_t prefetch_distance;
+    TM_PAD(4);
+
+    // Name of the CPU kernel set to use, one of "scalar", "sse2", "avx2", "avx512" or "neon", for
+    // comparing them. NULL selects the widest set the CPU supports, which is also used if the named
+    // set isn't. The CPU backend runs its dispatches with it, the Metal backend fills and verifies
+    // buffers with it.
+    const char *cpu_kernels;
+
+    // If not `METAL_ADDER_INCREMENTAL_OFF`, dispatches only recompute the chunks of the result whose
+    // inputs have changed, and only verify those. The first dispatch on each buffer set computes
+    // everything, as do dispatches after a verification failure for the failed chunks. Replaces
+    // `fused_verify`, which is ignored.
+    enum metal_adder_incremental incremental;
+
+    // If non-zero, the CPU backend runs at most this many jobs of a dispatch at once, across all of
+    // its devices, so it can't keep more job system workers busy. The dispatch is split into the same
+    // `grain_size` chunks and blocks either way. For measuring how dispatches scale with workers. The
+    // Metal backend ignores it.
+    uint32_t max_workers;
+} metal_adder_settings_t;
+
+#define METAL_ADDER_DEFAULT_ARRAY_LENGTH (1 << 24)
+
+// 32K floats per job: the two inputs and the result of one job (384 KB) fit in a typical L2.
+#define METAL_ADDER_DEFAULT_GRAIN_SIZE (32 * 1024)
+
+// 16 cache lines: far enough ahead to cover the memory latency at full bandwidth on one core,
+// close enough that the lines are still in L1 when the loop gets to them.
+#define METAL_ADDER_DEFAULT_PREFETCH_DISTANCE 1024
+
+#define METAL_ADDER_MAX_FRAMES_IN_FLIGHT 8
+
+#define METAL_ADDER_MAX_DEVICES 8
+
+// Identifies a dispatch started by `metal_adder_api->submit()`. Tickets are numbered from 1 in
+// submission order.
+typedef struct metal_adder_ticket_t
+{
+    uint64_t id;
+} metal_adder_ticket_t;
+
+// Time spent in each phase of a dispatch, in seconds.
+typedef struct metal_adder_timings_t
+{
+    // Encoding and starting the dispatch on the host, in `submit()`.
+    double encode;
+
+    // Executing the kernel on the device, from when it started until it finished.
+    double execute;
+
+    // Blocking on the host until the dispatch finished.
+    double wait;
+
+    // Verifying the results on the host.
+    double verify;
+} metal_adder_timings_t;
+
+// Outcome of a retired dispatch.
+typedef struct metal_adder_result_t
+{
+    metal_adder_ticket_t ticket;
+
+    // Number of elements the dispatch added. This is the length of the input files when they're
+    // used, rather than the requested array length, and with `metal_adder_settings_t::incremental`
+    // only the elements of the chunks that were recomputed.
+    uint64_t count;
+
+    // True if the results passed verification.
+    bool ok;
+    TM_PAD(7);
+
+    metal_adder_timings_t timings;
+} metal_adder_result_t;
+
+// Callback for when a dispatch is retired.
+typedef struct metal_adder_completion_t
+{
+    void (*f)(void *ud, const metal_adder_result_t *result);
+    void *ud;
+} metal_adder_completion_t;
+
+// One array addition in a batch, computes `result[i] = a[i] + b[i]` for `i` in `[0, count)`.
+typedef struct metal_adder_segment_t
+{
+    const float *a;
+    const float *b;
+    float *result;
+    uint64_t count;
+} metal_adder_segment_t;
+
+// Maximum number of nodes and inputs of a `metal_adder_expr_t`.
+#define METAL_ADDER_MAX_EXPR_NODES 64
+#define METAL_ADDER_MAX_EXPR_INPUTS 8
+
+// Operations of an elementwise expression. `x`, `y` and `z` are the values of the nodes referenced by
+// `args[0]`, `args[1]` and `args[2]`.
+enum metal_adder_expr_op {
+    // Element of the input array `input`.
+    METAL_ADDER_EXPR_OP_INPUT,
+
+    // The value `constant`.
+    METAL_ADDER_EXPR_OP_CONSTANT,
+
+    METAL_ADDER_EXPR_OP_ADD,    // x + y
+    METAL_ADDER_EXPR_OP_SUB,    // x - y
+    METAL_ADDER_EXPR_OP_MUL,    // x * y
+    METAL_ADDER_EXPR_OP_DIV,    // x / y
+    METAL_ADDER_EXPR_OP_MIN,    // x < y ? x : y
+    METAL_ADDER_EXPR_OP_MAX,    // x > y ? x : y
+    METAL_ADDER_EXPR_OP_LESS,   // x < y ? 1 : 0
+    METAL_ADDER_EXPR_OP_FMA,    // x * y + z, with a single rounding
+    METAL_ADDER_EXPR_OP_CLAMP,  // min(max(x, y), z)
+    METAL_ADDER_EXPR_OP_SELECT, // x != 0 ? y : z
+
+    METAL_ADDER_EXPR_OP_COUNT,
+};
+
+typedef struct metal_adder_expr_node_t
+{
+    enum metal_adder_expr_op op;
+
+    // Indices of the operand nodes. Operands must come before the node in `metal_adder_expr_t::nodes`.
+    uint32_t args[3];
+
+    // Input index for `METAL_ADDER_EXPR_OP_INPUT`.
+    uint32_t input;
+
+    // Value for `METAL_ADDER_EXPR_OP_CONSTANT`.
+    float constant;
+} metal_adder_expr_node_t;
+
+// An elementwise expression over `num_inputs` float arrays, with the result in the last node. For
+// example `out = a * b + c` is:
+//
+//     { INPUT 0 }, { INPUT 1 }, { INPUT 2 }, { FMA, args = { 0, 1, 2 } }
+typedef struct metal_adder_expr_t
+{
+    const metal_adder_expr_node_t *nodes;
+    uint32_t num_nodes;
+    uint32_t num_inputs;
+} metal_adder_expr_t;
+
+// Maximum number of operations and arrays of a `metal_adder_graph_t`.
+#define METAL_ADDER_MAX_GRAPH_OPS 64
+#define METAL_ADDER_MAX_GRAPH_ARRAYS 32
+
+// Operations of a `metal_adder_graph_t`. The arguments are indices of the graph's arrays.
+enum metal_adder_graph_op_type {
+    // `args[2] = args[0] + args[1]`
+    METAL_ADDER_GRAPH_OP_ADD,
+
+    // `args[n] = expr(args[0], ..., args[n - 1])`, where `n` is the number of inputs of `expr`.
+    METAL_ADDER_GRAPH_OP_EXPR,
+};
+
+typedef struct metal_adder_graph_op_t
+{
+    enum metal_adder_graph_op_type type;
+    uint32_t args[METAL_ADDER_MAX_EXPR_INPUTS + 1];
+
+    // Expression returned by `metal_adder_api->compile_expr()` for `METAL_ADDER_GRAPH_OP_EXPR`. It
+    // must not be released before the graph.
+    const struct metal_adder_expr_o *expr;
+} metal_adder_graph_op_t;
+
+// A sequence of elementwise operations on `num_arrays` float arrays that belong to the graph, see
+// `metal_adder_api->record_graph()`. A graph without operations only owns arrays, for
+// `metal_adder_api->run_tasks()`.
+//
+// An operation waits for the earlier operations it depends on: those that write an array it reads
+// or writes, or read an array it writes. Independent operations can run concurrently.
+typedef struct metal_adder_graph_t
+{
+    const metal_adder_graph_op_t *ops;
+    uint32_t num_ops;
+    uint32_t num_arrays;
+
+    // Number of elements of each array, which is also the most elements a run can process.
+    uint64_t array_length;
+} metal_adder_graph_t;
+
+// Maximum number of tasks in a `metal_adder_api->run_tasks()` call.
+#define METAL_ADDER_MAX_TASKS 64
+
+// Where a `metal_adder_task_t` runs.
+enum metal_adder_task_type {
+    // `op`, on the compute device.
+    METAL_ADDER_TASK_DEVICE,
+
+    // `f`, on a thread of `tm_task_system_api`. For filling inputs, verifying results and other work
+    // on the CPU side.
+    METAL_ADDER_TASK_CPU,
+};
+
+typedef struct metal_adder_task_t
+{
+    enum metal_adder_task_type type;
+
+    // The arrays a CPU task reads and writes, one bit per array of the graph. Device tasks declare
+    // them through the arguments of `op`.
+    uint32_t reads;
+    uint32_t writes;
+    TM_PAD(4);
+
+    metal_adder_graph_op_t op;
+
+    // Function of a CPU task, called with the graph's arrays and the number of elements to process.
+    void (*f)(void *ud, float *const *arrays, uint64_t count);
+    void *ud;
+
+    // Name of a CPU task in the task system, may be NULL.
+    const char *name;
+} metal_adder_task_t;
+
+// Arrays of a dispatch's buffer set.
+enum metal_adder_array {
+    METAL_ADDER_ARRAY_A,
+    METAL_ADDER_ARRAY_B,
+    METAL_ADDER_ARRAY_RESULT,
+};
+
+// Reductions of `metal_adder_api->reduce()`. `x` and `y` are the arrays passed to it.
+enum metal_adder_reduce_op {
+    METAL_ADDER_REDUCE_OP_SUM, // Sum of x[i]
+    METAL_ADDER_REDUCE_OP_MIN, // Smallest x[i], ignoring NaNs
+    METAL_ADDER_REDUCE_OP_MAX, // Largest x[i], ignoring NaNs
+    METAL_ADDER_REDUCE_OP_DOT, // Sum of x[i] * y[i]
+};
+
+// Number of chunks `metal_adder_api->stream_files()` keeps in flight: one being read, one being
+// added and one being written back.
+#define METAL_ADDER_STREAM_RING_SIZE 3
+
+// 4M floats per chunk, so the ring's staging buffers take 144 MB.
+#define METAL_ADDER_DEFAULT_STREAM_CHUNK_LENGTH (4 * 1024 * 1024)
+
+// Files added by `metal_adder_api->stream_files()`.
+typedef struct metal_adder_stream_t
+{
+    // Raw float files to add. Only the length of the shorter file is added.
+    const char *input_a_path;
+    const char *input_b_path;
+
+    // File the sums are written to. Created or truncated.
+    const char *result_path;
+
+    // Number of elements per chunk. Defaults to `METAL_ADDER_DEFAULT_STREAM_CHUNK_LENGTH` if 0.
+    uint64_t chunk_length;
+} metal_adder_stream_t;
+
+struct metal_adder_expr_o;
+struct metal_adder_graph_o;
+
 struct metal_adder_api {
-    struct metal_adder_o *(*init)(struct tm_allocator_i *allocator, const char *data_dir);
+    struct metal_adder_o *(*init)(struct tm_allocator_i *allocator, const char *data_dir, const metal_adder_settings_t *settings);
+
+    // Dispatches the kernel and waits for it to finish. Same as `submit()` followed by
+    // `wait_for_completion()`.
     void (*send_compute_command)(struct metal_adder_o *metal_adder);
+
+    // Encodes and starts a dispatch on the next buffer set of the ring, without waiting for it to
+    // finish. If that buffer set is still used by an earlier dispatch, that dispatch is retired first.
+    //
+    // Retiring a dispatch verifies its results and calls its `completion` callback (if not NULL).
+    // This always happens on the thread calling into the adder, in `submit()`, `is_complete()`,
+    // `wait_for_completion()` or `shutdown()`.
+    metal_adder_ticket_t (*submit)(struct metal_adder_o *metal_adder, const metal_adder_completion_t *completion);
+
+    // Returns `true` if the dispatch has finished, retiring it if it hasn't been already. Never
+    // blocks.
+    bool (*is_complete)(struct metal_adder_o *metal_adder, metal_adder_ticket_t ticket);
+
+    // Waits for the dispatch to finish and retires it.
+    void (*wait_for_completion)(struct metal_adder_o *metal_adder, metal_adder_ticket_t ticket);
+
+    // Adds all the `segments` in a single dispatch and waits for it to finish. The segments use
+    // caller-owned memory and are not verified.
+    //
+    // Batching avoids the fixed per-dispatch cost for small arrays: the Metal backend packs the
+    // segments into staging buffers for one `add_arrays` dispatch, the CPU backend splits the
+    // concatenated segments into one set of jobs.
+    void (*add_batch)(struct metal_adder_o *metal_adder, const metal_adder_segment_t *segments, uint32_t num_segments);
+
+    // Retires all dispatches still in flight and frees the adder.
     void (*shutdown)(struct metal_adder_o *metal_adder);
+
+    // Compiles `expr` into a single fused pass: a generated kernel on Metal, a loop over cache-sized
+    // tiles on the CPU. Returns NULL and logs an error if the expression is invalid. Intermediate
+    // values never go to memory, so running the expression only reads the inputs and writes the
+    // result, however many operations it has.
+    //
+    // Compiled kernels are cached: the Metal backend keeps the pipelines in `<data_dir>/kernel_cache/`
+    // across runs, the CPU backend shares the compiled program between calls with the same
+    // expression. Every call must be matched by a `release_expr()`.
+    struct metal_adder_expr_o *(*compile_expr)(struct metal_adder_o *metal_adder, const metal_adder_expr_t *expr);
+
+    // Evaluates the compiled expression for `count` elements of the `inputs` arrays into `result`
+    // and waits for it to finish. The arrays use caller-owned memory and are not verified.
+    void (*run_expr)(struct metal_adder_o *metal_adder, const struct metal_adder_expr_o *expr, const float *const *inputs,
+        float *result, uint64_t count);
+
+    // Frees an expression returned by `compile_expr()`.
+    void (*release_expr)(struct metal_adder_o *metal_adder, struct metal_adder_expr_o *expr);
+
+    // Re-binds the adder to the kernels of the currently loaded code, call it after the plugin has
+    // been hot reloaded. Dispatches in flight are retired first, the buffers and their contents are
+    // kept, so a reload only swaps the kernels instead of re-initializing the adder. The Metal backend
+    // also reloads `shaders/metal_adder.metal` and rebuilds the pipeline if the source has changed.
+    //
+    // The callbacks the dispatches in flight were submitted with may point into the code that was
+    // just replaced, so they are reported to `completion` instead. Pass NULL to drop them.
+    void (*reload)(struct metal_adder_o *metal_adder, const metal_adder_completion_t *completion);
+
+    // Adds files that don't need to fit in memory. The files are walked in chunks through a ring of
+    // `METAL_ADDER_STREAM_RING_SIZE` staging buffer sets, so peak memory is bounded by the chunk
+    // length. Reading chunk N+1 and writing back chunk N-1 run as jobs while chunk N is added, so
+    // with a fast enough kernel the throughput is bound by the disk. Doesn't touch the adder's own
+    // buffers or dispatches, and the results are not verified.
+    //
+    // Returns the number of elements written to the result, or 0 if a file couldn't be opened, read
+    // or written.
+    uint64_t (*stream_files)(struct metal_adder_o *metal_adder, const metal_adder_stream_t *stream);
+
+    // Reduces the arrays of the dispatch `ticket` where they are, without reading them back to the
+    // caller: a threadgroup tree reduction on Metal, per-job partial results on the CPU. `y` is only
+    // used by `METAL_ADDER_REDUCE_OP_DOT`. The dispatch is retired first if it's still in flight.
+    // Only supported for `METAL_ADDER_DTYPE_FLOAT`.
+    //
+    // Sums are Kahan compensated within each thread or job, and the partial results are combined in
+    // a fixed order, so reducing the same data always gives the same result. Min and max of an
+    // array of only NaNs are NaN. Returns NaN and logs an error if the buffer set of `ticket` has
+    // been reused by a later dispatch, or the adder doesn't use floats.
+    double (*reduce)(struct metal_adder_o *metal_adder, metal_adder_ticket_t ticket, enum metal_adder_reduce_op op,
+        enum metal_adder_array x, enum metal_adder_array y);
+
+    // Returns a pointer to the elements `[first, first + count)` of the input `array` (A or B) of the
+    // buffer set the next `submit()` uses, for the caller to write new inputs to, and marks them as
+    // changed, see `metal_adder_settings_t::incremental`. If that buffer set is still used by an
+    // earlier dispatch, that dispatch is retired first. The pointer is valid until the next
+    // `submit()`, `send_compute_command()` or `shutdown()`, so both inputs can be written at once.
+    // Input files are shared by all buffer sets, so writing to them marks the elements in all of
+    // them.
+    //
+    // Returns NULL if `array` isn't an input or the range is outside the array.
+    void *(*write_input)(struct metal_adder_o *metal_adder, enum metal_adder_array array, uint64_t first, uint64_t count);
+
+    // Records `graph` once, so that `run_graph()` can replay it without encoding anything: into an
+    // indirect command buffer on Metal, into a pre-built job list for each group of independent
+    // operations on the CPU. The graph's arrays are allocated with it. Returns NULL and logs an error
+    // if the graph is invalid.
+    //
+    // Jobs are built for the full `array_length`, so record graphs at the size they're run at.
+    struct metal_adder_graph_o *(*record_graph)(struct metal_adder_o *metal_adder, const metal_adder_graph_t *graph);
+
+    // Returns the array `array` of `graph`, for the caller to write the inputs to and read the
+    // results from between runs.
+    float *(*graph_array)(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph, uint32_t array);
+
+    // Runs the operations of `graph` on the first `count` elements of its arrays and waits for them
+    // to finish. `count` is clamped to the graph's `array_length`, and is the only thing updated in
+    // the recorded commands when it changes. The results are not verified.
+    void (*run_graph)(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph, uint64_t count);
+
+    // Frees a graph returned by `record_graph()` and its arrays.
+    void (*release_graph)(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph);
+
+    // Runs `tasks` on the first `count` elements of the arrays of `graph` and waits for all of them.
+    // The graph's own operations are not run. As in a graph, a task depends on the earlier tasks that
+    // write an array it reads or writes, or read an array it writes. Each task starts as soon as
+    // those have finished, so independent device tasks run concurrently and CPU tasks overlap with
+    // the device work. Returns `false` and logs an error if the tasks are invalid.
+    bool (*run_tasks)(struct metal_adder_o *metal_adder, struct metal_adder_graph_o *graph, const metal_adder_task_t *tasks,
+        uint32_t num_tasks, uint64_t count);
 };
 
-#define metal_adder_api_version TM_VERSION(1, 0, 0)
+#define metal_adder_api_version TM_VERSION(5, 0, 0)
@@ -2,7 +2,7 @@
 See LICENSE folder for this sample’s licensing information.
 
 Abstract:
-A shader that adds two arrays of floats.
+A shader that adds two arrays of floats, or of the other element types of the adder.
 */
 
 #include <metal_stdlib>
@@ -17,3 +17,94 @@ kernel void add_arrays(device const float* inA,
     // calls this function.
     result[index] = inA[index] + inB[index];
 }
+
+// Versions of add_arrays for the other element types of `metal_adder_settings_t::dtype`. They give
+// bit-identical results to the CPU reference in cpu_kernels.cpp: half and bfloat16 are added in
+// float and rounded once, integers wrap around. bfloat16 is stored as ushort and converted by hand,
+// since the `bfloat` type needs Metal 3.1.
+
+static float bfloat16_to_float(ushort x)
+{
+    return as_type<float>(uint(x) << 16);
+}
+
+// Rounds to nearest even and keeps NaNs quiet.
+static ushort float_to_bfloat16(float f)
+{
+    const uint u = as_type<uint>(f);
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return ushort((u >> 16) | 0x40);
+    return ushort((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+static half add(half x, half y) { return half(float(x) + float(y)); }
+static ushort add(ushort x, ushort y) { return float_to_bfloat16(bfloat16_to_float(x) + bfloat16_to_float(y)); }
+static int add(int x, int y) { return as_type<int>(as_type<uint>(x) + as_type<uint>(y)); }
+static long add(long x, long y) { return as_type<long>(as_type<ulong>(x) + as_type<ulong>(y)); }
+
+template <typename T>
+kernel void add_arrays_typed(device const T* inA [[buffer(0)]],
+                             device const T* inB [[buffer(1)]],
+                             device T* result [[buffer(2)]],
+                             uint index [[thread_position_in_grid]])
+{
+    result[index] = add(inA[index], inB[index]);
+}
+
+template [[host_name("add_arrays_half")]] kernel void add_arrays_typed<half>(device const half*, device const half*, device half*, uint);
+template [[host_name("add_arrays_bfloat16")]] kernel void add_arrays_typed<ushort>(device const ushort*, device const ushort*, device ushort*, uint);
+template [[host_name("add_arrays_int32")]] kernel void add_arrays_typed<int>(device const int*, device const int*, device int*, uint);
+template [[host_name("add_arrays_int64")]] kernel void add_arrays_typed<long>(device const long*, device const long*, device long*, uint);
+
+// Versions of add_arrays that also add a checksum of each block of `block_size` results to
+// `checksums`, for `metal_adder_settings_t::fused_verify`. The checksum must match
+// `private__checksum_term()` in cpu_kernels.cpp: a wrapping sum of a hash of each result's bits
+// and index, so the threads can add their terms in any order.
+
+static float add(float x, float y) { return x + y; }
+
+static uint checksum_bits(float x) { return as_type<uint>(x); }
+static uint checksum_bits(half x) { return as_type<ushort>(x); }
+static uint checksum_bits(ushort x) { return x; }
+static uint checksum_bits(int x) { return as_type<uint>(x); }
+static uint checksum_bits(long x)
+{
+    const uint2 w = as_type<uint2>(x);
+    return w.x ^ rotate(w.y, 16u);
+}
+
+static uint checksum_term(uint bits, uint index)
+{
+    return (bits ^ (index * 0x9e3779b9u)) * 0x85ebca6bu;
+}
+
+template <typename T>
+kernel void add_arrays_checksum(device const T* inA [[buffer(0)]],
+                                device const T* inB [[buffer(1)]],
+                                device T* result [[buffer(2)]],
+                                device atomic_uint* checksums [[buffer(3)]],
+                                constant uint& block_size [[buffer(4)]],
+                                uint index [[thread_position_in_grid]])
+{
+    const T r = add(inA[index], inB[index]);
+    result[index] = r;
+
+    const uint term = checksum_term(checksum_bits(r), index);
+    const uint block = index / block_size;
+
+    // Blocks are much larger than a SIMD-group, so nearly every SIMD-group lies within one block
+    // and needs a single atomic.
+    if (simd_all(block == simd_broadcast_first(block))) {
+        const uint sum = simd_sum(term);
+        if (simd_is_first())
+            atomic_fetch_add_explicit(checksums + block, sum, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(checksums + block, term, memory_order_relaxed);
+    }
+}
+
+template [[host_name("add_arrays_checksum_float")]] kernel void add_arrays_checksum<float>(device const float*, device const float*, device float*, device atomic_uint*, constant uint&, uint);
+template [[host_name("add_arrays_checksum_half")]] kernel void add_arrays_checksum<half>(device const half*, device const half*, device half*, device atomic_uint*, constant uint&, uint);
+template [[host_name("add_arrays_checksum_bfloat16")]] kernel void add_arrays_checksum<ushort>(device const ushort*, device const ushort*, device ushort*, device atomic_uint*, constant uint&, uint);
+template [[host_name("add_arrays_checksum_int32")]] kernel void add_arrays_checksum<int>(device const int*, device const int*, device int*, device atomic_uint*, constant uint&, uint);
+template [[host_name("add_arrays_checksum_int64")]] kernel void add_arrays_checksum<long>(device const long*, device const long*, device long*, device atomic_uint*, constant uint&, uint);
@@ -0,0 +1,384 @@
+#include "cpu_kernels.h"
+
+#include <foundation/allocator.h>
+#include <foundation/api_registry.h>
+#include <foundation/carray.inl>
+#include <foundation/job_system.h>
+#include <foundation/macros.h>
+#include <foundation/math.inl>
+#include <foundation/os.h>
+
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Console microbenchmark of the CPU kernels of `samples/performing_calculations_on_gpu`. Sweeps the
+// working set of `a + b` from L1-resident sizes up to several GB, for each kernel set with cached
+// and streaming stores and for 1, 2, 4, ... threads, then prints a roofline-style summary. The
+// results can be written as CSV or JSON, and compared with a CSV from an earlier run.
+
+// The CPU kernels run their parallel-fors on this job system, created by `main()`. In the sample
+// the host creates it and `loader.c` gets it from the API registry.
+struct tm_job_system_api *tm_job_system_api;
+
+typedef struct bench_settings_t
+{
+    // Working set of the three arrays, in bytes. Sizes go up by a factor of 4 from `min_bytes`.
+    uint64_t min_bytes;
+    uint64_t max_bytes;
+
+    // Number of job system workers, and the largest thread count of the sweep.
+    uint32_t max_threads;
+    TM_PAD(4);
+
+    // Each measurement repeats the add until it has run this long, at least three times, and keeps
+    // the fastest run.
+    double min_time;
+
+    // Comma-separated names of the kernel sets to run, NULL for all of them.
+    const char *kernels;
+
+    const char *csv_path;
+    const char *json_path;
+
+    // CSV written with `--csv` by an earlier run. Results that are more than `threshold` slower than
+    // in the baseline are reported as regressions.
+    const char *baseline_path;
+    double threshold;
+} bench_settings_t;
+
+typedef struct bench_result_t
+{
+    const char *kernels;
+    const char *stores;
+    uint32_t threads;
+    TM_PAD(4);
+    uint64_t elements;
+
+    // Fastest time of one add of `elements` elements.
+    double seconds;
+
+    // Bytes read and written per second: two inputs and one result per element.
+    double gb_per_s;
+
+    // Elements per nanosecond, which is also GFLOP/s since each element is one add.
+    double elements_per_ns;
+} bench_result_t;
+
+// Data of the jobs of one measurement.
+typedef struct add_job_t
+{
+    const cpu_kernels_t *kernels;
+    const float *a;
+    const float *b;
+    float *result;
+    bool streaming;
+    TM_PAD(7);
+} add_job_t;
+
+static void add_job(void *data, uint64_t begin, uint64_t end)
+{
+    const add_job_t *job = (const add_job_t *)data;
+    if (job->streaming)
+        job->kernels->add_arrays_streaming(job->a + begin, job->b + begin, job->result + begin, end - begin, METAL_ADDER_DEFAULT_PREFETCH_DISTANCE);
+    else
+        job->kernels->add_arrays(job->a + begin, job->b + begin, job->result + begin, end - begin);
+}
+
+// Returns the fastest time of adding `n` elements as one job per thread.
+static double time_add(const add_job_t *job, uint64_t n, uint32_t threads, double min_time)
+{
+    // Whole cache lines per job, so the jobs never write to the same line.
+    const uint64_t grain_size = tm_max(((n + threads - 1) / threads + 15) & ~15ULL, 16);
+
+    double best = DBL_MAX, total = 0.0;
+    for (uint32_t run = 0; run < 3 || total < min_time; ++run) {
+        const tm_clock_o start = tm_os_api->time->now();
+        cpu_kernels__parallel_for(n, grain_size, add_job, (void *)job);
+        const double seconds = tm_os_api->time->delta(tm_os_api->time->now(), start);
+        best = tm_min(best, seconds);
+        total += seconds;
+    }
+    return best;
+}
+
+// Returns `true` if `name` is in the comma-separated `list`.
+static bool in_list(const char *list, const char *name)
+{
+    const uint64_t len = strlen(name);
+    for (const char *s = list; s; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL) {
+        if (!strncmp(s, name, len) && (s[len] == ',' || s[len] == 0))
+            return true;
+    }
+    return false;
+}
+
+#if defined(TM_CPU_NEON)
+static const char *kernel_names[] = { "scalar", "neon" };
+#else
+static const char *kernel_names[] = { "scalar", "sse2", "avx2", "avx512" };
+#endif
+
+static const char *stores_names[] = { "cached", "streaming" };
+
+static bench_result_t *run_sweep(const bench_settings_t *settings, tm_allocator_i *allocator)
+{
+    bench_result_t *results = 0;
+
+    const uint64_t max_elements = tm_max(settings->max_bytes / (3 * sizeof(float)), 16);
+    float *a = tm_alloc(allocator, max_elements * sizeof(float));
+    float *b = tm_alloc(allocator, max_elements * sizeof(float));
+    float *result = tm_alloc(allocator, max_elements * sizeof(float));
+
+    // Filling the arrays in parallel spreads their pages over the workers' nodes.
+    const cpu_kernels_dtype_t *fill = cpu_kernels__select_dtype(cpu_kernels__select(NULL), METAL_ADDER_DTYPE_FLOAT);
+    cpu_kernels__generate_random(fill, a, max_elements, 0, 0, METAL_ADDER_DEFAULT_GRAIN_SIZE);
+    cpu_kernels__generate_random(fill, b, max_elements, 0, 1, METAL_ADDER_DEFAULT_GRAIN_SIZE);
+    cpu_kernels__generate_random(fill, result, max_elements, 0, 2, METAL_ADDER_DEFAULT_GRAIN_SIZE);
+
+    printf("%-8s %-9s %7s %12s %12s %10s %12s\n", "kernels", "stores", "threads", "elements", "working set", "GB/s", "elements/ns");
+    for (uint32_t k = 0; k < TM_ARRAY_COUNT(kernel_names); ++k) {
+        if (settings->kernels && !in_list(settings->kernels, kernel_names[k]))
+            continue;
+        const cpu_kernels_t *kernels = cpu_kernels__select(kernel_names[k]);
+        if (strcmp(kernels->name, kernel_names[k]))
+            continue;
+
+        for (uint32_t s = 0; s < TM_ARRAY_COUNT(stores_names); ++s) {
+            const add_job_t job = { .kernels = kernels, .a = a, .b = b, .result = result, .streaming = s == 1 };
+            for (uint32_t threads = 1; threads;) {
+                for (uint64_t bytes = settings->min_bytes; bytes <= settings->max_bytes; bytes *= 4) {
+                    const uint64_t n = tm_clamp(bytes / (3 * sizeof(float)), 16, max_elements);
+                    const double seconds = time_add(&job, n, threads, settings->min_time);
+                    const bench_result_t r = {
+                        .kernels = kernels->name,
+                        .stores = stores_names[s],
+                        .threads = threads,
+                        .elements = n,
+                        .seconds = seconds,
+                        .gb_per_s = (double)(3 * sizeof(float) * n) / seconds * 1e-9,
+                        .elements_per_ns = (double)n / seconds * 1e-9,
+                    };
+                    printf("%-8s %-9s %7u %12llu %9llu KB %10.2f %12.3f\n", r.kernels, r.stores, r.threads, (unsigned long long)r.elements,
+                        (unsigned long long)(3 * sizeof(float) * n) >> 10, r.gb_per_s, r.elements_per_ns);
+                    tm_carray_push(results, r, allocator);
+                }
+                threads = threads == settings->max_threads ? 0 : tm_min(2 * threads, settings->max_threads);
+            }
+        }
+    }
+
+    tm_free(allocator, a, max_elements * sizeof(float));
+    tm_free(allocator, b, max_elements * sizeof(float));
+    tm_free(allocator, result, max_elements * sizeof(float));
+    return results;
+}
+
+// Prints the roofline of each kernel set, store type and thread count, from the measurements of the
+// sweep: the compute roof is the best throughput at any size, the memory roof the bandwidth at the
+// largest size. Each element is one float add, so the add does one flop per 12 bytes. It's bound by
+// memory where the ridge point, the intensity at which the roofs meet, is higher than that.
+static void print_roofline(const bench_result_t *results, const bench_settings_t *settings)
+{
+    const double flops_per_element = 1.0;
+    const double add_intensity = flops_per_element / (3 * sizeof(float));
+
+    printf("\nRoofline, the add does %.3f flop/byte", add_intensity);
+    if (settings->max_bytes <= cpu_kernels__llc_size())
+        printf(" (the largest working set fits in the %llu KB last-level cache, so the memory roof is the cache's)",
+            (unsigned long long)(cpu_kernels__llc_size() >> 10));
+    printf(":\n%-8s %-9s %7s %12s %12s %14s %8s\n", "kernels", "stores", "threads", "peak GFLOP/s", "memory GB/s", "ridge flop/B", "bound");
+
+    const bench_result_t *end = tm_carray_end(results);
+    for (const bench_result_t *first = results; first != end;) {
+        const bench_result_t *last = first;
+        double peak = 0.0;
+        for (; last != end && last->threads == first->threads && !strcmp(last->stores, first->stores) && !strcmp(last->kernels, first->kernels); ++last)
+            peak = tm_max(peak, last->elements_per_ns);
+        const double peak_gflops = peak * flops_per_element;
+        const double memory = last[-1].gb_per_s;
+        const double ridge = peak_gflops / memory;
+        // The ridge is above the add's intensity exactly when some smaller working set ran faster
+        // than the largest one. Comparing the throughputs directly keeps rounding in the division
+        // from deciding the tie where the largest size is the fastest.
+        printf("%-8s %-9s %7u %12.3f %12.2f %14.3f %8s\n", first->kernels, first->stores, first->threads, peak_gflops, memory, ridge,
+            peak > last[-1].elements_per_ns ? "memory" : "compute");
+        first = last;
+    }
+}
+
+static bool write_csv(const bench_result_t *results, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+    fprintf(f, "kernels,stores,threads,elements,bytes,seconds,gb_per_s,elements_per_ns\n");
+    for (const bench_result_t *r = results; r != tm_carray_end(results); ++r)
+        fprintf(f, "%s,%s,%u,%llu,%llu,%.9g,%.6g,%.6g\n", r->kernels, r->stores, r->threads, (unsigned long long)r->elements,
+            (unsigned long long)(3 * sizeof(float) * r->elements), r->seconds, r->gb_per_s, r->elements_per_ns);
+    fclose(f);
+    return true;
+}
+
+static bool write_json(const bench_result_t *results, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return false;
+    fprintf(f, "{\n  \"results\": [");
+    for (const bench_result_t *r = results; r != tm_carray_end(results); ++r) {
+        fprintf(f, "%s\n    { \"kernels\": \"%s\", \"stores\": \"%s\", \"threads\": %u, \"elements\": %llu, \"bytes\": %llu, "
+                   "\"seconds\": %.9g, \"gb_per_s\": %.6g, \"elements_per_ns\": %.6g }",
+            r == results ? "" : ",", r->kernels, r->stores, r->threads, (unsigned long long)r->elements,
+            (unsigned long long)(3 * sizeof(float) * r->elements), r->seconds, r->gb_per_s, r->elements_per_ns);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    return true;
+}
+
+// Compares `results` with the baseline CSV and prints the ones that got slower by more than the
+// threshold. Returns the number of regressions.
+static uint32_t check_baseline(const bench_result_t *results, const bench_settings_t *settings)
+{
+    FILE *f = fopen(settings->baseline_path, "r");
+    if (!f) {
+        printf("Could not open baseline `%s`\n", settings->baseline_path);
+        return 1;
+    }
+
+    uint32_t num_compared = 0, num_regressions = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char kernels[32], stores[32];
+        uint32_t threads;
+        unsigned long long elements;
+        double gb_per_s;
+        if (sscanf(line, "%31[^,],%31[^,],%u,%llu,%*[^,],%*[^,],%lg", kernels, stores, &threads, &elements, &gb_per_s) != 5)
+            continue;
+        for (const bench_result_t *r = results; r != tm_carray_end(results); ++r) {
+            if (r->threads != threads || r->elements != elements || strcmp(r->kernels, kernels) || strcmp(r->stores, stores))
+                continue;
+            ++num_compared;
+            if (r->gb_per_s < gb_per_s * (1.0 - settings->threshold)) {
+                printf("Regression: %s %s, %u threads, %llu elements: %.2f GB/s, baseline %.2f GB/s (%+.1f%%)\n", kernels, stores,
+                    threads, elements, r->gb_per_s, gb_per_s, (r->gb_per_s / gb_per_s - 1.0) * 100.0);
+                ++num_regressions;
+            }
+            break;
+        }
+    }
+    fclose(f);
+
+    printf("%u of %u results compared with `%s` are more than %.1f%% slower\n", num_regressions, num_compared,
+        settings->baseline_path, settings->threshold * 100.0);
+    return num_regressions;
+}
+
+typedef struct run_bench_t
+{
+    const bench_settings_t *settings;
+    tm_allocator_i *allocator;
+    int exit_code;
+    TM_PAD(4);
+} run_bench_t;
+
+static void run_bench(void *data)
+{
+    run_bench_t *run = (run_bench_t *)data;
+    const bench_settings_t *settings = run->settings;
+
+    bench_result_t *results = run_sweep(settings, run->allocator);
+    print_roofline(results, settings);
+
+    if (settings->csv_path && !write_csv(results, settings->csv_path)) {
+        printf("Could not write `%s`\n", settings->csv_path);
+        run->exit_code = 1;
+    }
+    if (settings->json_path && !write_json(results, settings->json_path)) {
+        printf("Could not write `%s`\n", settings->json_path);
+        run->exit_code = 1;
+    }
+    if (settings->baseline_path && check_baseline(results, settings))
+        run->exit_code = 1;
+
+    tm_carray_free(results, run->allocator);
+}
+
+static void print_usage(void)
+{
+    printf("adder-bench [options]\n"
+           "  --min-bytes N     Smallest working set of the three arrays (default 12 KB)\n"
+           "  --max-bytes N     Largest working set (default 3 GB)\n"
+           "  --threads N       Job system workers and the most threads to run on (default all cores)\n"
+           "  --kernels LIST    Comma-separated kernel sets to run (default all supported)\n"
+           "  --min-time S      Least time to repeat each measurement for (default 0.05)\n"
+           "  --csv PATH        Write the results as CSV\n"
+           "  --json PATH       Write the results as JSON\n"
+           "  --baseline PATH   Compare with the CSV of an earlier run, exit with 1 on regressions\n"
+           "  --threshold P     Percent slower than the baseline that counts as a regression (default 10)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    tm_allocator_i allocator = tm_allocator_api->create_child(tm_allocator_api->system, "adder_bench");
+    tm_init_global_api_registry(&allocator);
+    tm_register_all_foundation_apis(tm_global_api_registry);
+
+    bench_settings_t settings = {
+        .min_bytes = 12 * 1024,
+        .max_bytes = 3ULL * 1024 * 1024 * 1024,
+        .max_threads = tm_os_api->info->num_logical_processors(),
+        .min_time = 0.05,
+        .threshold = 0.1,
+    };
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--min-bytes") && i + 1 < argc)
+            settings.min_bytes = strtoull(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--max-bytes") && i + 1 < argc)
+            settings.max_bytes = strtoull(argv[++i], 0, 0);
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            settings.max_threads = (uint32_t)strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "--kernels") && i + 1 < argc)
+            settings.kernels = argv[++i];
+        else if (!strcmp(argv[i], "--min-time") && i + 1 < argc)
+            settings.min_time = strtod(argv[++i], 0);
+        else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+            settings.csv_path = argv[++i];
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            settings.json_path = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            settings.baseline_path = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+            settings.threshold = strtod(argv[++i], 0) / 100.0;
+        else {
+            print_usage();
+            return strcmp(argv[i], "--help") ? 1 : 0;
+        }
+    }
+    settings.min_bytes = tm_max(settings.min_bytes, 3 * sizeof(float));
+    settings.max_bytes = tm_max(settings.max_bytes, settings.min_bytes);
+    settings.max_threads = tm_max(settings.max_threads, 1);
+
+    // No limit on the number of workers here, unlike the sample's host, since the sweep is meant to
+    // find where adding threads stops paying off.
+    struct tm_job_system_api *job_system = tm_create_job_system(tm_os_api->thread, settings.max_threads, 128, 128 * 1024);
+    tm_job_system_api = job_system;
+
+    // The parallel-fors wait on fibers, so the benchmark runs as a job, as the host does with the
+    // application.
+    run_bench_t run = { .settings = &settings, .allocator = &allocator };
+    if (TM_IS_DEFINED(TM_NO_MAIN_FIBER))
+        run_bench(&run);
+    else {
+        tm_jobdecl_t j = { .task = run_bench, .data = &run };
+        tm_atomic_counter_o *completed = job_system->run_jobs(&j, 1);
+        job_system->wait_for_counter_and_free_from_os_thread(completed, 0.0);
+    }
+
+    tm_destroy_job_system(job_system);
+    tm_shutdown_global_api_registry(&allocator);
+    tm_allocator_api->destroy_child(&allocator);
+    return run.exit_code;
+}